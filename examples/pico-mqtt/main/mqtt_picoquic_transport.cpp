@@ -14,9 +14,16 @@
 #include <picoquic_packet_loop.h>
 #include "picoquic_bbr.h"
 #include "picoquic_esp_log.h"
+#include "picoquic_esp_metrics.h"
+#include "picoquic_esp_latency.h"
+#include "picoquic_esp_profile.h"
+#include "picoquic_dns_cache.h"
 
 #include "esp_log.h"
 #include "esp_timer.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "picoquic_esp_udp.h"
+#endif
 
 namespace {
 
@@ -25,10 +32,50 @@ static const char *TAG = "mqtt_picoquic_transport";
 static constexpr const char *kAlpn = "mqtt";
 static constexpr size_t kMaxBuffered = 256 * 1024; // safety cap (RX+TX)
 
+#if !CONFIG_IDF_TARGET_LINUX
+// Raw UDP network task: a wake up is a task notification, not a loopback datagram
+using net_thread_t = picoquic_esp_udp_thread_t;
+
+static net_thread_t *net_start(picoquic_quic_t *quic, picoquic_packet_loop_param_t *param,
+                               picoquic_packet_loop_cb_fn loop_callback, void *loop_callback_ctx, int *ret)
+{
+    return picoquic_esp_udp_start_network_thread(quic, param, loop_callback, loop_callback_ctx, ret);
+}
+
+static void net_wake_up(net_thread_t *net)
+{
+    (void)picoquic_esp_udp_wake_up_network_thread(net);
+}
+
+static void net_delete(net_thread_t *net)
+{
+    (void)picoquic_esp_udp_delete_network_thread(net);
+}
+#else
+using net_thread_t = picoquic_network_thread_ctx_t;
+
+static net_thread_t *net_start(picoquic_quic_t *quic, picoquic_packet_loop_param_t *param,
+                               picoquic_packet_loop_cb_fn loop_callback, void *loop_callback_ctx, int *ret)
+{
+    return picoquic_start_network_thread(quic, param, loop_callback, loop_callback_ctx, ret);
+}
+
+static void net_wake_up(net_thread_t *net)
+{
+    (void)picoquic_wake_up_network_thread(net);
+}
+
+static void net_delete(net_thread_t *net)
+{
+    (void)picoquic_wake_up_network_thread(net);
+    picoquic_delete_network_thread(net);
+}
+#endif
+
 struct picoquic_mqtt_ctx {
     picoquic_quic_t *quic = nullptr;
     picoquic_cnx_t *cnx = nullptr;
-    picoquic_network_thread_ctx_t *net = nullptr;
+    net_thread_t *net = nullptr;
     picoquic_packet_loop_param_t loop_param = {};
 
     uint64_t stream_id = UINT64_MAX;
@@ -42,12 +89,18 @@ struct picoquic_mqtt_ctx {
 
     std::vector<uint8_t> rx;
     std::vector<uint8_t> tx;
+    // Bytes written to the stream so far, the end offset of the last write
+    uint64_t tx_offset = 0;
+    // Time at which tx became non-empty, for the write-to-wire latency log
+    int64_t tx_queued_us = 0;
+
+    // Handshake, RTT and write-to-ack histograms, kept across reconnections
+    picoquic_esp_metrics_t metrics = {};
+    picoquic_esp_latency_t latency = {};
 };
 
 static int loop_cb(picoquic_quic_t *quic, picoquic_packet_loop_cb_enum cb_mode, void *callback_ctx, void *callback_arg)
 {
-    (void)quic;
-    (void)callback_arg;
     auto *ctx = (picoquic_mqtt_ctx *)callback_ctx;
     if (!ctx) {
         return PICOQUIC_ERROR_UNEXPECTED_ERROR;
@@ -70,6 +123,18 @@ static int loop_cb(picoquic_quic_t *quic, picoquic_packet_loop_cb_enum cb_mode,
         if (ctx->closed) {
             return PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP;
         }
+        if (ctx->tx_queued_us != 0 && *(size_t *)callback_arg > 0) {
+            ESP_LOGD(TAG, "write to wire: %" PRId64 " us", esp_timer_get_time() - ctx->tx_queued_us);
+            ctx->tx_queued_us = 0;
+        }
+        return 0;
+    }
+
+    if (cb_mode == picoquic_packet_loop_after_receive) {
+        std::unique_lock<std::mutex> lk(ctx->mu);
+        if (ctx->cnx != nullptr) {
+            picoquic_esp_latency_check_acked(&ctx->latency, ctx->cnx, picoquic_get_quic_time(quic));
+        }
         return 0;
     }
 
@@ -189,13 +254,18 @@ static int tp_connect(esp_transport_handle_t t, const char *host, int port, int
         ctx->stream_id = UINT64_MAX;
         ctx->rx.clear();
         ctx->tx.clear();
+        ctx->tx_offset = 0;
+        ctx->tx_queued_us = 0;
+        // Writes left unacknowledged by the previous connection are not measured
+        ctx->latency.write_tail = ctx->latency.write_head;
     }
 
     struct sockaddr_storage server_address;
     int is_name = 0;
-    int ret = picoquic_get_server_address(host, port, &server_address, &is_name);
+    // Reconnects are served from the resolver cache, refreshed in the background
+    int ret = picoquic_dns_cache_get_server_address(host, port, &server_address, &is_name);
     if (ret != 0) {
-        ESP_LOGE(TAG, "picoquic_get_server_address(%s:%d) failed: %d", host, port, ret);
+        ESP_LOGE(TAG, "picoquic_dns_cache_get_server_address(%s:%d) failed: %d", host, port, ret);
         errno = EHOSTUNREACH;
         return -1;
     }
@@ -211,9 +281,13 @@ static int tp_connect(esp_transport_handle_t t, const char *host, int port, int
         errno = ENOMEM;
         return -1;
     }
-    picoquic_set_default_congestion_algorithm(ctx->quic, picoquic_bbr_algorithm);
+    // Unchanged unless CONFIG_PICOQUIC_PROFILING is set
+    picoquic_set_default_congestion_algorithm(ctx->quic, picoquic_esp_profile_congestion_algorithm(picoquic_bbr_algorithm));
     picoquic_set_log_level(ctx->quic, 1);
     (void)picoquic_set_esp_log(ctx->quic, TAG, 0 /* log_packets */);
+    if (picoquic_set_esp_metrics(ctx->quic, &ctx->metrics) == 0) {
+        picoquic_esp_metrics_set_latency(&ctx->metrics, &ctx->latency);
+    }
 
     ctx->cnx = picoquic_create_cnx(ctx->quic,
                                   picoquic_null_connection_id,
@@ -249,9 +323,9 @@ static int tp_connect(esp_transport_handle_t t, const char *host, int port, int
     ctx->loop_param.dest_if = 0;
 
     int thread_ret = 0;
-    ctx->net = picoquic_start_network_thread(ctx->quic, &ctx->loop_param, loop_cb, ctx, &thread_ret);
+    ctx->net = net_start(ctx->quic, &ctx->loop_param, loop_cb, ctx, &thread_ret);
     if (ctx->net == nullptr || thread_ret != 0) {
-        ESP_LOGE(TAG, "picoquic_start_network_thread failed: %d", thread_ret);
+        ESP_LOGE(TAG, "network thread start failed: %d", thread_ret);
         picoquic_free(ctx->quic);
         ctx->quic = nullptr;
         ctx->cnx = nullptr;
@@ -282,8 +356,8 @@ static int tp_connect(esp_transport_handle_t t, const char *host, int port, int
 
     // At this point picoquic reported the connection as ready.
     // If we have a cached session ticket, picoquic may send 0-RTT packets.
-    // We don't have a public picoquic API to query 0-RTT acceptance here,
-    // so the easiest demo signal is the handshake completion latency.
+    // The latency histograms, printed on close, split handshakes with and
+    // without 0-RTT.
     ESP_LOGI(TAG, "tp_connect completed in %" PRIu64 " ms", (esp_timer_get_time() / 1000) - start_ms);
 
     return 0;
@@ -386,12 +460,17 @@ static int tp_write(esp_transport_handle_t t, const char *buffer, int len, int t
     size_t old = ctx->tx.size();
     ctx->tx.resize(old + (size_t)len);
     memcpy(ctx->tx.data() + old, buffer, (size_t)len);
+    if (old == 0 && ctx->tx_queued_us == 0) {
+        ctx->tx_queued_us = esp_timer_get_time();
+    }
+    ctx->tx_offset += (uint64_t)len;
+    picoquic_esp_latency_on_write(&ctx->latency, ctx->stream_id, ctx->tx_offset, picoquic_current_time());
 
     // Wake the network thread so it can mark stream active and flush tx.
-    picoquic_network_thread_ctx_t *net = ctx->net;
+    net_thread_t *net = ctx->net;
     lk.unlock();
     if (net) {
-        (void)picoquic_wake_up_network_thread(net);
+        net_wake_up(net);
     }
     return len;
 }
@@ -417,7 +496,7 @@ static int tp_close(esp_transport_handle_t t)
         return 0;
     }
 
-    picoquic_network_thread_ctx_t *net = nullptr;
+    net_thread_t *net = nullptr;
     picoquic_cnx_t *cnx = nullptr;
     picoquic_quic_t *quic = nullptr;
     {
@@ -445,11 +524,14 @@ static int tp_close(esp_transport_handle_t t)
     }
 
     if (net) {
-        (void)picoquic_wake_up_network_thread(net);
-        picoquic_delete_network_thread(net);
+        net_delete(net);
         ctx->net = nullptr;
     }
     if (quic) {
+        picoquic_esp_latency_log(&ctx->latency, TAG);
+#if CONFIG_PICOQUIC_PROFILING
+        picoquic_esp_profile_log(TAG);
+#endif
         picoquic_free(quic);
         ctx->quic = nullptr;
         ctx->cnx = nullptr;
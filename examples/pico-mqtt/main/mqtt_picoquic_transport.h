@@ -12,7 +12,8 @@ extern "C" {
  *
  * Notes:
  * - QUIC TLS ALPN is set to "mqtt"
- * - A background picoquic network thread is used (picoquic_start_network_thread)
+ * - A background picoquic network thread is used (picoquic_start_network_thread on Linux, the lwIP raw UDP
+ *   network task picoquic_esp_udp_start_network_thread on ESP32 targets)
  * - The returned transport is owned by the MQTT client and destroyed by esp_mqtt_client_destroy()
  */
 esp_transport_handle_t esp_transport_picoquic_mqtt_init(void);
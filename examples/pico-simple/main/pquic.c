@@ -35,6 +35,8 @@
 #include <picoquic_packet_loop.h>
 #include "picoquic_bbr.h"
 #include "picoquic_esp_log.h"
+#include "picoquic_dns_cache.h"
+#include "picoquic_socket_loop.h"
 #include "esp_log.h"
 
 #define PICOQUIC_SAMPLE_ALPN "picoquic_sample"
@@ -516,7 +518,7 @@ static int sample_client_init(char const* server_name, int server_port,
     if (ret == 0) {
         int is_name = 0;
 
-        ret = picoquic_get_server_address(server_name, server_port, server_address, &is_name);
+        ret = picoquic_dns_cache_get_server_address(server_name, server_port, server_address, &is_name);
         if (ret != 0) {
             ESP_LOGE(TAG, "Cannot get the IP address for <%s> port <%d>", server_name, server_port);
         }
@@ -599,7 +601,13 @@ int picoquic_sample_client(char const * server_name, int server_port,
         }
     }
 
+#if CONFIG_PICOQUIC_SOCKET_LOOP
+    picoquic_packet_loop_param_t loop_param = { 0 };
+    loop_param.local_af = server_address.ss_family;
+    ret = picoquic_socket_packet_loop(quic, &loop_param, sample_client_loop_cb, &client_ctx);
+#else
     ret = picoquic_packet_loop(quic, 0, server_address.ss_family, 0, 0, 0, sample_client_loop_cb, &client_ctx);
+#endif
     if (ret != 0) {
         ESP_LOGW(TAG, "picoquic_packet_loop returned %d (%s)", ret, picoquic_error_name((uint64_t)ret));
     }
@@ -0,0 +1,54 @@
+/*
+ * Picoquic resolver cache
+ *
+ * Caches the results of picoquic_get_server_addresses() for reconnects.
+ * Entries are fresh for CONFIG_PICOQUIC_DNS_CACHE_TTL_S seconds. After that,
+ * they are still served for up to CONFIG_PICOQUIC_DNS_CACHE_MAX_STALE_S
+ * seconds, while a background thread refreshes them (serve-stale, RFC 8767).
+ * Stale entries are also served if a blocking lookup fails. A blocking
+ * lookup makes a single query for both families; on lwIP, which answers it
+ * with one family only, the other one is added by a background refresh.
+ *
+ * getaddrinfo() does not report the record TTL, so the configured TTL is used
+ * for all entries. On lwIP, the stack's own DNS table still honors the record
+ * TTL for the refresh lookups.
+ *
+ * The cache is shared by all connections and is thread safe.
+ */
+
+#ifndef PICOQUIC_DNS_CACHE_H
+#define PICOQUIC_DNS_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picosocks.h"
+
+/* Drop-in replacement for picoquic_get_server_address(), served from the cache.
+ *
+ * Returns 0 on success, -1 if the name cannot be resolved.
+ */
+int picoquic_dns_cache_get_server_address(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_address, int* is_name);
+
+/* Cached version of picoquic_get_server_addresses(), IPv6 first.
+ *
+ * Returns the number of addresses found, 0 if the name cannot be resolved.
+ */
+int picoquic_dns_cache_get_server_addresses(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_addresses, int max_addresses, int* is_name);
+
+/* Start resolving a name in the background, e.g. at startup or when the
+ * network comes up, so that the first connection finds it in the cache.
+ */
+void picoquic_dns_cache_prefetch(const char* name);
+
+/* Remove all entries, e.g. after a change of network. */
+void picoquic_dns_cache_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_DNS_CACHE_H */
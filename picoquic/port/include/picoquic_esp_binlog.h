@@ -0,0 +1,119 @@
+/*
+ * Picoquic ESP-IDF binary logging backend
+ *
+ * An alternative to picoquic_set_esp_log() for production builds: each
+ * logging event is stored as a fixed-size, timestamped binary record in a
+ * RAM or PSRAM ring buffer, without any string formatting. Writers reserve
+ * records with an atomic increment, so several contexts (e.g. the shards of
+ * a sharded server) can share one ring without locking.
+ *
+ * The ring is retrieved with picoquic_esp_binlog_dump(), and converted to
+ * qlog on the host with scripts/picoquic_binlog_to_qlog.py.
+ */
+
+#ifndef PICOQUIC_ESP_BINLOG_H
+#define PICOQUIC_ESP_BINLOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picoquic.h"
+
+#define PICOQUIC_ESP_BINLOG_MAGIC "PQBL"
+#define PICOQUIC_ESP_BINLOG_VERSION 1
+/* Number of distinct loss triggers names kept in the dump header */
+#define PICOQUIC_ESP_BINLOG_MAX_TRIGGERS 16
+#define PICOQUIC_ESP_BINLOG_TRIGGER_LEN 16
+
+typedef enum {
+    picoquic_esp_binlog_event_pdu = 1,
+    picoquic_esp_binlog_event_packet,
+    picoquic_esp_binlog_event_dropped,
+    picoquic_esp_binlog_event_buffered,
+    picoquic_esp_binlog_event_sent,
+    picoquic_esp_binlog_event_lost,
+    picoquic_esp_binlog_event_new_connection,
+    picoquic_esp_binlog_event_close_connection,
+    picoquic_esp_binlog_event_cc_dump,
+    picoquic_esp_binlog_event_app_message
+} picoquic_esp_binlog_event_enum;
+
+/* Record flags */
+#define PICOQUIC_ESP_BINLOG_FLAG_RECEIVING 0x01
+
+/* One event, 40 bytes, little endian as stored by the target.
+ *
+ * - seq: write index + 1, written last; 0 while the record is being written.
+ * - ptype: picoquic_packet_type_enum, or 0xFF if unknown.
+ * - arg: loss trigger index for lost packets, congestion control state for
+ *   cc dumps.
+ * - length: packet length, or bytes in transit for cc dumps.
+ * - arg32: path id for PDUs, error code for dropped packets, smoothed RTT
+ *   for cc dumps.
+ * - number: packet number, congestion window for cc dumps, or the format
+ *   string address of app messages.
+ */
+typedef struct st_picoquic_esp_binlog_record_t {
+    uint32_t seq;
+    uint8_t event;
+    uint8_t ptype;
+    uint8_t flags;
+    uint8_t arg;
+    uint32_t length;
+    uint32_t arg32;
+    uint64_t time;
+    uint64_t cid64;
+    uint64_t number;
+} picoquic_esp_binlog_record_t;
+
+/* Dump header, followed by nb_records records in ring order. */
+typedef struct st_picoquic_esp_binlog_header_t {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t nb_records;
+    uint32_t head;
+    uint64_t dump_time;
+    char triggers[PICOQUIC_ESP_BINLOG_MAX_TRIGGERS][PICOQUIC_ESP_BINLOG_TRIGGER_LEN];
+} picoquic_esp_binlog_header_t;
+
+typedef struct st_picoquic_esp_binlog_t picoquic_esp_binlog_t;
+
+/* Create a ring of nb_records records, rounded up to a power of 2.
+ *
+ * - use_psram: allocate the records in PSRAM if available, else in RAM.
+ *
+ * Returns NULL on error.
+ */
+picoquic_esp_binlog_t* picoquic_esp_binlog_create(size_t nb_records, int use_psram);
+
+/* Free the ring. It must no longer be installed in a quic context. */
+void picoquic_esp_binlog_delete(picoquic_esp_binlog_t* binlog);
+
+/* Route the unified logging events of quic to the ring.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int picoquic_set_esp_binlog(picoquic_quic_t* quic, picoquic_esp_binlog_t* binlog);
+
+/* Number of records written since the ring was created. */
+uint32_t picoquic_esp_binlog_get_count(picoquic_esp_binlog_t* binlog);
+
+/* Write the dump header and the records through write_fn, in chunks.
+ *
+ * Records keep being written during the dump. Those that may have been
+ * overwritten while being copied are dumped with seq 0, and ignored by the
+ * decoder.
+ *
+ * Returns 0 on success, or the first non zero value returned by write_fn.
+ */
+typedef int (*picoquic_esp_binlog_write_fn)(void* write_ctx, const uint8_t* data, size_t length);
+
+int picoquic_esp_binlog_dump(picoquic_esp_binlog_t* binlog, picoquic_esp_binlog_write_fn write_fn, void* write_ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_ESP_BINLOG_H */
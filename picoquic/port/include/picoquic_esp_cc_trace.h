@@ -0,0 +1,93 @@
+/*
+ * Picoquic ESP-IDF congestion control trace
+ *
+ * Records a time series of the congestion control state of the connections
+ * (congestion window, bytes in flight, min and smoothed RTT, pacing rate,
+ * and the state reported by the algorithm, e.g. the BBR state) into a
+ * fixed-size ring. Samples are taken on the cc dump events of the ESP
+ * logging backends, so picoquic_set_esp_log(), picoquic_set_esp_binlog() or
+ * picoquic_set_esp_metrics() must be installed, and exported as CSV or qlog
+ * on demand. With esp_log or binlog alone, picoquic only reports cc dump
+ * events for the first packets of each connection unless the log level is
+ * raised, which picoquic_set_esp_cc_trace() does.
+ */
+
+#ifndef PICOQUIC_ESP_CC_TRACE_H
+#define PICOQUIC_ESP_CC_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picoquic.h"
+
+/* One sample, 56 bytes */
+typedef struct st_picoquic_esp_cc_sample_t {
+    uint32_t seq; /* write index + 1, 0 while the sample is being written */
+    uint32_t cc_state; /* first value reported by the algorithm's alg_observe() */
+    uint64_t time;
+    uint64_t cid64;
+    uint64_t cwin;
+    uint64_t bytes_in_transit;
+    uint32_t rtt_min;
+    uint32_t smoothed_rtt;
+    uint64_t pacing_rate; /* bytes per second */
+} picoquic_esp_cc_sample_t;
+
+typedef struct st_picoquic_esp_cc_trace_t picoquic_esp_cc_trace_t;
+
+/* Create a ring of nb_samples samples, rounded up to a power of 2.
+ *
+ * - min_interval: minimum time between two samples of the same connection,
+ *   in microseconds, unless the congestion control state changes. cc dump
+ *   events can occur for every packet sent.
+ * - use_psram: allocate the samples in PSRAM if available, else in RAM.
+ *
+ * Returns NULL on error.
+ */
+picoquic_esp_cc_trace_t* picoquic_esp_cc_trace_create(size_t nb_samples, uint64_t min_interval, int use_psram);
+
+/* Free the ring. It must no longer be installed. */
+void picoquic_esp_cc_trace_delete(picoquic_esp_cc_trace_t* trace);
+
+/* Start recording into trace, or stop if trace is NULL.
+ *
+ * Starting sets the log level of quic to 1, as picoquic_set_esp_metrics()
+ * does, so that cc dump events are reported for every packet and not only
+ * the first ones of each connection. Stopping does not restore it.
+ */
+void picoquic_set_esp_cc_trace(picoquic_quic_t* quic, picoquic_esp_cc_trace_t* trace);
+
+/* Take a sample of cnx, if a trace is installed. Called by the cc dump
+ * handlers of the logging backends and metrics. */
+void picoquic_esp_cc_trace_sample(picoquic_cnx_t* cnx, uint64_t current_time);
+
+/* Copy the sample of rank `index`, 0 being the oldest still in the ring.
+ *
+ * Returns 0, or -1 if there is no such sample.
+ */
+int picoquic_esp_cc_trace_get(picoquic_esp_cc_trace_t* trace, uint32_t index, picoquic_esp_cc_sample_t* sample);
+
+/* Number of samples in the ring. */
+uint32_t picoquic_esp_cc_trace_get_count(picoquic_esp_cc_trace_t* trace);
+
+/* Write the samples, oldest first, through write_fn.
+ *
+ * The CSV export has one header line, then one line per sample. The qlog
+ * export is a JSON qlog 0.3 file with a single trace, made of
+ * recovery:metrics_updated and recovery:congestion_state_updated events
+ * whose group_id is the connection cid64.
+ *
+ * Returns 0 on success, or the first non zero value returned by write_fn.
+ */
+typedef int (*picoquic_esp_cc_trace_write_fn)(void* write_ctx, const uint8_t* data, size_t length);
+
+int picoquic_esp_cc_trace_export_csv(picoquic_esp_cc_trace_t* trace, picoquic_esp_cc_trace_write_fn write_fn, void* write_ctx);
+
+int picoquic_esp_cc_trace_export_qlog(picoquic_esp_cc_trace_t* trace, picoquic_esp_cc_trace_write_fn write_fn, void* write_ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_ESP_CC_TRACE_H */
@@ -0,0 +1,115 @@
+/*
+ * Picoquic ESP-IDF latency histograms
+ *
+ * Log-linear histograms of fixed size (HDR style: 16 linear sub-buckets per
+ * power of 2, so values are kept within 6.25%), with merge and percentile
+ * queries, and a latency collector made of four of them:
+ *
+ * - handshake duration, split between handshakes that did or did not use
+ *   0-RTT, from the creation of the connection to the ready state;
+ * - RTT samples, one per new sample taken by picoquic on acknowledgements;
+ * - write to acknowledgement, from the time the application writes data to
+ *   the time that data is acknowledged.
+ *
+ * The handshake and RTT histograms are fed by the metrics module, see
+ * picoquic_esp_metrics_set_latency(), on packet events: they get no samples
+ * if CONFIG_PICOQUIC_LOG_HOOKS_NO_PACKETS is set. The write to
+ * acknowledgement one is fed by the application, which knows when and where
+ * in the stream data is written.
+ *
+ * All values are in microseconds. Histograms are updated without locks by
+ * the network thread; reading them from another task may give slightly
+ * inconsistent counts, copy them with picoquic_esp_histogram_merge() first if
+ * that matters.
+ */
+
+#ifndef PICOQUIC_ESP_LATENCY_H
+#define PICOQUIC_ESP_LATENCY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picoquic.h"
+
+#define PICOQUIC_ESP_HISTOGRAM_SUB_BITS 4
+#define PICOQUIC_ESP_HISTOGRAM_SUB_COUNT (1 << PICOQUIC_ESP_HISTOGRAM_SUB_BITS)
+/* Values from 2^28 us (about 4.5 minutes) go to the last bucket */
+#define PICOQUIC_ESP_HISTOGRAM_MAX_BITS 28
+#define PICOQUIC_ESP_HISTOGRAM_NB_BUCKETS \
+    ((PICOQUIC_ESP_HISTOGRAM_MAX_BITS - PICOQUIC_ESP_HISTOGRAM_SUB_BITS + 1) * PICOQUIC_ESP_HISTOGRAM_SUB_COUNT)
+
+/* Number of application writes waiting for their acknowledgement */
+#define PICOQUIC_ESP_LATENCY_MAX_WRITES 32
+
+typedef struct st_picoquic_esp_histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[PICOQUIC_ESP_HISTOGRAM_NB_BUCKETS];
+} picoquic_esp_histogram_t;
+
+void picoquic_esp_histogram_reset(picoquic_esp_histogram_t* histogram);
+
+void picoquic_esp_histogram_record(picoquic_esp_histogram_t* histogram, uint64_t value);
+
+/* Add the values of src to dst. */
+void picoquic_esp_histogram_merge(picoquic_esp_histogram_t* dst, const picoquic_esp_histogram_t* src);
+
+/* Value below which `percentile` percent of the recorded values fall, e.g.
+ * 99.0 for p99, rounded up to the end of its bucket.
+ *
+ * Returns 0 if the histogram is empty.
+ */
+uint64_t picoquic_esp_histogram_percentile(const picoquic_esp_histogram_t* histogram, double percentile);
+
+/* Print count, min, p50, p90, p99, p99.9 and max with ESP_LOGI(). */
+void picoquic_esp_histogram_log(const picoquic_esp_histogram_t* histogram, const char* tag, const char* name);
+
+typedef struct st_picoquic_esp_latency_t {
+    picoquic_esp_histogram_t handshake_1rtt;
+    picoquic_esp_histogram_t handshake_0rtt;
+    picoquic_esp_histogram_t rtt;
+    picoquic_esp_histogram_t write_to_ack;
+    /* Pending writes, a single producer single consumer ring */
+    struct {
+        uint64_t write_time;
+        uint64_t stream_id;
+        uint64_t end_offset;
+    } writes[PICOQUIC_ESP_LATENCY_MAX_WRITES];
+    uint32_t write_head;
+    uint32_t write_tail;
+    uint32_t writes_dropped;
+} picoquic_esp_latency_t;
+
+void picoquic_esp_latency_reset(picoquic_esp_latency_t* latency);
+
+/* Record the handshake duration of cnx, which just became ready. */
+void picoquic_esp_latency_on_ready(picoquic_esp_latency_t* latency, picoquic_cnx_t* cnx, uint64_t current_time);
+
+/* Note that the application wrote data at current_time, on the
+ * picoquic_current_time() clock, up to end_offset on stream_id: end_offset
+ * is the total number of bytes written to the stream so far. Can be called
+ * from the application task. Writes are dropped and counted if
+ * PICOQUIC_ESP_LATENCY_MAX_WRITES are already pending.
+ */
+void picoquic_esp_latency_on_write(picoquic_esp_latency_t* latency, uint64_t stream_id, uint64_t end_offset,
+    uint64_t current_time);
+
+/* Complete the pending writes whose data is acknowledged: the peer
+ * acknowledged every byte of their stream up to their end offset, or the
+ * stream was already deleted. Writes complete in order, a write waits for the
+ * writes made before it. Call from the network thread, e.g. after receiving
+ * packets.
+ */
+void picoquic_esp_latency_check_acked(picoquic_esp_latency_t* latency, picoquic_cnx_t* cnx, uint64_t current_time);
+
+/* Print the four histograms with ESP_LOGI(). */
+void picoquic_esp_latency_log(const picoquic_esp_latency_t* latency, const char* tag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_ESP_LATENCY_H */
@@ -18,15 +18,66 @@ extern "C" {
 
 #include "picoquic.h"
 
+/* Event types, for picoquic_esp_log_config_t::event_mask */
+#define PICOQUIC_ESP_LOG_EVENT_APP_MESSAGE 0x0001
+#define PICOQUIC_ESP_LOG_EVENT_PDU 0x0002
+#define PICOQUIC_ESP_LOG_EVENT_PACKET 0x0004
+#define PICOQUIC_ESP_LOG_EVENT_DROPPED 0x0008
+#define PICOQUIC_ESP_LOG_EVENT_BUFFERED 0x0010
+#define PICOQUIC_ESP_LOG_EVENT_OUTGOING 0x0020
+#define PICOQUIC_ESP_LOG_EVENT_LOST 0x0040
+#define PICOQUIC_ESP_LOG_EVENT_HANDSHAKE 0x0080 /* ALPN, transport parameters, tickets */
+#define PICOQUIC_ESP_LOG_EVENT_CONNECTION 0x0100 /* new and closed connections */
+#define PICOQUIC_ESP_LOG_EVENT_CC_DUMP 0x0200
+
+/* Per packet events, subject to packet_sampling */
+#define PICOQUIC_ESP_LOG_EVENTS_PACKETS (PICOQUIC_ESP_LOG_EVENT_PDU | PICOQUIC_ESP_LOG_EVENT_PACKET | PICOQUIC_ESP_LOG_EVENT_OUTGOING)
+#define PICOQUIC_ESP_LOG_EVENTS_ALL 0x03FF
+#define PICOQUIC_ESP_LOG_EVENTS_DEFAULT (PICOQUIC_ESP_LOG_EVENTS_ALL & ~PICOQUIC_ESP_LOG_EVENTS_PACKETS)
+
+/* Maximum number of connections with their own configuration */
+#define PICOQUIC_ESP_LOG_MAX_CNX_CONFIGS 8
+
+typedef struct st_picoquic_esp_log_config_t {
+    const char* tag; /* ESP logging tag, must remain valid. If NULL, a default tag is used. */
+    uint32_t event_mask; /* PICOQUIC_ESP_LOG_EVENT_* to log; 0 silences the context or connection */
+    uint32_t packet_sampling; /* log 1 in N events of each packet event kind; 0 or 1 logs all */
+} picoquic_esp_log_config_t;
+
 /* Enable picoquic unified "text logs" and route them to ESP_LOGx().
  *
  * - tag: ESP logging tag (e.g., "pquic"). If NULL, a default tag is used.
  * - log_packets: if non-zero, emit packet/pdu level logs (can be noisy).
+ *   These events are compiled out if CONFIG_PICOQUIC_LOG_HOOKS_NO_PACKETS is set.
  *
  * Returns 0 on success, or -1 on error (e.g., OOM).
  */
 int picoquic_set_esp_log(picoquic_quic_t* quic, const char* tag, int log_packets);
 
+/* Same as picoquic_set_esp_log(), with a configuration specific to this
+ * context. Up to CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS contexts can log at
+ * the same time. Packet events are logged at DEBUG level: while they are
+ * enabled, the level of the tag is raised to DEBUG, and restored when the
+ * configuration is cleared or stops logging packet events.
+ *
+ * Returns 0 on success, or -1 on error (e.g., too many contexts).
+ */
+int picoquic_set_esp_log_config(picoquic_quic_t* quic, const picoquic_esp_log_config_t* config);
+
+/* Override the configuration of its context for one connection, e.g. to
+ * trace it in full while the other connections stay silent. A NULL config
+ * removes the override; it is also removed when the connection is deleted.
+ *
+ * Returns 0 on success, or -1 on error (e.g., PICOQUIC_ESP_LOG_MAX_CNX_CONFIGS reached).
+ */
+int picoquic_set_esp_log_cnx_config(picoquic_cnx_t* cnx, const picoquic_esp_log_config_t* config);
+
+/* Number of log messages dropped because the log queue was full, if
+ * CONFIG_PICOQUIC_ESP_LOG_ASYNC is set; messages are then formatted on a low
+ * priority task instead of the network task.
+ */
+uint32_t picoquic_esp_log_get_dropped(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,122 @@
+/*
+ * Picoquic ESP-IDF connection metrics
+ *
+ * Counts the unified logging events of a context (packets and bytes in and
+ * out, losses by trigger, drops by error, packets buffered until keys are
+ * available) in totals and per connection, and keeps the RTT, congestion
+ * window and pacing rate of each connection. The metrics are stored in a
+ * caller provided structure, so nothing is allocated once installed.
+ *
+ * The metrics hook in front of the logging backend of the context, which
+ * still receives every event: call picoquic_set_esp_metrics() after
+ * picoquic_set_esp_log() or picoquic_set_esp_binlog(), since installing a
+ * logging backend removes the metrics.
+ *
+ * Picoquic only reports the first packets of a connection unless the log
+ * level is at least 1: picoquic_set_esp_metrics() sets it, for the logging
+ * backend too, and restores the previous level when the metrics are removed.
+ *
+ * The metrics can also feed the handshake and RTT histograms of a latency
+ * collector, see picoquic_esp_metrics_set_latency().
+ */
+
+#ifndef PICOQUIC_ESP_METRICS_H
+#define PICOQUIC_ESP_METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picoquic.h"
+#include "picoquic_esp_latency.h"
+#include "sdkconfig.h"
+
+#ifndef CONFIG_PICOQUIC_ESP_METRICS_MAX_CONNECTIONS
+#define CONFIG_PICOQUIC_ESP_METRICS_MAX_CONNECTIONS 8
+#endif
+
+/* Number of distinct loss triggers and drop errors counted separately;
+ * further ones are counted in the last entry, "other". */
+#define PICOQUIC_ESP_METRICS_MAX_TRIGGERS 8
+#define PICOQUIC_ESP_METRICS_MAX_ERRORS 8
+
+typedef struct st_picoquic_esp_metrics_counters_t {
+    uint64_t packets_received;
+    uint64_t packets_sent;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t packets_lost;
+    uint64_t packets_dropped;
+    uint64_t packets_buffered;
+    uint32_t lost_by_trigger[PICOQUIC_ESP_METRICS_MAX_TRIGGERS + 1];
+    uint32_t dropped_by_error[PICOQUIC_ESP_METRICS_MAX_ERRORS + 1];
+} picoquic_esp_metrics_counters_t;
+
+typedef struct st_picoquic_esp_metrics_cnx_t {
+    picoquic_cnx_t* cnx; /* NULL if the slot is free */
+    uint64_t cid64;
+    uint64_t start_time;
+    picoquic_esp_metrics_counters_t counters;
+    /* Gauges, as of update_time */
+    uint64_t update_time;
+    uint64_t smoothed_rtt;
+    uint64_t cwin;
+    uint64_t pacing_rate; /* bytes per second */
+    uint64_t bytes_in_transit;
+    uint32_t nb_outgoing; /* packets sent, to refresh the gauges periodically */
+    /* Latency collection state */
+    int handshake_recorded;
+    uint64_t last_rtt_sample;
+} picoquic_esp_metrics_cnx_t;
+
+typedef struct st_picoquic_esp_metrics_t {
+    picoquic_quic_t* quic;
+    const struct st_picoquic_unified_logging_t* next_log_fns;
+    picoquic_esp_latency_t* latency;
+    /* Trigger names and error codes of the by_trigger and by_error entries */
+    const char* triggers[PICOQUIC_ESP_METRICS_MAX_TRIGGERS];
+    int errors[PICOQUIC_ESP_METRICS_MAX_ERRORS];
+    int nb_errors;
+    /* All the connections, including closed and untracked ones */
+    picoquic_esp_metrics_counters_t totals;
+    uint64_t nb_connections;
+    uint64_t nb_untracked; /* connections that did not fit in cnx[] */
+    int previous_log_level; /* restored when the metrics are removed */
+    picoquic_esp_metrics_cnx_t cnx[CONFIG_PICOQUIC_ESP_METRICS_MAX_CONNECTIONS];
+} picoquic_esp_metrics_t;
+
+/* Start counting the events of quic into metrics, which is reset and must
+ * remain valid until picoquic_free(quic) or picoquic_set_esp_metrics(quic, NULL).
+ * Up to CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS contexts can have metrics.
+ *
+ * Returns 0 on success, or -1 on error (e.g., too many contexts).
+ */
+int picoquic_set_esp_metrics(picoquic_quic_t* quic, picoquic_esp_metrics_t* metrics);
+
+/* Record the handshake duration of the tracked connections and their new
+ * RTT samples into latency, or stop if latency is NULL. Both are checked on
+ * packet events, so they are recorded at the next packet sent or received,
+ * and consecutive equal RTT samples are counted once. Call after
+ * picoquic_set_esp_metrics(), which resets metrics.
+ */
+void picoquic_esp_metrics_set_latency(picoquic_esp_metrics_t* metrics, picoquic_esp_latency_t* latency);
+
+/* Metrics of a live connection, with its gauges refreshed.
+ *
+ * Returns NULL if the connection is not tracked.
+ */
+const picoquic_esp_metrics_cnx_t* picoquic_esp_metrics_get_cnx(picoquic_esp_metrics_t* metrics, picoquic_cnx_t* cnx);
+
+/* Name of the loss trigger counted in lost_by_trigger[index], or NULL. */
+const char* picoquic_esp_metrics_trigger_name(const picoquic_esp_metrics_t* metrics, int index);
+
+/* Print the totals and the metrics of each tracked connection with ESP_LOGI().
+ * Meant to be called periodically, e.g. from the packet loop callback.
+ */
+void picoquic_esp_metrics_log(picoquic_esp_metrics_t* metrics, const char* tag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_ESP_METRICS_H */
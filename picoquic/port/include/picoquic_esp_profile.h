@@ -0,0 +1,93 @@
+/*
+ * Picoquic ESP-IDF hot path profiling
+ *
+ * With CONFIG_PICOQUIC_PROFILING, the main per-packet stages of picoquic are
+ * wrapped at link time (-Wl,--wrap) and timed with the CPU cycle counter
+ * (esp_cpu_get_cycle_count(), or rdtsc on the x86 Linux target, or
+ * nanoseconds from clock_gettime() on other Linux hosts):
+ *
+ * - incoming: picoquic_incoming_packet_ex(), one received datagram, which
+ *   includes the decryption, header protection, frame and congestion
+ *   control stages below;
+ * - prepare: picoquic_prepare_next_packet_ex(), including calls that find
+ *   nothing to send;
+ * - aead decrypt and aead encrypt: packet payload protection;
+ * - header protection: packet number mask, on both paths;
+ * - frames: picoquic_decode_frames(), frame parsing and processing,
+ *   including ACK frames and the loss recovery they trigger;
+ * - congestion: notifications of the congestion control algorithm, only if
+ *   it is wrapped with picoquic_esp_profile_congestion_algorithm().
+ *
+ * Counters are updated without locks, by a single network thread. The
+ * cycle counter is per core: pin the network task to one core for exact
+ * figures.
+ */
+
+#ifndef PICOQUIC_ESP_PROFILE_H
+#define PICOQUIC_ESP_PROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picoquic.h"
+
+typedef enum {
+    picoquic_esp_profile_incoming = 0,
+    picoquic_esp_profile_prepare,
+    picoquic_esp_profile_aead_decrypt,
+    picoquic_esp_profile_aead_encrypt,
+    picoquic_esp_profile_header_protection,
+    picoquic_esp_profile_frames,
+    picoquic_esp_profile_congestion,
+    picoquic_esp_profile_nb_stages
+} picoquic_esp_profile_stage_enum;
+
+typedef struct st_picoquic_esp_profile_stage_t {
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t bytes; /* bytes processed by the stage, 0 if not relevant */
+} picoquic_esp_profile_stage_t;
+
+typedef struct st_picoquic_esp_profile_t {
+    picoquic_esp_profile_stage_t stages[picoquic_esp_profile_nb_stages];
+    uint64_t packets_received;
+    uint64_t bytes_received;
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+} picoquic_esp_profile_t;
+
+/* Copy the counters accumulated since start or the last reset.
+ *
+ * Returns 0, or -1 if CONFIG_PICOQUIC_PROFILING is not set.
+ */
+int picoquic_esp_profile_get(picoquic_esp_profile_t* profile);
+
+void picoquic_esp_profile_reset(void);
+
+/* Name of a stage, e.g. "aead encrypt", or NULL. */
+const char* picoquic_esp_profile_stage_name(int stage);
+
+/* Unit of the cycle counts: "cycles", or "ns" where no cycle counter is used. */
+const char* picoquic_esp_profile_unit(void);
+
+/* Print, for each stage, the calls, cycles per call, cycles per packet and
+ * cycles per byte processed, with ESP_LOGI(). Receive stages (incoming, aead
+ * decrypt, frames) are divided by the packets received, send stages
+ * (prepare, aead encrypt) by the packets sent, the others by both.
+ */
+void picoquic_esp_profile_log(const char* tag);
+
+/* Returns a copy of alg whose notifications are timed, to pass to
+ * picoquic_set_default_congestion_algorithm() or
+ * picoquic_set_congestion_algorithm(). There is one copy: a new call
+ * replaces the algorithm profiled by the previous one. Returns alg if
+ * CONFIG_PICOQUIC_PROFILING is not set.
+ */
+const picoquic_congestion_algorithm_t* picoquic_esp_profile_congestion_algorithm(const picoquic_congestion_algorithm_t* alg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_ESP_PROFILE_H */
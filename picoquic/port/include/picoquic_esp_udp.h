@@ -0,0 +1,148 @@
+/*
+ * Picoquic ESP-IDF lwIP raw UDP transport
+ *
+ * An alternative to the BSD socket emulation on ESP32 targets. Datagrams are
+ * received in lwIP's raw UDP callback (in the TCP/IP task), posted as pbufs
+ * to a FreeRTOS queue, and handed to picoquic as a pointer into the pbuf
+ * payload. This avoids the select()/recvmsg() mailbox round trips and the
+ * copy into the caller's buffer.
+ *
+ * The network thread of this transport blocks on its FreeRTOS task
+ * notification, so waking it up to send (picoquic_esp_udp_wake_up_network_thread)
+ * costs one xTaskNotifyGive() instead of a loopback datagram and a select()
+ * round trip.
+ *
+ * Not available on the Linux target, which always uses host sockets.
+ */
+
+#ifndef PICOQUIC_ESP_UDP_H
+#define PICOQUIC_ESP_UDP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picoquic.h"
+#include "picoquic_packet_loop.h"
+#include "picosocks.h"
+
+typedef struct st_picoquic_esp_udp_t picoquic_esp_udp_t;
+typedef struct st_picoquic_esp_udp_thread_t picoquic_esp_udp_thread_t;
+
+/* A received datagram. `bytes` points into the pbuf held in `pbuf`, which
+ * must be released with picoquic_esp_udp_release() after processing.
+ * `rx_time` is the arrival time returned by picoquic_esp_udp_get_rx_time().
+ */
+typedef struct st_picoquic_esp_udp_packet_t {
+    void* pbuf;
+    uint8_t* bytes;
+    size_t length;
+    struct sockaddr_storage addr_from;
+    struct sockaddr_storage addr_dest;
+    int dest_if;
+    unsigned char received_ecn;
+    uint64_t rx_time;
+} picoquic_esp_udp_packet_t;
+
+struct pbuf;
+
+/* Receive time hook, called in the TCP/IP task for each datagram.
+ *
+ * The default (weak) implementation returns picoquic_current_time(), which
+ * excludes the time spent in the receive queue and in the packet loop. A
+ * project that records the driver RX time in its pbufs (e.g. with
+ * LWIP_PBUF_CUSTOM_DATA) can override it to return that time, converted
+ * to the picoquic_current_time() clock.
+ */
+uint64_t picoquic_esp_udp_get_rx_time(const struct pbuf* p);
+
+/* Open a raw UDP endpoint bound to local_port (0 for an ephemeral port).
+ *
+ * - af: address family of the endpoint: AF_INET, or with LWIP_IPV6, AF_INET6
+ *   or AF_UNSPEC for a dual stack endpoint.
+ * - queue_len: depth of the receive queue; 0 selects the Kconfig default.
+ *
+ * Returns NULL on error.
+ */
+picoquic_esp_udp_t* picoquic_esp_udp_open(int af, int local_port, int queue_len);
+
+/* Close the endpoint and free any queued packets. */
+void picoquic_esp_udp_close(picoquic_esp_udp_t* udp_ctx);
+
+/* Return the local port the endpoint is bound to. */
+int picoquic_esp_udp_get_local_port(picoquic_esp_udp_t* udp_ctx);
+
+/* Return the number of datagrams dropped before reaching the packet loop,
+ * because the receive queue was full or out of memory.
+ *
+ * Unlike the socket path, where lwIP silently drops datagrams when the
+ * recvmbox is full, these losses are visible here and can be told apart
+ * from network congestion.
+ */
+uint32_t picoquic_esp_udp_get_drop_count(picoquic_esp_udp_t* udp_ctx);
+
+/* Wait up to delta_t microseconds for a datagram.
+ *
+ * The calling task waits on its task notification (index 0), which it must
+ * not use for anything else. The wait ends early after
+ * picoquic_esp_udp_wake_up().
+ *
+ * Returns 1 if a packet was received, 0 on timeout or wake up.
+ */
+int picoquic_esp_udp_recv(picoquic_esp_udp_t* udp_ctx, picoquic_esp_udp_packet_t* packet, int64_t delta_t);
+
+/* Interrupt the current or next wait of picoquic_esp_udp_recv(). Can be
+ * called from any task.
+ */
+void picoquic_esp_udp_wake_up(picoquic_esp_udp_t* udp_ctx);
+
+/* Return 1 and clear the request if a wake up was requested, else 0. */
+int picoquic_esp_udp_take_wake_up(picoquic_esp_udp_t* udp_ctx);
+
+/* Release the pbuf of a received packet. */
+void picoquic_esp_udp_release(picoquic_esp_udp_t* udp_ctx, picoquic_esp_udp_packet_t* packet);
+
+/* Send a datagram. Same conventions as picoquic_sendmsg(), including the
+ * EMSGSIZE failure of datagrams larger than the path MTU (see
+ * picoquic_pmtu_cache_get()).
+ */
+int picoquic_esp_udp_send(picoquic_esp_udp_t* udp_ctx,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int dest_if,
+    const uint8_t* bytes, int length, int* sock_err);
+
+/* Packet loop using the raw UDP transport, with the same parameters and
+ * callback conventions as picoquic_packet_loop_v2().
+ */
+int picoquic_esp_udp_packet_loop(picoquic_quic_t* quic,
+    picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void* loop_callback_ctx);
+
+/* Run the raw UDP packet loop in a FreeRTOS task, with the same conventions
+ * as picoquic_start_network_thread(): wake ups are reported to the loop
+ * callback as picoquic_packet_loop_wake_up.
+ *
+ * The task stack size and priority are set in Kconfig.
+ *
+ * Returns NULL on error, with the error code in *ret.
+ */
+picoquic_esp_udp_thread_t* picoquic_esp_udp_start_network_thread(picoquic_quic_t* quic,
+    picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void* loop_callback_ctx,
+    int* ret);
+
+/* Wake up the network task, e.g. after queuing data to send. Returns 0. */
+int picoquic_esp_udp_wake_up_network_thread(picoquic_esp_udp_thread_t* thread);
+
+/* Stop the network task, wait for it to exit and free it.
+ *
+ * Returns the return code of the packet loop.
+ */
+int picoquic_esp_udp_delete_network_thread(picoquic_esp_udp_thread_t* thread);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_ESP_UDP_H */
@@ -0,0 +1,86 @@
+/*
+ * Picoquic happy eyeballs connection racing
+ *
+ * Races QUIC handshakes to the IPv6 and IPv4 addresses of a server, in the
+ * spirit of RFC 8305: the first attempt starts immediately, the next one after
+ * a short stagger delay (or as soon as the previous attempt fails), and the
+ * first handshake to complete wins. The losing attempts are closed.
+ *
+ * The packet loop must be able to send on both families: run the socket loop
+ * with local_af set to 0 (AF_UNSPEC), or picoquic_esp_udp_packet_loop(),
+ * which then opens a dual stack endpoint.
+ */
+
+#ifndef PICOQUIC_HAPPY_EYEBALLS_H
+#define PICOQUIC_HAPPY_EYEBALLS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picoquic.h"
+#include "picosocks.h"
+
+/* One attempt per address family */
+#define PICOQUIC_HAPPY_EYEBALLS_MAX 2
+
+typedef struct st_picoquic_happy_eyeballs_t {
+    picoquic_quic_t* quic;
+    const char* sni;
+    const char* alpn;
+    picoquic_callback_fn callback_fn;
+    void* callback_ctx;
+    struct sockaddr_storage addresses[PICOQUIC_HAPPY_EYEBALLS_MAX];
+    picoquic_cnx_t* cnx[PICOQUIC_HAPPY_EYEBALLS_MAX];
+    int nb_addresses;
+    int nb_started;
+    int nb_failed;
+    uint64_t stagger_delay;
+    uint64_t next_start_time;
+    picoquic_cnx_t* winner;
+} picoquic_happy_eyeballs_t;
+
+/* Start racing connections to the server addresses, in order of preference,
+ * typically as returned by picoquic_get_server_addresses().
+ *
+ * - sni, alpn: passed to picoquic_create_cnx(); must remain valid until all
+ *   attempts are started.
+ * - callback_fn, callback_ctx: application callback. Events of an attempt
+ *   are only delivered once it wins (starting with almost_ready or ready),
+ *   or if all attempts failed (the close event of the last one).
+ * - stagger_delay: delay in microseconds before starting the next attempt,
+ *   0 selects CONFIG_PICOQUIC_HAPPY_EYEBALLS_DELAY_MS.
+ *
+ * The structure must remain valid until the winning connection is
+ * established and the other attempts are closed.
+ *
+ * Returns 0 on success, or -1 if no attempt could be started.
+ */
+int picoquic_happy_eyeballs_start(picoquic_happy_eyeballs_t* he, picoquic_quic_t* quic,
+    const struct sockaddr_storage* addresses, int nb_addresses,
+    const char* sni, const char* alpn,
+    picoquic_callback_fn callback_fn, void* callback_ctx,
+    uint64_t stagger_delay, uint64_t current_time);
+
+/* Start the next attempt if its stagger delay expired, and reduce delta_t
+ * (microseconds, may be NULL) to the time of the next start.
+ *
+ * Call from the packet loop thread, e.g. in picoquic_packet_loop_time_check.
+ *
+ * Returns the winning connection, or NULL while the race is still running
+ * or if all attempts failed.
+ */
+picoquic_cnx_t* picoquic_happy_eyeballs_check(picoquic_happy_eyeballs_t* he,
+    uint64_t current_time, int64_t* delta_t);
+
+/* Return 1 once all attempts failed. */
+int picoquic_happy_eyeballs_is_failed(picoquic_happy_eyeballs_t* he);
+
+/* Close all attempts that did not win yet. */
+void picoquic_happy_eyeballs_abort(picoquic_happy_eyeballs_t* he);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_HAPPY_EYEBALLS_H */
@@ -0,0 +1,105 @@
+/*
+ * Picoquic sharded server (Linux target)
+ *
+ * Runs N independent picoquic contexts, one per worker thread, each with its
+ * own SO_REUSEPORT socket bound to the server port. Every context creates
+ * connection IDs whose first byte maps to its shard, and the kernel steers
+ * datagrams on that byte (see picoquic_open_sharded_server_sockets()), so
+ * each connection stays on the thread that owns it without any locking.
+ *
+ * Initial packets are steered on the client chosen CID, which is stable
+ * until the client switches to the server's CID, owned by the same shard.
+ *
+ * If CONFIG_PICOQUIC_TXTIME_HORIZON_US is set, the workers prepare the
+ * packets paced within that horizon in one go, and send them with SO_TXTIME
+ * departure times instead of waking up at every pacing slot.
+ */
+
+#ifndef PICOQUIC_SHARDED_SERVER_H
+#define PICOQUIC_SHARDED_SERVER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+
+#include "picoquic.h"
+#include "picoquic_packet_loop.h"
+#include "picosocks_esp32.h"
+
+/* Create the picoquic context of a shard.
+ *
+ * The application must pass cnx_id_callback and cnx_id_callback_data as the
+ * cnx_id_callback and cnx_id_callback_data parameters of picoquic_create().
+ *
+ * Returns NULL on error.
+ */
+typedef picoquic_quic_t* (*picoquic_shard_create_quic_fn)(int shard_id,
+    picoquic_connection_id_cb_fn cnx_id_callback, void* cnx_id_callback_data,
+    void* create_ctx, uint64_t current_time);
+
+/* Longest wait of a worker before it checks for a stop request, in microseconds */
+#define PICOQUIC_SHARD_STOP_DELAY 100000
+
+typedef struct st_picoquic_shard_t {
+    struct st_picoquic_sharded_server_t* server;
+    int shard_id;
+    SOCKET_TYPE fd;
+    int local_port;
+    int txtime_enabled;
+    picoquic_quic_t* quic;
+    pthread_t thread;
+    int thread_started;
+    int loop_ret;
+} picoquic_shard_t;
+
+typedef struct st_picoquic_sharded_server_t {
+    int nb_shards;
+    picoquic_shard_t shards[PICOQUIC_SHARDS_MAX];
+    SOCKET_TYPE sockets[PICOQUIC_SHARDS_MAX];
+    picoquic_packet_loop_cb_fn loop_callback;
+    void* loop_callback_ctx;
+    volatile int stop_requested;
+} picoquic_sharded_server_t;
+
+/* Connection ID callback of a shard: keeps the random CID, except for the
+ * first byte, which is adjusted so that it maps to the shard.
+ */
+void picoquic_shard_cnx_id_callback(picoquic_quic_t* quic, picoquic_connection_id_t cnx_id_local,
+    picoquic_connection_id_t cnx_id_remote, void* cnx_id_cb_data, picoquic_connection_id_t* cnx_id_returned);
+
+/* Open the shard sockets, create one context per shard and start the worker
+ * threads.
+ *
+ * The loop callback follows the picoquic_packet_loop_v2() conventions. It is
+ * called from all worker threads with the same loop_callback_ctx; the quic
+ * parameter identifies the shard. Returning an error or
+ * PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP stops that shard only.
+ *
+ * Returns 0 on success, or -1 on error, in which case nothing is left running.
+ */
+int picoquic_sharded_server_start(picoquic_sharded_server_t* server, int nb_shards, int af, int port,
+    picoquic_shard_create_quic_fn create_quic_fn, void* create_ctx,
+    picoquic_packet_loop_cb_fn loop_callback, void* loop_callback_ctx);
+
+/* Ask all shards to stop. They exit within PICOQUIC_SHARD_STOP_DELAY. */
+void picoquic_sharded_server_stop(picoquic_sharded_server_t* server);
+
+/* Wait for all worker threads to exit.
+ *
+ * Returns the first non zero loop return code, or 0.
+ */
+int picoquic_sharded_server_wait(picoquic_sharded_server_t* server);
+
+/* Stop the workers, free the contexts and close the sockets. */
+void picoquic_sharded_server_delete(picoquic_sharded_server_t* server);
+
+/* Return the picoquic context of a shard, or NULL. */
+picoquic_quic_t* picoquic_sharded_server_get_quic(picoquic_sharded_server_t* server, int shard_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_SHARDED_SERVER_H */
@@ -0,0 +1,47 @@
+/*
+ * Picoquic ESP-IDF socket packet loop
+ *
+ * Packet loop on the BSD sockets of the ESP32 (lwIP) and of the Linux
+ * target. The sockets are registered once in a picoquic_poller_t, which
+ * waits with epoll on the Linux target instead of rebuilding a select()
+ * descriptor set on every iteration. The ready sockets are drained with
+ * picoquic_recvmsg_batch(), one recvmmsg() call each on the Linux target,
+ * up to CONFIG_PICOQUIC_SOCKET_LOOP_BATCH datagrams per wake-up. The
+ * prepared packets are queued in a picoquic_send_batch_t and sent
+ * CONFIG_PICOQUIC_SOCKET_LOOP_SEND_BATCH at a time, with one sendmmsg()
+ * call on the Linux target. There, unless param->do_not_use_gso is set,
+ * picoquic coalesces the packets of a path into one buffer, sent with
+ * UDP_SEGMENT, and the loop falls back to single packets if the kernel or
+ * driver rejects it.
+ *
+ * Only built if CONFIG_PICOQUIC_SOCKET_LOOP is set.
+ */
+
+#ifndef PICOQUIC_SOCKET_LOOP_H
+#define PICOQUIC_SOCKET_LOOP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picoquic.h"
+#include "picoquic_packet_loop.h"
+#include "picosocks_esp32.h"
+
+/* Maximum number of sockets of the loop: one per address family */
+#define PICOQUIC_SOCKET_LOOP_MAX_SOCKETS 2
+
+/* Packet loop on the port sockets, with the same parameters and callback
+ * conventions as picoquic_packet_loop_v2(). If local_af is 0, one socket is
+ * opened per supported address family.
+ */
+int picoquic_socket_packet_loop(picoquic_quic_t* quic,
+    picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void* loop_callback_ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_SOCKET_LOOP_H */
@@ -0,0 +1,92 @@
+/*
+ * Picoquic io_uring socket backend (Linux target)
+ *
+ * Receives with one multishot recvmsg per socket, into a ring of provided
+ * buffers, and queues sends as sendmsg SQEs. Pending sends, the re-armed
+ * receives and a timeout SQE for the next picoquic wake time are submitted
+ * together, so that a loop iteration costs a single io_uring_enter() call
+ * instead of a select() plus one syscall per datagram.
+ *
+ * Requires liburing 2.4 and Linux 6.0 (multishot recvmsg). Only built if
+ * CONFIG_PICOQUIC_IO_URING is set.
+ */
+
+#ifndef PICOQUIC_URING_H
+#define PICOQUIC_URING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picoquic.h"
+#include "picoquic_packet_loop.h"
+#include "picosocks_esp32.h"
+
+/* Maximum number of sockets served by one ring */
+#define PICOQUIC_URING_MAX_SOCKETS 2
+
+typedef struct st_picoquic_uring_t picoquic_uring_t;
+
+/* Create a ring serving the given sockets, which remain owned by the caller.
+ *
+ * - nb_recv_buffers: number of provided receive buffers, rounded up to a
+ *   power of 2; 0 selects CONFIG_PICOQUIC_IO_URING_RECV_BUFFERS.
+ * - nb_send_slots: number of sends in flight; 0 selects the default.
+ *   If all are in use, packets are sent with a direct sendmsg().
+ *
+ * Returns NULL on error, e.g. if the kernel does not support io_uring.
+ */
+picoquic_uring_t* picoquic_uring_create(SOCKET_TYPE* sockets, int nb_sockets,
+    int nb_recv_buffers, int nb_send_slots);
+
+void picoquic_uring_delete(picoquic_uring_t* uring);
+
+/* Queue a packet for sending, with the same conventions as
+ * picoquic_sendmsg(). The packet is copied, and submitted with the next
+ * picoquic_uring_wait() or picoquic_uring_flush().
+ *
+ * Errors are only reported for packets sent directly, because the send slots
+ * are all busy. Errors of queued sends are counted, see
+ * picoquic_uring_get_send_errors().
+ *
+ * Returns the length queued or sent, or -1 on error.
+ */
+int picoquic_uring_send(picoquic_uring_t* uring,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int dest_if,
+    const uint8_t* bytes, int length, int send_msg_size, int* sock_err);
+
+/* Submit the queued sends without waiting. Returns 0, or -1 on error. */
+int picoquic_uring_flush(picoquic_uring_t* uring);
+
+/* Submit the queued sends, then wait up to delta_t microseconds for
+ * datagrams and return up to nb_slots of them.
+ *
+ * The slot buffers point into the provided buffer ring, and must be handed
+ * back with picoquic_uring_release() once processed. Slots do not need a
+ * caller provided buffer.
+ *
+ * Returns the number of datagrams received (0 on timeout), or -1 on error.
+ */
+int picoquic_uring_wait(picoquic_uring_t* uring, int64_t delta_t,
+    picoquic_recv_slot_t* slots, int nb_slots, uint64_t* current_time);
+
+/* Return the buffers of received slots to the ring. */
+void picoquic_uring_release(picoquic_uring_t* uring, picoquic_recv_slot_t* slots, int nb_slots);
+
+/* Number of queued sends that failed, and the last error. */
+uint64_t picoquic_uring_get_send_errors(picoquic_uring_t* uring, int* last_sock_err);
+
+/* Packet loop using the io_uring backend, with the same parameters and
+ * callback conventions as picoquic_packet_loop_v2(). If local_af is 0,
+ * one socket is opened per address family.
+ */
+int picoquic_uring_packet_loop(picoquic_quic_t* quic,
+    picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void* loop_callback_ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOQUIC_URING_H */
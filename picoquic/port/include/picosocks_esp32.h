@@ -0,0 +1,548 @@
+/*
+ * Picoquic ESP-IDF socket extensions
+ *
+ * Additional socket helpers implemented by port/picosocks_esp32.c, on top of
+ * the regular picosocks.h API. They target the packet loops that run on the
+ * ESP32 (lwIP) and on the ESP-IDF Linux target.
+ */
+
+#ifndef PICOSOCKS_ESP32_H
+#define PICOSOCKS_ESP32_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "picosocks.h"
+
+/* Maximum number of datagrams that callers typically drain per wakeup. */
+#define PICOQUIC_RECV_BATCH_MAX 32
+
+/* One received datagram, with its own parsed control data.
+ *
+ * The caller provides `buffer` and `buffer_max`; all other fields are
+ * filled by the batch receive functions. If UDP GRO is enabled on the
+ * socket, the buffer may hold several coalesced packets of
+ * `udp_coalesced_size` bytes each (the last one may be shorter).
+ *
+ * If receive time stamps are enabled on the socket, `rx_time` holds the
+ * kernel arrival time, on the picoquic_current_time() clock; it is 0 otherwise.
+ *
+ * If drop counters are enabled on the socket, `rxq_drops` holds the number
+ * of datagrams the kernel dropped on that socket so far, because its receive
+ * buffer was full. It is 0 until the first drop.
+ */
+typedef struct st_picoquic_recv_slot_t {
+    struct sockaddr_storage addr_from;
+    struct sockaddr_storage addr_dest;
+    int dest_if;
+    unsigned char received_ecn;
+    size_t udp_coalesced_size;
+    uint64_t rx_time;
+    uint32_t rxq_drops;
+    int socket_rank;
+    uint8_t* buffer;
+    int buffer_max;
+    int bytes_recv;
+} picoquic_recv_slot_t;
+
+/* Drain up to nb_slots datagrams from a socket without blocking.
+ *
+ * Uses recvmmsg() on the Linux target and a non-blocking recvmsg() loop on lwIP.
+ *
+ * Returns the number of datagrams received (0 if none are pending),
+ * or -1 on socket error.
+ */
+int picoquic_recvmsg_batch(SOCKET_TYPE fd, picoquic_recv_slot_t* slots, int nb_slots);
+
+/* Parse the control data of a received message into the slot: destination
+ * address and interface, ECN, GRO segment size, receive time and drop count.
+ * Used by receive paths that do their own recvmsg(), such as io_uring.
+ */
+void picoquic_socks_cmsg_parse_slot(void* vmsg, picoquic_recv_slot_t* slot);
+
+/* Wait up to delta_t microseconds for any of the sockets to become readable,
+ * then drain up to nb_slots datagrams from the ready sockets.
+ *
+ * All received datagrams share the single timestamp returned in current_time.
+ * Each slot records the rank of the socket it was received on.
+ *
+ * Returns the number of datagrams received (0 on timeout), or -1 on error.
+ */
+int picoquic_select_batch(SOCKET_TYPE* sockets, int nb_sockets,
+    picoquic_recv_slot_t* slots, int nb_slots,
+    int64_t delta_t, uint64_t* current_time);
+
+/* Receive buffer size for sockets with GRO enabled */
+#define PICOQUIC_RECV_GRO_BUFFER_SIZE 0x10000
+
+/* Enable UDP GRO on a Linux-target socket, so that one receive can return
+ * several coalesced packets from the same flow.
+ *
+ * This is opt-in: only enable it on sockets read through the batch receive
+ * functions with buffers of PICOQUIC_RECV_GRO_BUFFER_SIZE, since smaller
+ * buffers would truncate the coalesced datagrams. The sharded server
+ * sockets enable it.
+ *
+ * Returns 0 on success, or -1 if GRO is not available (always on lwIP).
+ */
+int picoquic_socket_set_gro_options(SOCKET_TYPE sd, int af);
+
+/* Set the socket receive and send buffer sizes, in bytes; 0 keeps the
+ * current size.
+ *
+ * The client and server sockets opened by this shim use
+ * CONFIG_PICOQUIC_SOCKET_RCVBUF and CONFIG_PICOQUIC_SOCKET_SNDBUF. On lwIP,
+ * only SO_RCVBUF is available, if CONFIG_LWIP_SO_RCVBUF is set; the number
+ * of queued datagrams is also bounded by CONFIG_LWIP_UDP_RECVMBOX_SIZE.
+ *
+ * Returns 0 on success, or -1 if a size could not be set.
+ */
+int picoquic_socket_set_buffer_sizes(SOCKET_TYPE sd, int rcvbuf, int sndbuf);
+
+/* Read back the buffer sizes; Linux reports twice the requested size. */
+int picoquic_socket_get_buffer_sizes(SOCKET_TYPE sd, int* rcvbuf, int* sndbuf);
+
+/* Enable the kernel drop counter (SO_RXQ_OVFL) on a Linux-target socket,
+ * reported in the rxq_drops field of the received slots. The sockets opened
+ * by this shim enable it by default.
+ *
+ * Returns 0 on success, or -1 if not available (always on lwIP, see
+ * picoquic_esp_udp_get_drop_count() for the raw UDP transport).
+ */
+int picoquic_socket_set_drop_counter_options(SOCKET_TYPE sd);
+
+/* Enable kernel receive time stamps (SO_TIMESTAMPNS) on a Linux-target
+ * socket. The batch receive functions then report the arrival time of each
+ * datagram in the slot's rx_time, and picoquic_select_ex() returns it as
+ * current_time, so that the time spent in the socket queue and in the packet
+ * loop does not inflate the RTT samples. The client, server and sharded
+ * server sockets enable them when opened.
+ *
+ * Returns 0 on success, or -1 if not available (always on lwIP, see
+ * picoquic_esp_udp_get_rx_time() for the raw UDP transport).
+ */
+int picoquic_socket_set_rx_timestamp_options(SOCKET_TYPE sd, int af);
+
+/* Enable timed transmission (SO_TXTIME) on a Linux-target socket, so that
+ * packets sent with a departure time are held by the qdisc until then.
+ *
+ * Departure times are only enforced by the fq or etf qdisc, e.g. after
+ * "tc qdisc replace dev eth0 root fq"; other qdiscs send immediately.
+ *
+ * Returns 0 on success, or -1 if not available (always on lwIP).
+ */
+int picoquic_socket_set_txtime_options(SOCKET_TYPE sd);
+
+/* picoquic_socks_cmsg_format(), adding an SCM_TXTIME control message if
+ * departure_time is in the future. The departure time uses the
+ * picoquic_current_time() clock; 0 sends immediately.
+ */
+void picoquic_socks_cmsg_format_txtime(
+    void* vmsg,
+    size_t message_length,
+    size_t send_msg_size,
+    struct sockaddr* addr_from,
+    int dest_if,
+    uint64_t departure_time);
+
+/* picoquic_sendmsg(), asking the kernel to send the packet at
+ * departure_time, see picoquic_socket_set_txtime_options(). Ignored on lwIP.
+ */
+int picoquic_sendmsg_txtime(SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from,
+    int dest_if,
+    const char* bytes, int length,
+    int send_msg_size,
+    uint64_t departure_time,
+    int * sock_err);
+
+/* Number of destinations in the path MTU cache */
+#define PICOQUIC_PMTU_CACHE_SIZE 8
+
+/* Size of the IP and UDP headers of a datagram of family af. */
+int picoquic_datagram_overhead(int af);
+
+/* Per-destination path MTU cache, in IP packet bytes, shared by all sockets.
+ *
+ * On lwIP, which does not set the DF bit, picoquic_sendmsg() fails datagrams
+ * that do not fit the cached PMTU, or the MTU of the route to the
+ * destination, with EMSGSIZE instead of letting lwIP fragment them. A
+ * PMTUD probe that is too large is thus lost, and picoquic settles on the
+ * largest size that fits. EMSGSIZE is not a fatal error: the packet loops
+ * do not treat it as an unreachable destination.
+ *
+ * The PMTU is lowered by the datagrams failing with EMSGSIZE on lwIP; the
+ * kernel of the Linux target keeps its own. The route MTU is kept apart:
+ * it is looked up once per destination, and again after
+ * picoquic_pmtu_cache_route_changed(). Sends read the cache without locking.
+ *
+ * Returns the cached PMTU of addr_dest, or 0 if unknown.
+ */
+int picoquic_pmtu_cache_get(const struct sockaddr* addr_dest);
+
+/* Returns the lower of the PMTU and of the route MTU of addr_dest, or 0 if
+ * neither is known. */
+int picoquic_pmtu_cache_get_limit(const struct sockaddr* addr_dest);
+
+/* Set the PMTU of a destination. */
+void picoquic_pmtu_cache_set(const struct sockaddr* addr_dest, int pmtu);
+
+/* Set the MTU of the route to a destination, 0 if there is no route. It is
+ * valid until the next picoquic_pmtu_cache_route_changed(). */
+void picoquic_pmtu_cache_set_route_mtu(const struct sockaddr* addr_dest, int route_mtu);
+
+/* Invalidate the route MTUs, e.g. from the IP event handler when an
+ * interface goes up or down or changes address. */
+void picoquic_pmtu_cache_route_changed(void);
+
+void picoquic_pmtu_cache_flush(void);
+
+/* Longest queueing delay accepted from a receive time stamp, in microseconds */
+#define PICOQUIC_RX_TIME_MAX_AGE 1000000
+
+/* Return rx_time if it is a plausible arrival time, else current_time, and
+ * never less than last_time, the latest time the packet loop passed to
+ * picoquic (e.g. to picoquic_prepare_next_packet_ex()).
+ */
+uint64_t picoquic_rx_time_or_current(uint64_t rx_time, uint64_t current_time, uint64_t last_time);
+
+/* Returns the local port a socket is bound to, in host order, or 0. */
+int picoquic_get_local_port(SOCKET_TYPE sd);
+
+/* Submit a received slot to picoquic, splitting GRO coalesced buffers into
+ * individual packets. The packets are stamped with the slot's rx_time if
+ * available, with current_time otherwise, see picoquic_rx_time_or_current().
+ *
+ * local_port is the port of the receiving socket, see
+ * picoquic_get_local_port(). It is copied into addr_dest, since the packet
+ * info only reports the local address.
+ *
+ * All the segments are processed, even if one of them fails.
+ *
+ * Returns the result of picoquic_incoming_packet_ex() for the first failing
+ * packet, or 0.
+ */
+int picoquic_incoming_recv_slot(picoquic_quic_t* quic, picoquic_recv_slot_t* slot, int local_port,
+    picoquic_cnx_t** first_cnx, uint64_t current_time, uint64_t last_time);
+
+/* Persistent readiness poller.
+ *
+ * Sockets are registered once and keep their rank until removed. The Linux
+ * target uses epoll and only reports the ready sockets. lwIP keeps the select()
+ * backend, but builds the descriptor set on registration rather than on
+ * every wait.
+ */
+typedef struct st_picoquic_poller_t picoquic_poller_t;
+
+/* Create a poller for at most max_sockets sockets, which must be positive.
+ * Returns NULL on error.
+ */
+picoquic_poller_t* picoquic_poller_create(int max_sockets);
+
+void picoquic_poller_delete(picoquic_poller_t* poller);
+
+/* Register a socket.
+ *
+ * Returns its rank, or -1 on error: poller full, socket already registered,
+ * or, on lwIP, socket number not below FD_SETSIZE.
+ */
+int picoquic_poller_add(picoquic_poller_t* poller, SOCKET_TYPE fd);
+
+/* Unregister a socket. The ranks of the other sockets do not change. */
+int picoquic_poller_remove(picoquic_poller_t* poller, SOCKET_TYPE fd);
+
+/* Return the socket registered at rank, or INVALID_SOCKET. */
+SOCKET_TYPE picoquic_poller_get_socket(picoquic_poller_t* poller, int rank);
+
+/* Wait up to delta_t microseconds and fill ready_ranks with the ranks of
+ * the readable sockets.
+ *
+ * Returns the number of ready sockets (0 on timeout), or -1 on error.
+ */
+int picoquic_poller_wait(picoquic_poller_t* poller, int64_t delta_t, int* ready_ranks, int max_ready);
+
+/* Same as picoquic_select_batch(), using a poller instead of a socket array. */
+int picoquic_poller_select_batch(picoquic_poller_t* poller,
+    picoquic_recv_slot_t* slots, int nb_slots,
+    int64_t delta_t, uint64_t* current_time);
+
+/* Maximum number of packets queued in a send batch before it must be flushed. */
+#define PICOQUIC_SEND_BATCH_MAX 16
+
+/* One prepared packet in a send batch.
+ *
+ * The packet bytes are not copied: `bytes` must remain valid until the
+ * batch is flushed. After the flush, `bytes_sent` holds the result of the
+ * send and `sock_err` the socket error, if any.
+ */
+typedef struct st_picoquic_send_batch_entry_t {
+    struct sockaddr_storage addr_dest;
+    struct sockaddr_storage addr_from;
+    int dest_if;
+    const uint8_t* bytes;
+    int length;
+    int send_msg_size;
+    int bytes_sent;
+    int sock_err;
+} picoquic_send_batch_entry_t;
+
+typedef struct st_picoquic_send_batch_t {
+    int nb_entries;
+    picoquic_send_batch_entry_t entries[PICOQUIC_SEND_BATCH_MAX];
+} picoquic_send_batch_t;
+
+/* Reset a send batch to the empty state. */
+void picoquic_send_batch_init(picoquic_send_batch_t* batch);
+
+/* Queue a prepared packet. Packets in one batch may go to different peers.
+ *
+ * Returns 0 on success, or -1 if the batch is full and must be flushed first.
+ */
+int picoquic_send_batch_add(picoquic_send_batch_t* batch,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int dest_if,
+    const uint8_t* bytes, int length, int send_msg_size);
+
+/* Send all queued packets through one socket and empty the batch.
+ *
+ * Uses sendmmsg() on the Linux target and a picoquic_sendmsg_template()
+ * loop on lwIP.
+ * A packet rejected by the socket (e.g. unreachable destination) does not
+ * stop the flush; its error is reported in the entry's sock_err, and the
+ * first error is also returned in sock_err. If the socket cannot take more
+ * packets (EAGAIN, ENOBUFS), all the remaining entries fail with that error.
+ *
+ * Returns the number of packets that were sent.
+ */
+int picoquic_send_batch_flush(SOCKET_TYPE fd, picoquic_send_batch_t* batch, int* sock_err);
+
+/* Maximum number of segments the Linux kernel accepts in one GSO send. */
+#define PICOQUIC_GSO_MAX_SEGMENTS 64
+
+/* Send a buffer of consecutive same-path packets, all of size segment_size
+ * except possibly the last one.
+ *
+ * If segment_size is smaller than length, the buffer is sent with one
+ * UDP_SEGMENT (GSO) sendmsg() on the Linux target. If the kernel or driver
+ * rejects it with EIO or EINVAL, *gso_disabled is set and the buffer is
+ * sent again, one packet per call, as it is on lwIP.
+ *
+ * Returns the number of bytes sent, or -1 on error (see sock_err).
+ */
+int picoquic_send_through_socket_gso(
+    SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from, int from_if,
+    const char* bytes, int length, int segment_size,
+    int* gso_disabled, int* sock_err);
+
+/* picoquic_send_through_socket_gso() with a departure time, see
+ * picoquic_sendmsg_txtime(). All the segments leave at that time.
+ */
+int picoquic_send_through_socket_gso_txtime(
+    SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from, int from_if,
+    const char* bytes, int length, int segment_size,
+    uint64_t departure_time,
+    int* gso_disabled, int* sock_err);
+
+/* Coalesces consecutive packets for the same path into one super-buffer,
+ * sent with picoquic_send_through_socket_gso().
+ *
+ * The caller provides the super-buffer, typically 64KB on the Linux target.
+ */
+typedef struct st_picoquic_gso_sender_t {
+    SOCKET_TYPE fd;
+    int gso_disabled;
+    struct sockaddr_storage addr_dest;
+    struct sockaddr_storage addr_from;
+    int dest_if;
+    uint8_t* buffer;
+    size_t buffer_max;
+    size_t length;
+    size_t segment_size;
+    int nb_segments;
+    int is_last_segment_short;
+} picoquic_gso_sender_t;
+
+void picoquic_gso_sender_init(picoquic_gso_sender_t* sender, SOCKET_TYPE fd,
+    uint8_t* buffer, size_t buffer_max);
+
+/* Append a packet. Pending packets are flushed first if the packet is for a
+ * different path, does not fit the current segment size, or does not fit
+ * in the super-buffer.
+ *
+ * Returns 0 on success, or -1 if a flush failed (see sock_err).
+ */
+int picoquic_gso_sender_add(picoquic_gso_sender_t* sender,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int dest_if,
+    const uint8_t* bytes, size_t length, int* sock_err);
+
+/* Send the pending packets, if any.
+ *
+ * Returns 0 on success, or -1 on error (see sock_err).
+ */
+int picoquic_gso_sender_flush(picoquic_gso_sender_t* sender, int* sock_err);
+
+/* Connected UDP client socket, for clients that talk to a single peer.
+ *
+ * Once the connection runs on a single validated path, the socket is
+ * connect()ed to the peer, so the hot path uses plain send()/recv() without
+ * per-datagram addresses or route lookups. While the connection probes or
+ * migrates to other paths, the socket stays unconnected, so that the
+ * replies from the new peer addresses are not filtered out by the stack.
+ * The socket keeps its address family for its whole life.
+ */
+typedef struct st_picoquic_connected_socket_t {
+    SOCKET_TYPE fd;
+    int af;
+    struct sockaddr_storage peer_addr;
+    struct sockaddr_storage local_addr;
+    int ecn_recv_set;
+} picoquic_connected_socket_t;
+
+/* Open an unconnected client socket of address family af.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int picoquic_connected_socket_open(picoquic_connected_socket_t* connected, int af);
+
+void picoquic_connected_socket_close(picoquic_connected_socket_t* connected);
+
+/* Connect the socket to peer_addr.
+ *
+ * Returns 0 on success, or -1 on error. errno is EAFNOSUPPORT if peer_addr
+ * is not in the address family of the socket.
+ */
+int picoquic_connected_socket_connect(picoquic_connected_socket_t* connected, struct sockaddr* peer_addr);
+
+/* Dissolve the association with the peer, with connect(AF_UNSPEC).
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int picoquic_connected_socket_disconnect(picoquic_connected_socket_t* connected);
+
+/* Follow the paths of cnx: connect the socket to the peer when the
+ * connection has a single path and that path is validated, disconnect it
+ * otherwise. Call it after each receive and before sending.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int picoquic_connected_socket_update(picoquic_connected_socket_t* connected, picoquic_cnx_t* cnx);
+
+/* Send a packet, with the same conventions as picoquic_send_through_socket().
+ *
+ * Packets for the connected peer use send(). Other destinations, or a source
+ * address that differs from the connected local address, use
+ * picoquic_sendmsg() without changing the association. A destination that
+ * is not in the address family of the socket fails with EAFNOSUPPORT.
+ */
+int picoquic_connected_socket_send(picoquic_connected_socket_t* connected,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int from_if,
+    const char* bytes, int length, int* sock_err);
+
+/* Receive a packet, with the same conventions as picoquic_recvmsg().
+ *
+ * Uses recv() on a connected socket, unless ECN reception is enabled, since
+ * the ECN marks are only available through recvmsg() control data. The
+ * source and destination addresses are then the connected peer and local
+ * addresses. An unconnected socket uses picoquic_recvmsg().
+ */
+int picoquic_connected_socket_recv(picoquic_connected_socket_t* connected,
+    struct sockaddr_storage* addr_from,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    uint8_t* buffer, int buffer_max);
+
+/* Control buffer space for sent datagrams: source address and segment size. */
+#define PICOQUIC_SEND_CMSG_SPACE 128
+
+/* Pre-formatted send header for one path.
+ *
+ * The control data (source address, interface, GSO segment size) is formatted
+ * once, and only rebuilt when one of these parameters changes, or after
+ * picoquic_send_template_invalidate() on a path change. Keep one template per
+ * socket and path.
+ */
+typedef struct st_picoquic_send_template_t {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr hdr;
+        char buf[PICOQUIC_SEND_CMSG_SPACE];
+    } control;
+    struct sockaddr_storage addr_from;
+    int dest_if;
+    int segment_size;
+    int is_valid;
+} picoquic_send_template_t;
+
+void picoquic_send_template_init(picoquic_send_template_t* send_template);
+
+void picoquic_send_template_invalidate(picoquic_send_template_t* send_template);
+
+/* Same as picoquic_sendmsg(), reusing the template's control data when the
+ * source address, interface and segment size did not change.
+ */
+int picoquic_sendmsg_template(SOCKET_TYPE fd,
+    picoquic_send_template_t* send_template,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from,
+    int dest_if,
+    const char* bytes, int length,
+    int send_msg_size,
+    int* sock_err);
+
+/* Return 1 if sockets of this address family can be opened: AF_INET, and
+ * AF_INET6 on the Linux target or if lwIP is built with IPv6.
+ */
+int picoquic_socket_af_is_supported(int af);
+
+/* Resolve a server name or numeric address into at most one address per
+ * supported family, IPv6 first.
+ *
+ * Unlike picoquic_get_server_address(), which returns a single address,
+ * this provides the candidates for picoquic_happy_eyeballs_start().
+ *
+ * Returns the number of addresses found, 0 if the name cannot be resolved.
+ */
+int picoquic_get_server_addresses(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_addresses, int max_addresses, int* is_name);
+
+/* Same as picoquic_get_server_addresses(), with a single getaddrinfo()
+ * call for both families, so that the caller waits for one lookup only.
+ * lwIP's getaddrinfo() then returns a single address, of the family its
+ * DNS client prefers; the Linux target returns both.
+ *
+ * Returns the number of addresses found, 0 if the name cannot be resolved.
+ */
+int picoquic_get_server_addresses_single_query(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_addresses, int max_addresses, int* is_name);
+
+/* Maximum number of shards of a sharded server */
+#define PICOQUIC_SHARDS_MAX 16
+
+/* Open nb_shards SO_REUSEPORT sockets bound to the same port, for a sharded
+ * server on the Linux target.
+ *
+ * A reuseport BPF program delivers each datagram to socket
+ * (first destination CID byte % nb_shards), so a shard only receives the
+ * packets of its own connections if its CIDs are chosen accordingly (see
+ * picoquic_shard_cnx_id_callback()). If port is 0, all sockets share the
+ * ephemeral port of the first one. GRO is enabled if available, the sockets
+ * must be read with buffers of PICOQUIC_RECV_GRO_BUFFER_SIZE.
+ *
+ * Returns 0 on success, or -1 on error (always on lwIP).
+ */
+int picoquic_open_sharded_server_sockets(SOCKET_TYPE* sockets, int nb_shards, int af, int port);
+
+void picoquic_close_sharded_server_sockets(SOCKET_TYPE* sockets, int nb_shards);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PICOSOCKS_ESP32_H */
@@ -0,0 +1,317 @@
+/*
+ * Picoquic resolver cache
+ *
+ * A small table of recently resolved names, protected by a mutex. Expired
+ * entries are refreshed by short lived detached threads, so that the
+ * connecting thread never waits for DNS when it has a usable entry.
+ */
+
+#include "picoquic_dns_cache.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+
+#include "picosocks_esp32.h"
+#include "picoquic_utils.h"
+#include "sdkconfig.h"
+
+#ifndef CONFIG_PICOQUIC_DNS_CACHE_SIZE
+#define CONFIG_PICOQUIC_DNS_CACHE_SIZE 4
+#endif
+#ifndef CONFIG_PICOQUIC_DNS_CACHE_TTL_S
+#define CONFIG_PICOQUIC_DNS_CACHE_TTL_S 300
+#endif
+#ifndef CONFIG_PICOQUIC_DNS_CACHE_MAX_STALE_S
+#define CONFIG_PICOQUIC_DNS_CACHE_MAX_STALE_S 86400
+#endif
+
+#define PICOQUIC_DNS_CACHE_NAME_MAX 128
+/* One address per family, as returned by picoquic_get_server_addresses() */
+#define PICOQUIC_DNS_CACHE_ADDRESSES 2
+/* getaddrinfo() on lwIP needs a bit more than the default pthread stack */
+#define PICOQUIC_DNS_REFRESH_STACK_SIZE 4096
+
+typedef struct st_picoquic_dns_cache_entry_t {
+    char name[PICOQUIC_DNS_CACHE_NAME_MAX];
+    struct sockaddr_storage addresses[PICOQUIC_DNS_CACHE_ADDRESSES];
+    int nb_addresses;
+    uint64_t resolved_time;
+    uint64_t last_used;
+    int refresh_pending;
+} picoquic_dns_cache_entry_t;
+
+static picoquic_dns_cache_entry_t g_picoquic_dns_cache[CONFIG_PICOQUIC_DNS_CACHE_SIZE];
+static pthread_mutex_t g_picoquic_dns_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int picoquic_dns_cache_is_numeric(const char* name)
+{
+    uint8_t addr[16];
+
+    return inet_pton(AF_INET, name, addr) == 1 || inet_pton(AF_INET6, name, addr) == 1;
+}
+
+/* Find the entry for a name, or if create is set, recycle an empty or the
+ * least recently used entry for it. Must be called with the mutex held.
+ */
+static picoquic_dns_cache_entry_t* picoquic_dns_cache_find(const char* name, int create)
+{
+    picoquic_dns_cache_entry_t* lru = NULL;
+
+    for (int i = 0; i < CONFIG_PICOQUIC_DNS_CACHE_SIZE; i++) {
+        picoquic_dns_cache_entry_t* entry = &g_picoquic_dns_cache[i];
+        if (entry->name[0] != 0 && strcasecmp(entry->name, name) == 0) {
+            return entry;
+        }
+        if (entry->name[0] == 0) {
+            if (lru == NULL || lru->name[0] != 0) {
+                lru = entry;
+            }
+        }
+        else if (lru == NULL || (lru->name[0] != 0 &&
+            (entry->refresh_pending < lru->refresh_pending ||
+            (entry->refresh_pending == lru->refresh_pending && entry->last_used < lru->last_used)))) {
+            /* Entries with a pending refresh are only recycled as a last resort */
+            lru = entry;
+        }
+    }
+
+    if (create && lru != NULL) {
+        memset(lru, 0, sizeof(picoquic_dns_cache_entry_t));
+        strncpy(lru->name, name, PICOQUIC_DNS_CACHE_NAME_MAX - 1);
+        return lru;
+    }
+    return NULL;
+}
+
+static void picoquic_dns_cache_store(picoquic_dns_cache_entry_t* entry,
+    const struct sockaddr_storage* addresses, int nb_addresses, uint64_t current_time)
+{
+    memcpy(entry->addresses, addresses, nb_addresses * sizeof(struct sockaddr_storage));
+    entry->nb_addresses = nb_addresses;
+    entry->resolved_time = current_time;
+}
+
+/* Copy the cached addresses with the requested port. IPv4 is copied first
+ * if prefer_ipv4 is set, to match picoquic_get_server_address().
+ */
+static int picoquic_dns_cache_copy(const picoquic_dns_cache_entry_t* entry, int server_port,
+    struct sockaddr_storage* server_addresses, int max_addresses, int prefer_ipv4)
+{
+    int nb_copied = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < entry->nb_addresses && nb_copied < max_addresses; i++) {
+            const struct sockaddr_storage* addr = &entry->addresses[i];
+            int is_first_pass_af = !prefer_ipv4 || addr->ss_family == AF_INET;
+
+            if ((pass == 0) == (is_first_pass_af != 0)) {
+                struct sockaddr_storage* copy = &server_addresses[nb_copied++];
+                memcpy(copy, addr, sizeof(struct sockaddr_storage));
+                if (copy->ss_family == AF_INET6) {
+                    ((struct sockaddr_in6*)copy)->sin6_port = htons((unsigned short)server_port);
+                }
+                else {
+                    ((struct sockaddr_in*)copy)->sin_port = htons((unsigned short)server_port);
+                }
+            }
+        }
+    }
+
+    return nb_copied;
+}
+
+static void* picoquic_dns_cache_refresh_thread(void* arg)
+{
+    char* name = (char*)arg;
+    struct sockaddr_storage addresses[PICOQUIC_DNS_CACHE_ADDRESSES];
+    int is_name = 0;
+    int nb_addresses = picoquic_get_server_addresses(name, 0, addresses, PICOQUIC_DNS_CACHE_ADDRESSES, &is_name);
+    picoquic_dns_cache_entry_t* entry;
+
+    pthread_mutex_lock(&g_picoquic_dns_cache_mutex);
+    entry = picoquic_dns_cache_find(name, 0);
+    if (entry != NULL) {
+        if (nb_addresses > 0) {
+            picoquic_dns_cache_store(entry, addresses, nb_addresses, picoquic_current_time());
+        }
+        entry->refresh_pending = 0;
+    }
+    pthread_mutex_unlock(&g_picoquic_dns_cache_mutex);
+
+    DBG_PRINTF("DNS cache refresh of %s: %d addresses\n", name, nb_addresses);
+    free(name);
+
+    return NULL;
+}
+
+static int picoquic_dns_cache_start_refresh(const char* name)
+{
+    int ret = -1;
+    pthread_t thread;
+    pthread_attr_t attr;
+    char* arg = (char*)malloc(strlen(name) + 1);
+
+    if (arg != NULL) {
+        strcpy(arg, name);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+#if !defined(__linux)
+        pthread_attr_setstacksize(&attr, PICOQUIC_DNS_REFRESH_STACK_SIZE);
+#endif
+        ret = pthread_create(&thread, &attr, picoquic_dns_cache_refresh_thread, arg);
+        pthread_attr_destroy(&attr);
+        if (ret != 0) {
+            DBG_PRINTF("Cannot start DNS refresh of %s, err: %d\n", name, ret);
+            free(arg);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Mark the entry as being refreshed, unless a refresh is already running.
+ * Must be called with the mutex held. Returns 1 if the caller must start
+ * the refresh with picoquic_dns_cache_refresh() once the mutex is released.
+ */
+static int picoquic_dns_cache_mark_refresh(picoquic_dns_cache_entry_t* entry)
+{
+    if (entry->refresh_pending) {
+        return 0;
+    }
+    entry->refresh_pending = 1;
+    return 1;
+}
+
+/* Start the refresh thread of a marked entry. Must be called without the
+ * mutex, so that the thread creation does not block the other lookups.
+ */
+static void picoquic_dns_cache_refresh(const char* name)
+{
+    if (picoquic_dns_cache_start_refresh(name) != 0) {
+        picoquic_dns_cache_entry_t* entry;
+
+        pthread_mutex_lock(&g_picoquic_dns_cache_mutex);
+        if ((entry = picoquic_dns_cache_find(name, 0)) != NULL) {
+            entry->refresh_pending = 0;
+        }
+        pthread_mutex_unlock(&g_picoquic_dns_cache_mutex);
+    }
+}
+
+static int picoquic_dns_cache_get_ex(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_addresses, int max_addresses, int* is_name, int prefer_ipv4)
+{
+    int nb_addresses = 0;
+    uint64_t current_time = picoquic_current_time();
+    const uint64_t ttl = (uint64_t)CONFIG_PICOQUIC_DNS_CACHE_TTL_S * 1000000;
+    const uint64_t max_age = ttl + (uint64_t)CONFIG_PICOQUIC_DNS_CACHE_MAX_STALE_S * 1000000;
+    picoquic_dns_cache_entry_t* entry;
+    int do_refresh = 0;
+
+    if (max_addresses <= 0 || picoquic_dns_cache_is_numeric(ip_address_text) ||
+        strlen(ip_address_text) >= PICOQUIC_DNS_CACHE_NAME_MAX) {
+        /* Nothing worth caching */
+        if (prefer_ipv4) {
+            return (picoquic_get_server_address(ip_address_text, server_port, server_addresses, is_name) == 0) ? 1 : 0;
+        }
+        return picoquic_get_server_addresses(ip_address_text, server_port, server_addresses, max_addresses, is_name);
+    }
+
+    *is_name = 1;
+
+    pthread_mutex_lock(&g_picoquic_dns_cache_mutex);
+    entry = picoquic_dns_cache_find(ip_address_text, 0);
+    if (entry != NULL && entry->nb_addresses > 0 && current_time - entry->resolved_time < max_age) {
+        /* Fresh or stale entry, refresh stale ones in the background */
+        nb_addresses = picoquic_dns_cache_copy(entry, server_port, server_addresses, max_addresses, prefer_ipv4);
+        entry->last_used = current_time;
+        if (current_time - entry->resolved_time >= ttl) {
+            do_refresh = picoquic_dns_cache_mark_refresh(entry);
+        }
+    }
+    pthread_mutex_unlock(&g_picoquic_dns_cache_mutex);
+
+    if (nb_addresses == 0) {
+        /* Missing or too old: blocking lookup, with a single query for both
+         * families. If it only returned one family, as lwIP does, the other
+         * one is resolved in the background. */
+        struct sockaddr_storage addresses[PICOQUIC_DNS_CACHE_ADDRESSES];
+        int resolved_is_name = 0;
+        int nb_resolved = picoquic_get_server_addresses_single_query(ip_address_text, 0, addresses,
+            PICOQUIC_DNS_CACHE_ADDRESSES, &resolved_is_name);
+
+        current_time = picoquic_current_time();
+        pthread_mutex_lock(&g_picoquic_dns_cache_mutex);
+        entry = picoquic_dns_cache_find(ip_address_text, nb_resolved > 0);
+        if (entry != NULL) {
+            if (nb_resolved > 0) {
+                picoquic_dns_cache_store(entry, addresses, nb_resolved, current_time);
+                if (nb_resolved == 1 && picoquic_socket_af_is_supported(AF_INET6)) {
+                    do_refresh = picoquic_dns_cache_mark_refresh(entry);
+                }
+            }
+            else if (entry->nb_addresses > 0) {
+                DBG_PRINTF("Cannot resolve %s, using the expired cache entry\n", ip_address_text);
+            }
+            entry->last_used = current_time;
+            nb_addresses = picoquic_dns_cache_copy(entry, server_port, server_addresses, max_addresses, prefer_ipv4);
+        }
+        pthread_mutex_unlock(&g_picoquic_dns_cache_mutex);
+    }
+
+    if (do_refresh) {
+        picoquic_dns_cache_refresh(ip_address_text);
+    }
+    if (nb_addresses == 0) {
+        *is_name = 0;
+    }
+
+    return nb_addresses;
+}
+
+int picoquic_dns_cache_get_server_address(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_address, int* is_name)
+{
+    return (picoquic_dns_cache_get_ex(ip_address_text, server_port, server_address, 1, is_name, 1) == 1) ? 0 : -1;
+}
+
+int picoquic_dns_cache_get_server_addresses(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_addresses, int max_addresses, int* is_name)
+{
+    return picoquic_dns_cache_get_ex(ip_address_text, server_port, server_addresses, max_addresses, is_name, 0);
+}
+
+void picoquic_dns_cache_prefetch(const char* name)
+{
+    picoquic_dns_cache_entry_t* entry;
+    int do_refresh = 0;
+
+    if (picoquic_dns_cache_is_numeric(name) || strlen(name) >= PICOQUIC_DNS_CACHE_NAME_MAX) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_picoquic_dns_cache_mutex);
+    entry = picoquic_dns_cache_find(name, 1);
+    if (entry->nb_addresses == 0 ||
+        picoquic_current_time() - entry->resolved_time >= (uint64_t)CONFIG_PICOQUIC_DNS_CACHE_TTL_S * 1000000) {
+        entry->last_used = picoquic_current_time();
+        do_refresh = picoquic_dns_cache_mark_refresh(entry);
+    }
+    pthread_mutex_unlock(&g_picoquic_dns_cache_mutex);
+
+    if (do_refresh) {
+        picoquic_dns_cache_refresh(name);
+    }
+}
+
+void picoquic_dns_cache_flush(void)
+{
+    pthread_mutex_lock(&g_picoquic_dns_cache_mutex);
+    for (int i = 0; i < CONFIG_PICOQUIC_DNS_CACHE_SIZE; i++) {
+        /* Pending refreshes find no entry and are dropped */
+        memset(&g_picoquic_dns_cache[i], 0, sizeof(picoquic_dns_cache_entry_t));
+    }
+    pthread_mutex_unlock(&g_picoquic_dns_cache_mutex);
+}
@@ -0,0 +1,412 @@
+/*
+ * Picoquic ESP-IDF binary logging backend
+ *
+ * Implements a picoquic_unified_logging_t vtable that stores fixed-size
+ * records in a lock-free ring buffer.
+ */
+
+#include "picoquic_esp_binlog.h"
+#include "picoquic_esp_cc_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picoquic_internal.h"
+#include "picoquic_unified_log.h"
+#include "picoquic_utils.h"
+#include "sdkconfig.h"
+
+#if defined(ESP_PLATFORM) && !CONFIG_IDF_TARGET_LINUX
+#include "esp_heap_caps.h"
+#endif
+
+/* Records copied per write_fn call when dumping */
+#define PICOQUIC_ESP_BINLOG_DUMP_CHUNK 16
+
+struct st_picoquic_esp_binlog_t {
+    picoquic_esp_binlog_record_t* records;
+    uint32_t nb_records;
+    uint32_t head;
+    /* Interned loss trigger names, compared by address */
+    const char* triggers[PICOQUIC_ESP_BINLOG_MAX_TRIGGERS];
+};
+
+/* As for the text backend, F_log must remain a valid FILE*, so the ring is
+ * kept in a static global: one ring for all the contexts of the application.
+ */
+static picoquic_esp_binlog_t* g_picoquic_esp_binlog = NULL;
+
+picoquic_esp_binlog_t* picoquic_esp_binlog_create(size_t nb_records, int use_psram)
+{
+    picoquic_esp_binlog_t* binlog = (picoquic_esp_binlog_t*)malloc(sizeof(picoquic_esp_binlog_t));
+    uint32_t n = 1;
+    size_t records_size;
+
+    if (binlog == NULL) {
+        return NULL;
+    }
+    memset(binlog, 0, sizeof(picoquic_esp_binlog_t));
+
+    while (n < nb_records && n < 0x40000000) {
+        n <<= 1;
+    }
+    records_size = (size_t)n * sizeof(picoquic_esp_binlog_record_t);
+#if defined(ESP_PLATFORM) && !CONFIG_IDF_TARGET_LINUX
+    if (use_psram) {
+        binlog->records = (picoquic_esp_binlog_record_t*)heap_caps_malloc(records_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+#else
+    (void)use_psram;
+#endif
+    if (binlog->records == NULL) {
+        binlog->records = (picoquic_esp_binlog_record_t*)malloc(records_size);
+    }
+    if (binlog->records == NULL) {
+        free(binlog);
+        return NULL;
+    }
+    memset(binlog->records, 0, records_size);
+    binlog->nb_records = n;
+
+    return binlog;
+}
+
+void picoquic_esp_binlog_delete(picoquic_esp_binlog_t* binlog)
+{
+    if (binlog != NULL) {
+        /* heap_caps_malloc() memory is released with free() as well */
+        free(binlog->records);
+        free(binlog);
+    }
+}
+
+uint32_t picoquic_esp_binlog_get_count(picoquic_esp_binlog_t* binlog)
+{
+    return __atomic_load_n(&binlog->head, __ATOMIC_RELAXED);
+}
+
+static picoquic_esp_binlog_record_t* picoquic_esp_binlog_reserve(picoquic_esp_binlog_t* binlog, uint32_t* seq)
+{
+    uint32_t index = __atomic_fetch_add(&binlog->head, 1, __ATOMIC_RELAXED);
+    picoquic_esp_binlog_record_t* record = &binlog->records[index & (binlog->nb_records - 1)];
+
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    *seq = index + 1;
+
+    return record;
+}
+
+static void picoquic_esp_binlog_commit(picoquic_esp_binlog_record_t* record, uint32_t seq)
+{
+    __atomic_store_n(&record->seq, seq, __ATOMIC_RELEASE);
+}
+
+static void picoquic_esp_binlog_add(uint8_t event, uint8_t ptype, uint8_t flags, uint8_t arg,
+    uint32_t length, uint32_t arg32, uint64_t current_time, uint64_t cid64, uint64_t number)
+{
+    picoquic_esp_binlog_t* binlog = g_picoquic_esp_binlog;
+    picoquic_esp_binlog_record_t* record;
+    uint32_t seq;
+
+    if (binlog == NULL) {
+        return;
+    }
+    record = picoquic_esp_binlog_reserve(binlog, &seq);
+    record->event = event;
+    record->ptype = ptype;
+    record->flags = flags;
+    record->arg = arg;
+    record->length = length;
+    record->arg32 = arg32;
+    record->time = current_time;
+    record->cid64 = cid64;
+    record->number = number;
+    picoquic_esp_binlog_commit(record, seq);
+}
+
+static uint64_t picoquic_esp_binlog_cid64(picoquic_cnx_t* cnx)
+{
+    return picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx));
+}
+
+/* Index of a loss trigger name, interned on first use */
+static uint8_t picoquic_esp_binlog_trigger_index(char const* trigger)
+{
+    picoquic_esp_binlog_t* binlog = g_picoquic_esp_binlog;
+
+    if (binlog == NULL || trigger == NULL) {
+        return 0xFF;
+    }
+    for (int i = 0; i < PICOQUIC_ESP_BINLOG_MAX_TRIGGERS; i++) {
+        const char* known = __atomic_load_n(&binlog->triggers[i], __ATOMIC_ACQUIRE);
+        if (known == NULL) {
+            const char* expected = NULL;
+            if (__atomic_compare_exchange_n(&binlog->triggers[i], &expected, trigger, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return (uint8_t)i;
+            }
+            known = expected;
+        }
+        if (known == trigger) {
+            return (uint8_t)i;
+        }
+    }
+    return 0xFF;
+}
+
+static uint8_t picoquic_esp_binlog_outgoing_ptype(const uint8_t* bytes)
+{
+    if (bytes == NULL) {
+        return 0xFF;
+    }
+    if ((bytes[0] & 0x80) == 0) {
+        return (uint8_t)picoquic_packet_1rtt_protected;
+    }
+    /* QUIC v1 long header types */
+    switch ((bytes[0] >> 4) & 0x03) {
+    case 0: return (uint8_t)picoquic_packet_initial;
+    case 1: return (uint8_t)picoquic_packet_0rtt_protected;
+    case 2: return (uint8_t)picoquic_packet_handshake;
+    default: return (uint8_t)picoquic_packet_retry;
+    }
+}
+
+static void binlog_quic_app_message(picoquic_quic_t* quic, const picoquic_connection_id_t* cid,
+    const char* fmt, va_list vargs)
+{
+    (void)vargs;
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_app_message, 0xFF, 0, 0, 0, 0,
+        picoquic_get_quic_time(quic), (cid != NULL) ? picoquic_val64_connection_id(*cid) : 0,
+        (uint64_t)(uintptr_t)fmt);
+}
+
+static void binlog_quic_pdu(picoquic_quic_t* quic, int receiving, uint64_t current_time, uint64_t cid64,
+    const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length)
+{
+    (void)quic;
+    (void)addr_peer;
+    (void)addr_local;
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_pdu, 0xFF,
+        (receiving != 0) ? PICOQUIC_ESP_BINLOG_FLAG_RECEIVING : 0, 0,
+        (uint32_t)packet_length, 0, current_time, cid64, 0);
+}
+
+static void binlog_quic_close(picoquic_quic_t* quic)
+{
+    quic->F_log = NULL;
+    quic->text_log_fns = NULL;
+    quic->should_close_log = 0;
+}
+
+static void binlog_app_message(picoquic_cnx_t* cnx, const char* fmt, va_list vargs)
+{
+    (void)vargs;
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_app_message, 0xFF, 0, 0, 0, 0,
+        picoquic_get_quic_time(cnx->quic), picoquic_esp_binlog_cid64(cnx), (uint64_t)(uintptr_t)fmt);
+}
+
+static void binlog_pdu(picoquic_cnx_t* cnx, int receiving, uint64_t current_time,
+    const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length,
+    uint64_t unique_path_id, unsigned char ecn)
+{
+    (void)addr_peer;
+    (void)addr_local;
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_pdu, 0xFF,
+        (receiving != 0) ? PICOQUIC_ESP_BINLOG_FLAG_RECEIVING : 0, ecn,
+        (uint32_t)packet_length, (uint32_t)unique_path_id, current_time, picoquic_esp_binlog_cid64(cnx), 0);
+}
+
+static void binlog_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, int receiving, uint64_t current_time,
+    struct st_picoquic_packet_header_t* ph, const uint8_t* bytes, size_t bytes_max)
+{
+    (void)path_x;
+    (void)bytes;
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_packet, (uint8_t)ph->ptype,
+        (receiving != 0) ? PICOQUIC_ESP_BINLOG_FLAG_RECEIVING : 0, 0,
+        (uint32_t)bytes_max, 0, current_time, picoquic_esp_binlog_cid64(cnx), ph->pn64);
+}
+
+static void binlog_dropped_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    struct st_picoquic_packet_header_t* ph, size_t packet_size, int err, uint64_t current_time)
+{
+    (void)path_x;
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_dropped, (uint8_t)ph->ptype,
+        PICOQUIC_ESP_BINLOG_FLAG_RECEIVING, 0, (uint32_t)packet_size, (uint32_t)err,
+        current_time, picoquic_esp_binlog_cid64(cnx), ph->pn64);
+}
+
+static void binlog_buffered_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_type_enum ptype, uint64_t current_time)
+{
+    (void)path_x;
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_buffered, (uint8_t)ptype,
+        PICOQUIC_ESP_BINLOG_FLAG_RECEIVING, 0, 0, 0, current_time, picoquic_esp_binlog_cid64(cnx), 0);
+}
+
+static void binlog_outgoing_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    uint8_t* bytes, uint64_t sequence_number, size_t pn_length, size_t length,
+    uint8_t* send_buffer, size_t send_length, uint64_t current_time)
+{
+    (void)path_x;
+    (void)pn_length;
+    (void)send_buffer;
+    (void)send_length;
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_sent, picoquic_esp_binlog_outgoing_ptype(bytes), 0, 0,
+        (uint32_t)length, 0, current_time, picoquic_esp_binlog_cid64(cnx), sequence_number);
+}
+
+static void binlog_packet_lost(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    picoquic_packet_type_enum ptype, uint64_t sequence_number, char const* trigger,
+    picoquic_connection_id_t* dcid, size_t packet_size, uint64_t current_time)
+{
+    (void)path_x;
+    (void)dcid;
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_lost, (uint8_t)ptype, 0,
+        picoquic_esp_binlog_trigger_index(trigger), (uint32_t)packet_size, 0,
+        current_time, picoquic_esp_binlog_cid64(cnx), sequence_number);
+}
+
+static void binlog_negotiated_alpn(picoquic_cnx_t* cnx, int is_local,
+    uint8_t const* sni, size_t sni_len, uint8_t const* alpn, size_t alpn_len,
+    const ptls_iovec_t* alpn_list, size_t alpn_count)
+{
+    (void)cnx;
+    (void)is_local;
+    (void)sni;
+    (void)sni_len;
+    (void)alpn;
+    (void)alpn_len;
+    (void)alpn_list;
+    (void)alpn_count;
+}
+
+static void binlog_transport_extension(picoquic_cnx_t* cnx, int is_local, size_t param_length, uint8_t* params)
+{
+    (void)cnx;
+    (void)is_local;
+    (void)param_length;
+    (void)params;
+}
+
+static void binlog_tls_ticket(picoquic_cnx_t* cnx, uint8_t* ticket, uint16_t ticket_length)
+{
+    (void)cnx;
+    (void)ticket;
+    (void)ticket_length;
+}
+
+static void binlog_new_connection(picoquic_cnx_t* cnx)
+{
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_new_connection, 0xFF,
+        (cnx->client_mode) ? 0 : PICOQUIC_ESP_BINLOG_FLAG_RECEIVING, 0, 0, 0,
+        picoquic_get_quic_time(cnx->quic), picoquic_esp_binlog_cid64(cnx), 0);
+}
+
+static void binlog_close_connection(picoquic_cnx_t* cnx)
+{
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_close_connection, 0xFF, 0, 0, 0, 0,
+        picoquic_get_quic_time(cnx->quic), picoquic_esp_binlog_cid64(cnx), 0);
+}
+
+static void binlog_cc_dump(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    picoquic_path_quality_t quality;
+    uint64_t cc_state = 0;
+    uint64_t cc_param = 0;
+
+    picoquic_esp_cc_trace_sample(cnx, current_time);
+    if (picoquic_get_default_path_quality(cnx, &quality) != 0) {
+        return;
+    }
+    if (cnx->congestion_alg != NULL && cnx->congestion_alg->alg_observe != NULL && cnx->nb_paths > 0) {
+        cnx->congestion_alg->alg_observe(cnx->path[0], &cc_state, &cc_param);
+    }
+    picoquic_esp_binlog_add(picoquic_esp_binlog_event_cc_dump, 0xFF, 0, (uint8_t)cc_state,
+        (uint32_t)quality.bytes_in_transit, (uint32_t)quality.rtt, current_time, picoquic_esp_binlog_cid64(cnx),
+        quality.cwin);
+}
+
+static struct st_picoquic_unified_logging_t binlog_functions = {
+    /* Per context log function */
+    binlog_quic_app_message,
+    binlog_quic_pdu,
+    binlog_quic_close,
+    /* Per connection functions */
+    binlog_app_message,
+    binlog_pdu,
+    binlog_packet,
+    binlog_dropped_packet,
+    binlog_buffered_packet,
+    binlog_outgoing_packet,
+    binlog_packet_lost,
+    binlog_negotiated_alpn,
+    binlog_transport_extension,
+    binlog_tls_ticket,
+    binlog_new_connection,
+    binlog_close_connection,
+    binlog_cc_dump
+};
+
+int picoquic_set_esp_binlog(picoquic_quic_t* quic, picoquic_esp_binlog_t* binlog)
+{
+    if (quic == NULL || binlog == NULL) {
+        return -1;
+    }
+
+    /* Close existing text logger (if any), respecting its own cleanup. */
+    if (quic->text_log_fns != NULL && quic->text_log_fns->log_quic_close != NULL) {
+        quic->text_log_fns->log_quic_close(quic);
+    }
+
+    g_picoquic_esp_binlog = binlog;
+
+    /* Any valid FILE* enables unified logging, nothing is written to it */
+    quic->F_log = stdout;
+    quic->text_log_fns = &binlog_functions;
+    quic->should_close_log = 0;
+
+    return 0;
+}
+
+int picoquic_esp_binlog_dump(picoquic_esp_binlog_t* binlog, picoquic_esp_binlog_write_fn write_fn, void* write_ctx)
+{
+    int ret;
+    uint32_t head;
+    picoquic_esp_binlog_header_t header;
+    picoquic_esp_binlog_record_t chunk[PICOQUIC_ESP_BINLOG_DUMP_CHUNK];
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PICOQUIC_ESP_BINLOG_MAGIC, sizeof(header.magic));
+    header.version = PICOQUIC_ESP_BINLOG_VERSION;
+    header.record_size = (uint16_t)sizeof(picoquic_esp_binlog_record_t);
+    header.nb_records = binlog->nb_records;
+    header.head = picoquic_esp_binlog_get_count(binlog);
+    header.dump_time = picoquic_current_time();
+    for (int i = 0; i < PICOQUIC_ESP_BINLOG_MAX_TRIGGERS; i++) {
+        const char* trigger = __atomic_load_n(&binlog->triggers[i], __ATOMIC_ACQUIRE);
+        if (trigger != NULL) {
+            strncpy(header.triggers[i], trigger, PICOQUIC_ESP_BINLOG_TRIGGER_LEN - 1);
+        }
+    }
+
+    ret = write_fn(write_ctx, (const uint8_t*)&header, sizeof(header));
+
+    for (uint32_t i = 0; ret == 0 && i < binlog->nb_records; i += PICOQUIC_ESP_BINLOG_DUMP_CHUNK) {
+        uint32_t nb = binlog->nb_records - i;
+
+        if (nb > PICOQUIC_ESP_BINLOG_DUMP_CHUNK) {
+            nb = PICOQUIC_ESP_BINLOG_DUMP_CHUNK;
+        }
+        memcpy(chunk, &binlog->records[i], nb * sizeof(picoquic_esp_binlog_record_t));
+        /* Clear the records that may have been overwritten while copying */
+        head = __atomic_load_n(&binlog->head, __ATOMIC_ACQUIRE);
+        for (uint32_t j = 0; j < nb; j++) {
+            if (chunk[j].seq != 0 && head - (chunk[j].seq - 1) > binlog->nb_records) {
+                chunk[j].seq = 0;
+            }
+        }
+        ret = write_fn(write_ctx, (const uint8_t*)chunk, nb * sizeof(picoquic_esp_binlog_record_t));
+    }
+
+    return ret;
+}
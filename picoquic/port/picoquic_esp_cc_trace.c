@@ -0,0 +1,297 @@
+/*
+ * Picoquic ESP-IDF congestion control trace
+ *
+ * Lock-free ring of congestion control samples, with CSV and qlog export.
+ */
+
+#include "picoquic_esp_cc_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picoquic_internal.h"
+#include "picoquic_utils.h"
+#include "sdkconfig.h"
+
+#if defined(ESP_PLATFORM) && !CONFIG_IDF_TARGET_LINUX
+#include "esp_heap_caps.h"
+#endif
+
+/* Connections whose last sample time is remembered for min_interval */
+#define PICOQUIC_ESP_CC_TRACE_MAX_CNX 8
+/* Connections whose state changes are followed in the qlog export */
+#define PICOQUIC_ESP_CC_TRACE_EXPORT_MAX_CNX 16
+
+typedef struct st_picoquic_esp_cc_trace_cnx_t {
+    picoquic_cnx_t* cnx;
+    uint64_t last_time;
+    uint32_t last_state;
+} picoquic_esp_cc_trace_cnx_t;
+
+struct st_picoquic_esp_cc_trace_t {
+    picoquic_esp_cc_sample_t* samples;
+    uint32_t nb_samples;
+    uint32_t head;
+    uint64_t min_interval;
+    picoquic_esp_cc_trace_cnx_t cnx[PICOQUIC_ESP_CC_TRACE_MAX_CNX];
+    uint32_t cnx_next;
+};
+
+/* As for the binary log, one trace for all the contexts of the application */
+static picoquic_esp_cc_trace_t* g_picoquic_esp_cc_trace = NULL;
+
+picoquic_esp_cc_trace_t* picoquic_esp_cc_trace_create(size_t nb_samples, uint64_t min_interval, int use_psram)
+{
+    picoquic_esp_cc_trace_t* trace = (picoquic_esp_cc_trace_t*)malloc(sizeof(picoquic_esp_cc_trace_t));
+    uint32_t n = 1;
+    size_t samples_size;
+
+    if (trace == NULL) {
+        return NULL;
+    }
+    memset(trace, 0, sizeof(picoquic_esp_cc_trace_t));
+
+    while (n < nb_samples && n < 0x40000000) {
+        n <<= 1;
+    }
+    samples_size = (size_t)n * sizeof(picoquic_esp_cc_sample_t);
+#if defined(ESP_PLATFORM) && !CONFIG_IDF_TARGET_LINUX
+    if (use_psram) {
+        trace->samples = (picoquic_esp_cc_sample_t*)heap_caps_malloc(samples_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+#else
+    (void)use_psram;
+#endif
+    if (trace->samples == NULL) {
+        trace->samples = (picoquic_esp_cc_sample_t*)malloc(samples_size);
+    }
+    if (trace->samples == NULL) {
+        free(trace);
+        return NULL;
+    }
+    memset(trace->samples, 0, samples_size);
+    trace->nb_samples = n;
+    trace->min_interval = min_interval;
+
+    return trace;
+}
+
+void picoquic_esp_cc_trace_delete(picoquic_esp_cc_trace_t* trace)
+{
+    if (trace != NULL) {
+        free(trace->samples);
+        free(trace);
+    }
+}
+
+void picoquic_set_esp_cc_trace(picoquic_quic_t* quic, picoquic_esp_cc_trace_t* trace)
+{
+    if (trace != NULL) {
+        /* Otherwise the cc dump events stop after the first packets of each connection */
+        picoquic_set_log_level(quic, 1);
+    }
+    __atomic_store_n(&g_picoquic_esp_cc_trace, trace, __ATOMIC_RELEASE);
+}
+
+/* Returns 1 if a sample of cnx in state cc_state is due, and remembers it.
+ * The table is only a filter: races between contexts cost an extra or a
+ * missing sample. */
+static int picoquic_esp_cc_trace_is_due(picoquic_esp_cc_trace_t* trace, picoquic_cnx_t* cnx,
+    uint32_t cc_state, uint64_t current_time)
+{
+    picoquic_esp_cc_trace_cnx_t* tcnx = NULL;
+
+    for (int i = 0; i < PICOQUIC_ESP_CC_TRACE_MAX_CNX; i++) {
+        if (trace->cnx[i].cnx == cnx) {
+            tcnx = &trace->cnx[i];
+            break;
+        }
+    }
+    if (tcnx == NULL) {
+        tcnx = &trace->cnx[trace->cnx_next++ % PICOQUIC_ESP_CC_TRACE_MAX_CNX];
+        tcnx->cnx = cnx;
+    }
+    else if (tcnx->last_state == cc_state && current_time < tcnx->last_time + trace->min_interval) {
+        return 0;
+    }
+    tcnx->last_time = current_time;
+    tcnx->last_state = cc_state;
+
+    return 1;
+}
+
+void picoquic_esp_cc_trace_sample(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    picoquic_esp_cc_trace_t* trace = __atomic_load_n(&g_picoquic_esp_cc_trace, __ATOMIC_ACQUIRE);
+    picoquic_path_quality_t quality;
+    picoquic_esp_cc_sample_t* sample;
+    uint64_t cc_state = 0;
+    uint64_t cc_param = 0;
+    uint32_t index;
+
+    if (trace == NULL || cnx->nb_paths < 1) {
+        return;
+    }
+    if (cnx->congestion_alg != NULL && cnx->congestion_alg->alg_observe != NULL) {
+        cnx->congestion_alg->alg_observe(cnx->path[0], &cc_state, &cc_param);
+    }
+    if (!picoquic_esp_cc_trace_is_due(trace, cnx, (uint32_t)cc_state, current_time) ||
+        picoquic_get_default_path_quality(cnx, &quality) != 0) {
+        return;
+    }
+
+    index = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    sample = &trace->samples[index & (trace->nb_samples - 1)];
+    __atomic_store_n(&sample->seq, 0, __ATOMIC_RELAXED);
+    sample->cc_state = (uint32_t)cc_state;
+    sample->time = current_time;
+    sample->cid64 = picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx));
+    sample->cwin = quality.cwin;
+    sample->bytes_in_transit = quality.bytes_in_transit;
+    sample->rtt_min = (uint32_t)quality.rtt_min;
+    sample->smoothed_rtt = (uint32_t)quality.rtt;
+    sample->pacing_rate = quality.pacing_rate;
+    __atomic_store_n(&sample->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t picoquic_esp_cc_trace_get_count(picoquic_esp_cc_trace_t* trace)
+{
+    uint32_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+
+    return (head < trace->nb_samples) ? head : trace->nb_samples;
+}
+
+int picoquic_esp_cc_trace_get(picoquic_esp_cc_trace_t* trace, uint32_t index, picoquic_esp_cc_sample_t* sample)
+{
+    uint32_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    uint32_t count = (head < trace->nb_samples) ? head : trace->nb_samples;
+    uint32_t seq;
+
+    if (index >= count) {
+        return -1;
+    }
+    seq = head - count + index + 1;
+    memcpy(sample, &trace->samples[(seq - 1) & (trace->nb_samples - 1)], sizeof(picoquic_esp_cc_sample_t));
+    /* Skip samples being written, or overwritten while copying */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (sample->seq != seq || __atomic_load_n(&trace->head, __ATOMIC_RELAXED) - seq >= trace->nb_samples) {
+        return -1;
+    }
+    return 0;
+}
+
+int picoquic_esp_cc_trace_export_csv(picoquic_esp_cc_trace_t* trace, picoquic_esp_cc_trace_write_fn write_fn, void* write_ctx)
+{
+    static const char header[] = "time_us,cid64,cc_state,cwin,bytes_in_transit,rtt_min_us,smoothed_rtt_us,pacing_rate_Bps\n";
+    uint32_t count = picoquic_esp_cc_trace_get_count(trace);
+    int ret = write_fn(write_ctx, (const uint8_t*)header, sizeof(header) - 1);
+
+    for (uint32_t i = 0; ret == 0 && i < count; i++) {
+        picoquic_esp_cc_sample_t sample;
+        char line[160];
+        int len;
+
+        if (picoquic_esp_cc_trace_get(trace, i, &sample) != 0) {
+            continue;
+        }
+        len = snprintf(line, sizeof(line), "%llu,%016llx,%u,%llu,%llu,%u,%u,%llu\n",
+            (unsigned long long)sample.time, (unsigned long long)sample.cid64, (unsigned)sample.cc_state,
+            (unsigned long long)sample.cwin, (unsigned long long)sample.bytes_in_transit,
+            (unsigned)sample.rtt_min, (unsigned)sample.smoothed_rtt, (unsigned long long)sample.pacing_rate);
+        if (len > 0 && (size_t)len < sizeof(line)) {
+            ret = write_fn(write_ctx, (const uint8_t*)line, (size_t)len);
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_esp_cc_trace_export_qlog(picoquic_esp_cc_trace_t* trace, picoquic_esp_cc_trace_write_fn write_fn, void* write_ctx)
+{
+    static const char header[] = "{\"qlog_version\":\"0.3\",\"qlog_format\":\"JSON\",\"title\":\"picoquic cc trace\","
+        "\"traces\":[{\"vantage_point\":{\"type\":\"unknown\"},\"common_fields\":{\"time_format\":\"relative\",";
+    static const char trailer[] = "\n]}]}\n";
+    struct {
+        uint64_t cid64;
+        uint32_t state;
+    } states[PICOQUIC_ESP_CC_TRACE_EXPORT_MAX_CNX];
+    int nb_states = 0;
+    uint32_t count = picoquic_esp_cc_trace_get_count(trace);
+    uint64_t reference_time = 0;
+    int first_event = 1;
+    char line[320];
+    int len;
+    int ret;
+
+    /* The reference time is the time of the oldest sample */
+    for (uint32_t i = 0; i < count; i++) {
+        picoquic_esp_cc_sample_t sample;
+        if (picoquic_esp_cc_trace_get(trace, i, &sample) == 0) {
+            reference_time = sample.time;
+            break;
+        }
+    }
+
+    ret = write_fn(write_ctx, (const uint8_t*)header, sizeof(header) - 1);
+    if (ret == 0) {
+        len = snprintf(line, sizeof(line), "\"reference_time\":%llu.%03u},\"events\":[",
+            (unsigned long long)(reference_time / 1000), (unsigned)(reference_time % 1000));
+        ret = write_fn(write_ctx, (const uint8_t*)line, (size_t)len);
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < count; i++) {
+        picoquic_esp_cc_sample_t sample;
+        uint64_t t;
+        int state_changed = 0;
+        int j;
+
+        if (picoquic_esp_cc_trace_get(trace, i, &sample) != 0 || sample.time < reference_time) {
+            continue;
+        }
+        t = sample.time - reference_time;
+
+        j = 0;
+        while (j < nb_states && states[j].cid64 != sample.cid64) {
+            j++;
+        }
+        if (j == nb_states && nb_states < PICOQUIC_ESP_CC_TRACE_EXPORT_MAX_CNX) {
+            states[nb_states].cid64 = sample.cid64;
+            states[nb_states].state = sample.cc_state;
+            nb_states++;
+            state_changed = 1;
+        }
+        else if (j < nb_states && states[j].state != sample.cc_state) {
+            states[j].state = sample.cc_state;
+            state_changed = 1;
+        }
+
+        if (state_changed) {
+            len = snprintf(line, sizeof(line), "%s\n{\"time\":%llu.%03u,\"name\":\"recovery:congestion_state_updated\","
+                "\"group_id\":\"%016llx\",\"data\":{\"new\":\"%u\"}}",
+                (first_event) ? "" : ",", (unsigned long long)(t / 1000), (unsigned)(t % 1000),
+                (unsigned long long)sample.cid64, (unsigned)sample.cc_state);
+            first_event = 0;
+            ret = write_fn(write_ctx, (const uint8_t*)line, (size_t)len);
+        }
+        if (ret == 0) {
+            len = snprintf(line, sizeof(line), "%s\n{\"time\":%llu.%03u,\"name\":\"recovery:metrics_updated\","
+                "\"group_id\":\"%016llx\",\"data\":{\"congestion_window\":%llu,\"bytes_in_flight\":%llu,"
+                "\"min_rtt\":%u.%03u,\"smoothed_rtt\":%u.%03u,\"pacing_rate\":%llu}}",
+                (first_event) ? "" : ",", (unsigned long long)(t / 1000), (unsigned)(t % 1000),
+                (unsigned long long)sample.cid64, (unsigned long long)sample.cwin,
+                (unsigned long long)sample.bytes_in_transit,
+                (unsigned)(sample.rtt_min / 1000), (unsigned)(sample.rtt_min % 1000),
+                (unsigned)(sample.smoothed_rtt / 1000), (unsigned)(sample.smoothed_rtt % 1000),
+                (unsigned long long)(sample.pacing_rate * 8));
+            first_event = 0;
+            ret = write_fn(write_ctx, (const uint8_t*)line, (size_t)len);
+        }
+    }
+
+    if (ret == 0) {
+        ret = write_fn(write_ctx, (const uint8_t*)trailer, sizeof(trailer) - 1);
+    }
+
+    return ret;
+}
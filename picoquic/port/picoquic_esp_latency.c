@@ -0,0 +1,218 @@
+/*
+ * Picoquic ESP-IDF latency histograms
+ *
+ * Bucket i < SUB_COUNT holds the value i. Above, each power of 2 from
+ * 2^SUB_BITS is split in SUB_COUNT buckets of equal width.
+ */
+
+#include "picoquic_esp_latency.h"
+
+#include <string.h>
+
+#include "picoquic_internal.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_log.h"
+#endif
+
+static uint32_t picoquic_esp_histogram_index(uint64_t value)
+{
+    int e = 63 - __builtin_clzll(value | 1);
+
+    if (value < PICOQUIC_ESP_HISTOGRAM_SUB_COUNT) {
+        return (uint32_t)value;
+    }
+    if (e >= PICOQUIC_ESP_HISTOGRAM_MAX_BITS) {
+        return PICOQUIC_ESP_HISTOGRAM_NB_BUCKETS - 1;
+    }
+    return (uint32_t)(e - PICOQUIC_ESP_HISTOGRAM_SUB_BITS + 1) * PICOQUIC_ESP_HISTOGRAM_SUB_COUNT +
+        (uint32_t)((value >> (e - PICOQUIC_ESP_HISTOGRAM_SUB_BITS)) & (PICOQUIC_ESP_HISTOGRAM_SUB_COUNT - 1));
+}
+
+/* Largest value of bucket index */
+static uint64_t picoquic_esp_histogram_bucket_max(uint32_t index)
+{
+    uint32_t group = index / PICOQUIC_ESP_HISTOGRAM_SUB_COUNT;
+    uint32_t sub = index % PICOQUIC_ESP_HISTOGRAM_SUB_COUNT;
+    int shift;
+
+    if (group == 0) {
+        return sub;
+    }
+    shift = (int)group - 1;
+    return (((uint64_t)PICOQUIC_ESP_HISTOGRAM_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void picoquic_esp_histogram_reset(picoquic_esp_histogram_t* histogram)
+{
+    memset(histogram, 0, sizeof(picoquic_esp_histogram_t));
+}
+
+void picoquic_esp_histogram_record(picoquic_esp_histogram_t* histogram, uint64_t value)
+{
+    if (histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->sum += value;
+    histogram->buckets[picoquic_esp_histogram_index(value)]++;
+    histogram->count++;
+}
+
+void picoquic_esp_histogram_merge(picoquic_esp_histogram_t* dst, const picoquic_esp_histogram_t* src)
+{
+    if (src->count == 0) {
+        return;
+    }
+    if (dst->count == 0 || src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    dst->sum += src->sum;
+    for (int i = 0; i < PICOQUIC_ESP_HISTOGRAM_NB_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+}
+
+uint64_t picoquic_esp_histogram_percentile(const picoquic_esp_histogram_t* histogram, double percentile)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+    if (percentile >= 100.0) {
+        return histogram->max;
+    }
+    rank = (percentile > 0.0) ? (uint64_t)((percentile * (double)histogram->count) / 100.0 + 0.999999) : 1;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (uint32_t i = 0; i < PICOQUIC_ESP_HISTOGRAM_NB_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = picoquic_esp_histogram_bucket_max(i);
+            if (value > histogram->max) {
+                value = histogram->max;
+            }
+            return (value < histogram->min) ? histogram->min : value;
+        }
+    }
+    /* Only if the buckets were changed while reading */
+    return histogram->max;
+}
+
+void picoquic_esp_histogram_log(const picoquic_esp_histogram_t* histogram, const char* tag, const char* name)
+{
+#ifdef ESP_PLATFORM
+    if (tag == NULL || tag[0] == 0) {
+        tag = "picoquic";
+    }
+    if (histogram->count == 0) {
+        ESP_LOGI(tag, "%s: no samples", name);
+        return;
+    }
+    ESP_LOGI(tag, "%s: n %llu, min %llu, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu, mean %llu (us)",
+        name, (unsigned long long)histogram->count, (unsigned long long)histogram->min,
+        (unsigned long long)picoquic_esp_histogram_percentile(histogram, 50.0),
+        (unsigned long long)picoquic_esp_histogram_percentile(histogram, 90.0),
+        (unsigned long long)picoquic_esp_histogram_percentile(histogram, 99.0),
+        (unsigned long long)picoquic_esp_histogram_percentile(histogram, 99.9),
+        (unsigned long long)histogram->max, (unsigned long long)(histogram->sum / histogram->count));
+#else
+    (void)histogram;
+    (void)tag;
+    (void)name;
+#endif
+}
+
+void picoquic_esp_latency_reset(picoquic_esp_latency_t* latency)
+{
+    memset(latency, 0, sizeof(picoquic_esp_latency_t));
+}
+
+void picoquic_esp_latency_on_ready(picoquic_esp_latency_t* latency, picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    uint64_t duration = (current_time > cnx->start_time) ? current_time - cnx->start_time : 0;
+
+    if (cnx->nb_zero_rtt_sent > 0 || cnx->nb_zero_rtt_received > 0) {
+        picoquic_esp_histogram_record(&latency->handshake_0rtt, duration);
+    }
+    else {
+        picoquic_esp_histogram_record(&latency->handshake_1rtt, duration);
+    }
+}
+
+void picoquic_esp_latency_on_write(picoquic_esp_latency_t* latency, uint64_t stream_id, uint64_t end_offset,
+    uint64_t current_time)
+{
+    uint32_t head = __atomic_load_n(&latency->write_head, __ATOMIC_RELAXED);
+    uint32_t index = head % PICOQUIC_ESP_LATENCY_MAX_WRITES;
+
+    if (head - __atomic_load_n(&latency->write_tail, __ATOMIC_ACQUIRE) >= PICOQUIC_ESP_LATENCY_MAX_WRITES) {
+        __atomic_fetch_add(&latency->writes_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    latency->writes[index].write_time = current_time;
+    latency->writes[index].stream_id = stream_id;
+    latency->writes[index].end_offset = end_offset;
+    __atomic_store_n(&latency->write_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns 1 if the peer acknowledged the bytes of stream_id before end_offset */
+static int picoquic_esp_latency_is_acked(picoquic_cnx_t* cnx, uint64_t stream_id, uint64_t end_offset)
+{
+    picoquic_stream_head_t* stream = picoquic_find_stream(cnx, stream_id);
+    picoquic_sack_item_t* first_range;
+
+    if (stream == NULL) {
+        /* Streams are deleted once all their data is acknowledged, or reset */
+        return 1;
+    }
+    if (end_offset == 0) {
+        return 1;
+    }
+    first_range = picoquic_sack_first_item(&stream->sack_list);
+    /* Ranges are inclusive */
+    return first_range != NULL && picoquic_sack_item_range_start(first_range) == 0 &&
+        picoquic_sack_item_range_end(first_range) + 1 >= end_offset;
+}
+
+void picoquic_esp_latency_check_acked(picoquic_esp_latency_t* latency, picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    uint32_t head = __atomic_load_n(&latency->write_head, __ATOMIC_ACQUIRE);
+    uint32_t tail = latency->write_tail;
+
+    while (tail != head) {
+        uint32_t index = tail % PICOQUIC_ESP_LATENCY_MAX_WRITES;
+        uint64_t write_time = latency->writes[index].write_time;
+
+        if (!picoquic_esp_latency_is_acked(cnx, latency->writes[index].stream_id, latency->writes[index].end_offset)) {
+            break;
+        }
+        picoquic_esp_histogram_record(&latency->write_to_ack,
+            (current_time > write_time) ? current_time - write_time : 0);
+        tail++;
+    }
+    __atomic_store_n(&latency->write_tail, tail, __ATOMIC_RELEASE);
+}
+
+void picoquic_esp_latency_log(const picoquic_esp_latency_t* latency, const char* tag)
+{
+    picoquic_esp_histogram_log(&latency->handshake_1rtt, tag, "handshake 1-RTT");
+    picoquic_esp_histogram_log(&latency->handshake_0rtt, tag, "handshake 0-RTT");
+    picoquic_esp_histogram_log(&latency->rtt, tag, "rtt");
+    picoquic_esp_histogram_log(&latency->write_to_ack, tag, "write to ack");
+#ifdef ESP_PLATFORM
+    if (latency->writes_dropped > 0) {
+        ESP_LOGI((tag != NULL && tag[0] != 0) ? tag : "picoquic", "write to ack: %u writes not tracked",
+            (unsigned)latency->writes_dropped);
+    }
+#endif
+}
@@ -5,71 +5,634 @@
  */
 
 #include "picoquic_esp_log.h"
+#include "picoquic_esp_cc_trace.h"
 
 #ifdef ESP_PLATFORM
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
 
 #include "picoquic_internal.h"
 #include "picoquic_unified_log.h"
+#include "sdkconfig.h"
+
+#ifndef CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS
+#define CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS 4
+#endif
+#ifndef CONFIG_PICOQUIC_ESP_LOG_QUEUE_LEN
+#define CONFIG_PICOQUIC_ESP_LOG_QUEUE_LEN 32
+#endif
+#ifndef CONFIG_PICOQUIC_ESP_LOG_TASK_PRIORITY
+#define CONFIG_PICOQUIC_ESP_LOG_TASK_PRIORITY 1
+#endif
 
 /* NOTE:
  * picoquic_quic_t::F_log is used in multiple places as a FILE* (e.g., fflush(quic->F_log)).
  * We must keep it a valid FILE* when logging is enabled.
  *
- * We keep our configuration in static globals (sufficient for typical ESP-IDF usage where
- * there is a single quic context in an application).
+ * picoquic_quic_t and picoquic_cnx_t have no room for backend data, so the
+ * configurations are kept in small static tables keyed by the context or
+ * connection pointer. Slots are claimed under a mutex; the logging callbacks
+ * look them up without locking.
  */
-static const char* g_picoquic_esp_log_tag = "picoquic";
-static int g_picoquic_esp_log_packets = 0;
+/* Packet events are sampled separately for each kind, so that the events
+ * of the other kinds do not shift the sampling phase. */
+typedef enum {
+    picoquic_esp_log_sample_pdu_rx = 0,
+    picoquic_esp_log_sample_pdu_tx,
+    picoquic_esp_log_sample_packet,
+    picoquic_esp_log_sample_outgoing,
+    picoquic_esp_log_nb_samples
+} picoquic_esp_log_sample_enum;
+
+/* The configuration is written in the buffer not in use and published with
+ * a single store of the config pointer, so readers always see one
+ * consistent configuration. */
+typedef struct st_picoquic_esp_log_slot_t {
+    const void* key;
+    const picoquic_esp_log_config_t* config;
+    picoquic_esp_log_config_t configs[2];
+    uint32_t sample_counts[picoquic_esp_log_nb_samples];
+    /* Tag raised to DEBUG for the packet events, and its level before */
+    const char* debug_tag;
+    esp_log_level_t previous_level;
+} picoquic_esp_log_slot_t;
+
+static picoquic_esp_log_slot_t g_picoquic_esp_log_contexts[CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS];
+static picoquic_esp_log_slot_t g_picoquic_esp_log_cnx[PICOQUIC_ESP_LOG_MAX_CNX_CONFIGS];
+static int g_picoquic_esp_log_nb_cnx = 0;
+static pthread_mutex_t g_picoquic_esp_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static picoquic_esp_log_slot_t* picoquic_esp_log_find(picoquic_esp_log_slot_t* slots, int nb_slots, const void* key)
+{
+    for (int i = 0; i < nb_slots; i++) {
+        if (__atomic_load_n(&slots[i].key, __ATOMIC_ACQUIRE) == key) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
 
-static const char* picoquic_esp_log_get_tag(picoquic_quic_t* quic)
+/* Raise tag to DEBUG for the packet events of slot, or give back the level
+ * the slot raised if tag is NULL or another tag. If another slot still
+ * raises the same tag, the level is handed over to it instead of being
+ * restored. Called with the mutex held.
+ */
+static void picoquic_esp_log_set_debug_tag(picoquic_esp_log_slot_t* slot, const char* tag)
 {
-    (void)quic;
-    return (g_picoquic_esp_log_tag != NULL && g_picoquic_esp_log_tag[0] != 0) ? g_picoquic_esp_log_tag : "picoquic";
+    picoquic_esp_log_slot_t* tables[2] = { g_picoquic_esp_log_contexts, g_picoquic_esp_log_cnx };
+    int table_sizes[2] = { CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS, PICOQUIC_ESP_LOG_MAX_CNX_CONFIGS };
+
+    if (slot->debug_tag != NULL && (tag == NULL || strcmp(tag, slot->debug_tag) != 0)) {
+        picoquic_esp_log_slot_t* other = NULL;
+
+        for (int t = 0; other == NULL && t < 2; t++) {
+            for (int i = 0; i < table_sizes[t]; i++) {
+                if (&tables[t][i] != slot && tables[t][i].debug_tag != NULL &&
+                    strcmp(tables[t][i].debug_tag, slot->debug_tag) == 0) {
+                    other = &tables[t][i];
+                    break;
+                }
+            }
+        }
+        if (other != NULL) {
+            other->previous_level = slot->previous_level;
+        }
+        else {
+            esp_log_level_set(slot->debug_tag, slot->previous_level);
+        }
+        slot->debug_tag = NULL;
+    }
+    if (tag != NULL && slot->debug_tag == NULL) {
+        /* Only works if ESP-IDF is built with dynamic log level control enabled */
+        slot->previous_level = esp_log_level_get(tag);
+        esp_log_level_set(tag, ESP_LOG_DEBUG);
+        slot->debug_tag = tag;
+    }
 }
 
-static int picoquic_esp_log_get_log_packets(picoquic_quic_t* quic)
+/* Set the configuration of key, or clear it if config is NULL, and update
+ * the number of keys in the table if nb_keys is not NULL.
+ * Returns 0, or -1 if the table is full.
+ */
+static int picoquic_esp_log_set_slot(picoquic_esp_log_slot_t* slots, int nb_slots, const void* key,
+    const picoquic_esp_log_config_t* config, int* nb_keys)
 {
-    (void)quic;
-    return g_picoquic_esp_log_packets;
+    int ret = 0;
+    picoquic_esp_log_slot_t* slot;
+
+    pthread_mutex_lock(&g_picoquic_esp_log_mutex);
+    slot = picoquic_esp_log_find(slots, nb_slots, key);
+    if (config == NULL) {
+        if (slot != NULL) {
+            __atomic_store_n(&slot->key, NULL, __ATOMIC_RELEASE);
+            picoquic_esp_log_set_debug_tag(slot, NULL);
+        }
+    }
+    else if (slot == NULL && (slot = picoquic_esp_log_find(slots, nb_slots, NULL)) == NULL) {
+        ret = -1;
+    }
+    else {
+        picoquic_esp_log_config_t* next = (slot->config == &slot->configs[0]) ? &slot->configs[1] : &slot->configs[0];
+
+        *next = *config;
+        if (next->tag == NULL || next->tag[0] == 0) {
+            next->tag = "picoquic";
+        }
+        if (slot->key != key) {
+            for (int i = 0; i < picoquic_esp_log_nb_samples; i++) {
+                __atomic_store_n(&slot->sample_counts[i], 0, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_store_n(&slot->config, next, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+        /* Packet logs are at DEBUG level, make them visible for this tag */
+        picoquic_esp_log_set_debug_tag(slot,
+            ((next->event_mask & PICOQUIC_ESP_LOG_EVENTS_PACKETS) != 0) ? next->tag : NULL);
+    }
+    if (nb_keys != NULL) {
+        int nb = 0;
+        for (int i = 0; i < nb_slots; i++) {
+            nb += (slots[i].key != NULL);
+        }
+        __atomic_store_n(nb_keys, nb, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&g_picoquic_esp_log_mutex);
+
+    return ret;
+}
+
+static picoquic_esp_log_slot_t* picoquic_esp_log_cnx_slot(picoquic_cnx_t* cnx)
+{
+    picoquic_esp_log_slot_t* slot = NULL;
+
+    if (__atomic_load_n(&g_picoquic_esp_log_nb_cnx, __ATOMIC_RELAXED) > 0) {
+        slot = picoquic_esp_log_find(g_picoquic_esp_log_cnx, PICOQUIC_ESP_LOG_MAX_CNX_CONFIGS, cnx);
+    }
+    if (slot == NULL) {
+        slot = picoquic_esp_log_find(g_picoquic_esp_log_contexts, CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS, cnx->quic);
+    }
+    return slot;
+}
+
+/* Returns the tag to log the event with, or NULL if it is filtered out.
+ * Packet events pass the counter they are sampled with, others -1.
+ */
+static const char* picoquic_esp_log_event_tag(picoquic_esp_log_slot_t* slot, uint32_t event, int sample)
+{
+    const picoquic_esp_log_config_t* config = (slot == NULL) ? NULL : __atomic_load_n(&slot->config, __ATOMIC_ACQUIRE);
+
+    if (config == NULL || (config->event_mask & event) == 0) {
+        return NULL;
+    }
+    if (sample >= 0 && config->packet_sampling > 1 &&
+        __atomic_fetch_add(&slot->sample_counts[sample], 1, __ATOMIC_RELAXED) % config->packet_sampling != 0) {
+        return NULL;
+    }
+    return config->tag;
+}
+
+static const char* picoquic_esp_log_quic_tag(picoquic_quic_t* quic, uint32_t event, int sample)
+{
+    return picoquic_esp_log_event_tag(
+        picoquic_esp_log_find(g_picoquic_esp_log_contexts, CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS, quic), event, sample);
+}
+
+static const char* picoquic_esp_log_cnx_tag(picoquic_cnx_t* cnx, uint32_t event)
+{
+    return picoquic_esp_log_event_tag(picoquic_esp_log_cnx_slot(cnx), event, -1);
+}
+
+static const char* picoquic_esp_log_cnx_packet_tag(picoquic_cnx_t* cnx, uint32_t event, int sample)
+{
+    return picoquic_esp_log_event_tag(picoquic_esp_log_cnx_slot(cnx), event, sample);
+}
+
+#if CONFIG_PICOQUIC_ESP_LOG_ASYNC
+/* Deferred formatting.
+ *
+ * The network task only copies the format pointer and the arguments into a
+ * queue entry; the log task formats and prints them. Since a va_list cannot
+ * be rebuilt, the log task formats one conversion at a time, which is why
+ * the arguments are stored with their type.
+ */
+#define PICOQUIC_ESP_LOG_MAX_ARGS 8
+#define PICOQUIC_ESP_LOG_STRINGS_LEN 64
+#define PICOQUIC_ESP_LOG_SPEC_MAX 16
+#define PICOQUIC_ESP_LOG_TASK_STACK_SIZE 4096
+
+typedef enum {
+    picoquic_esp_log_arg_invalid = 0,
+    picoquic_esp_log_arg_int,
+    picoquic_esp_log_arg_long,
+    picoquic_esp_log_arg_llong,
+    picoquic_esp_log_arg_size,
+    picoquic_esp_log_arg_ptr,
+    picoquic_esp_log_arg_double,
+    picoquic_esp_log_arg_str
+} picoquic_esp_log_arg_enum;
+
+typedef union {
+    long long i;
+    double d;
+    const void* p;
+} picoquic_esp_log_arg_t;
+
+typedef struct st_picoquic_esp_log_entry_t {
+    const char* fmt;
+    const char* tag;
+    uint8_t level;
+    uint8_t nb_args;
+    uint8_t types[PICOQUIC_ESP_LOG_MAX_ARGS];
+    picoquic_esp_log_arg_t args[PICOQUIC_ESP_LOG_MAX_ARGS];
+    char strings[PICOQUIC_ESP_LOG_STRINGS_LEN];
+} picoquic_esp_log_entry_t;
+
+/* One conversion specification: "%[flags][width][.precision][length]type" */
+typedef struct st_picoquic_esp_log_spec_t {
+    size_t length;
+    int nb_stars;
+    int precision_star;
+    int precision;
+    picoquic_esp_log_arg_enum type;
+} picoquic_esp_log_spec_t;
+
+static QueueHandle_t g_picoquic_esp_log_queue = NULL;
+static uint32_t g_picoquic_esp_log_dropped = 0;
+
+static void picoquic_esp_log_parse_spec(const char* p, picoquic_esp_log_spec_t* spec)
+{
+    const char* start = p++;
+    int nb_l = 0;
+    int is_size = 0;
+
+    memset(spec, 0, sizeof(picoquic_esp_log_spec_t));
+    spec->precision = -1;
+
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') {
+        p++;
+    }
+    if (*p == '*') {
+        spec->nb_stars++;
+        p++;
+    }
+    else {
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->nb_stars++;
+            spec->precision_star = 1;
+            p++;
+        }
+        else {
+            spec->precision = 0;
+            while (*p >= '0' && *p <= '9') {
+                spec->precision = spec->precision * 10 + (*p++ - '0');
+            }
+        }
+    }
+    while (*p == 'h' || *p == 'l' || *p == 'z' || *p == 'j' || *p == 't') {
+        if (*p == 'l') {
+            nb_l++;
+        }
+        else if (*p == 'j') {
+            nb_l = 2;
+        }
+        else if (*p != 'h') {
+            is_size = 1;
+        }
+        p++;
+    }
+
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        spec->type = (is_size) ? picoquic_esp_log_arg_size :
+            (nb_l >= 2) ? picoquic_esp_log_arg_llong :
+            (nb_l == 1) ? picoquic_esp_log_arg_long : picoquic_esp_log_arg_int;
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        spec->type = picoquic_esp_log_arg_double;
+        break;
+    case 's':
+        spec->type = picoquic_esp_log_arg_str;
+        break;
+    case 'p':
+        spec->type = picoquic_esp_log_arg_ptr;
+        break;
+    default:
+        /* %n, %L, wide strings or a malformed format: not supported */
+        spec->type = picoquic_esp_log_arg_invalid;
+        break;
+    }
+    if (*p != 0) {
+        p++;
+    }
+    spec->length = p - start;
+    if (spec->length >= PICOQUIC_ESP_LOG_SPEC_MAX) {
+        spec->type = picoquic_esp_log_arg_invalid;
+    }
+}
+
+/* Copy the arguments of fmt into the entry. Arguments that do not fit are
+ * dropped, and the message is printed up to the first missing one. */
+static void picoquic_esp_log_capture(picoquic_esp_log_entry_t* entry, const char* fmt, va_list vargs)
+{
+    const char* p = fmt;
+    size_t strings_used = 0;
+
+    entry->fmt = fmt;
+    entry->nb_args = 0;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        picoquic_esp_log_spec_t spec;
+        int star_value = -1;
+
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+        picoquic_esp_log_parse_spec(p, &spec);
+        if (spec.type == picoquic_esp_log_arg_invalid ||
+            entry->nb_args + spec.nb_stars + 1 > PICOQUIC_ESP_LOG_MAX_ARGS) {
+            break;
+        }
+        for (int i = 0; i < spec.nb_stars; i++) {
+            star_value = va_arg(vargs, int);
+            entry->types[entry->nb_args] = picoquic_esp_log_arg_int;
+            entry->args[entry->nb_args++].i = star_value;
+        }
+        if (spec.precision_star) {
+            spec.precision = star_value;
+        }
+
+        switch (spec.type) {
+        case picoquic_esp_log_arg_int:
+            entry->args[entry->nb_args].i = va_arg(vargs, int);
+            break;
+        case picoquic_esp_log_arg_long:
+            entry->args[entry->nb_args].i = va_arg(vargs, long);
+            break;
+        case picoquic_esp_log_arg_llong:
+            entry->args[entry->nb_args].i = va_arg(vargs, long long);
+            break;
+        case picoquic_esp_log_arg_size:
+            entry->args[entry->nb_args].i = (long long)va_arg(vargs, size_t);
+            break;
+        case picoquic_esp_log_arg_ptr:
+            entry->args[entry->nb_args].p = va_arg(vargs, void*);
+            break;
+        case picoquic_esp_log_arg_double:
+            entry->args[entry->nb_args].d = va_arg(vargs, double);
+            break;
+        default: {
+            /* The string may not outlive the call: copy it, as an offset in strings */
+            const char* s = va_arg(vargs, const char*);
+            size_t len;
+
+            if (s == NULL) {
+                s = "(null)";
+            }
+            /* With a precision, s does not need to be null terminated */
+            len = 0;
+            while (s[len] != 0 && (spec.precision < 0 || len < (size_t)spec.precision) &&
+                len < PICOQUIC_ESP_LOG_STRINGS_LEN - 1 - strings_used) {
+                len++;
+            }
+            memcpy(entry->strings + strings_used, s, len);
+            entry->strings[strings_used + len] = 0;
+            entry->args[entry->nb_args].i = (long long)strings_used;
+            strings_used += len + 1;
+            break;
+        }
+        }
+        entry->types[entry->nb_args++] = (uint8_t)spec.type;
+        p += spec.length;
+        if (strings_used >= PICOQUIC_ESP_LOG_STRINGS_LEN) {
+            break;
+        }
+    }
+}
+
+static void picoquic_esp_log_format(const picoquic_esp_log_entry_t* entry, char* buf, size_t buf_size)
+{
+    const char* p = entry->fmt;
+    size_t pos = 0;
+    int arg = 0;
+
+    while (*p != 0 && pos + 1 < buf_size) {
+        picoquic_esp_log_spec_t spec;
+        char spec_buf[PICOQUIC_ESP_LOG_SPEC_MAX + 24];
+        size_t spec_len = 0;
+        const picoquic_esp_log_arg_t* a;
+        int ret;
+
+        if (*p != '%') {
+            buf[pos++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            buf[pos++] = '%';
+            p += 2;
+            continue;
+        }
+        picoquic_esp_log_parse_spec(p, &spec);
+        if (spec.type == picoquic_esp_log_arg_invalid || arg + spec.nb_stars + 1 > entry->nb_args) {
+            /* Argument not captured */
+            ret = snprintf(buf + pos, buf_size - pos, "...");
+            pos += (ret > 0) ? (size_t)ret : 0;
+            break;
+        }
+        /* Replace the '*' by the captured width and precision */
+        for (size_t i = 0; i < spec.length; i++) {
+            if (p[i] == '*') {
+                spec_len += snprintf(spec_buf + spec_len, sizeof(spec_buf) - spec_len, "%d", (int)entry->args[arg++].i);
+            }
+            else {
+                spec_buf[spec_len++] = p[i];
+            }
+        }
+        spec_buf[spec_len] = 0;
+        p += spec.length;
+
+        a = &entry->args[arg++];
+        switch (spec.type) {
+        case picoquic_esp_log_arg_int:
+            ret = snprintf(buf + pos, buf_size - pos, spec_buf, (int)a->i);
+            break;
+        case picoquic_esp_log_arg_long:
+            ret = snprintf(buf + pos, buf_size - pos, spec_buf, (long)a->i);
+            break;
+        case picoquic_esp_log_arg_llong:
+            ret = snprintf(buf + pos, buf_size - pos, spec_buf, a->i);
+            break;
+        case picoquic_esp_log_arg_size:
+            ret = snprintf(buf + pos, buf_size - pos, spec_buf, (size_t)a->i);
+            break;
+        case picoquic_esp_log_arg_ptr:
+            ret = snprintf(buf + pos, buf_size - pos, spec_buf, a->p);
+            break;
+        case picoquic_esp_log_arg_double:
+            ret = snprintf(buf + pos, buf_size - pos, spec_buf, a->d);
+            break;
+        default:
+            ret = snprintf(buf + pos, buf_size - pos, spec_buf, entry->strings + a->i);
+            break;
+        }
+        if (ret > 0) {
+            pos += (size_t)ret;
+        }
+    }
+    if (pos >= buf_size) {
+        pos = buf_size - 1;
+    }
+    buf[pos] = 0;
+}
+
+static void picoquic_esp_log_task(void* arg)
+{
+    QueueHandle_t queue = (QueueHandle_t)arg;
+    picoquic_esp_log_entry_t entry;
+    uint32_t reported_dropped = 0;
+    char buf[256];
+
+    for (;;) {
+        uint32_t dropped;
+
+        if (xQueueReceive(queue, &entry, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        picoquic_esp_log_format(&entry, buf, sizeof(buf));
+        ESP_LOG_LEVEL_LOCAL((esp_log_level_t)entry.level, entry.tag, "%s", buf);
+
+        dropped = __atomic_load_n(&g_picoquic_esp_log_dropped, __ATOMIC_RELAXED);
+        if (dropped != reported_dropped) {
+            ESP_LOGW(entry.tag, "%u log messages dropped", (unsigned)(dropped - reported_dropped));
+            reported_dropped = dropped;
+        }
+    }
+}
+
+/* Start the formatter task once, even if several contexts install the
+ * logger concurrently. The queue is published after the task started, so
+ * that loggers never send to a queue that is about to be deleted.
+ */
+static void picoquic_esp_log_start_task(void)
+{
+    QueueHandle_t queue;
+
+    pthread_mutex_lock(&g_picoquic_esp_log_mutex);
+    if (__atomic_load_n(&g_picoquic_esp_log_queue, __ATOMIC_ACQUIRE) == NULL) {
+        queue = xQueueCreate(CONFIG_PICOQUIC_ESP_LOG_QUEUE_LEN, sizeof(picoquic_esp_log_entry_t));
+        if (queue == NULL) {
+            ESP_LOGW("picoquic", "Cannot create the log queue, logging synchronously");
+        }
+        else if (xTaskCreate(picoquic_esp_log_task, "picoquic_log", PICOQUIC_ESP_LOG_TASK_STACK_SIZE,
+            queue, CONFIG_PICOQUIC_ESP_LOG_TASK_PRIORITY, NULL) != pdPASS) {
+            ESP_LOGW("picoquic", "Cannot start the log task, logging synchronously");
+            vQueueDelete(queue);
+        }
+        else {
+            __atomic_store_n(&g_picoquic_esp_log_queue, queue, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&g_picoquic_esp_log_mutex);
+}
+
+uint32_t picoquic_esp_log_get_dropped(void)
+{
+    return __atomic_load_n(&g_picoquic_esp_log_dropped, __ATOMIC_RELAXED);
+}
+#else
+uint32_t picoquic_esp_log_get_dropped(void)
+{
+    return 0;
 }
+#endif /* CONFIG_PICOQUIC_ESP_LOG_ASYNC */
 
-static void picoquic_esp_vlog(picoquic_quic_t* quic, esp_log_level_t level, const char* fmt, va_list vargs)
+/* Compile time filter of ESP_LOGx(), then the runtime level of the tag, so
+ * that disabled messages are neither formatted nor queued. */
+static int picoquic_esp_log_is_enabled(const char* tag, esp_log_level_t level)
 {
+    return level <= LOG_LOCAL_LEVEL && level <= esp_log_level_get(tag);
+}
+
+static void picoquic_esp_vlog(const char* tag, esp_log_level_t level, const char* fmt, va_list vargs)
+{
+    if (!picoquic_esp_log_is_enabled(tag, level)) {
+        return;
+    }
+#if CONFIG_PICOQUIC_ESP_LOG_ASYNC
+    QueueHandle_t queue = __atomic_load_n(&g_picoquic_esp_log_queue, __ATOMIC_ACQUIRE);
+    if (queue != NULL) {
+        picoquic_esp_log_entry_t entry;
+
+        entry.tag = tag;
+        entry.level = (uint8_t)level;
+        picoquic_esp_log_capture(&entry, fmt, vargs);
+        if (xQueueSend(queue, &entry, 0) != pdTRUE) {
+            __atomic_fetch_add(&g_picoquic_esp_log_dropped, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+#endif
     /* Keep buffers small to avoid stack bloat; truncate is OK for debug logs. */
     char buf[256];
     (void)vsnprintf(buf, sizeof(buf), fmt, vargs);
-    ESP_LOG_LEVEL_LOCAL(level, picoquic_esp_log_get_tag(quic), "%s", buf);
+    ESP_LOG_LEVEL_LOCAL(level, tag, "%s", buf);
+}
+
+static void picoquic_esp_log_printf(const char* tag, esp_log_level_t level, const char* fmt, ...)
+{
+    va_list vargs;
+
+    va_start(vargs, fmt);
+    picoquic_esp_vlog(tag, level, fmt, vargs);
+    va_end(vargs);
 }
 
 static void esp_log_quic_app_message(picoquic_quic_t* quic, const picoquic_connection_id_t* cid,
     const char* fmt, va_list vargs)
 {
+    const char* tag = picoquic_esp_log_quic_tag(quic, PICOQUIC_ESP_LOG_EVENT_APP_MESSAGE, -1);
+
     (void)cid;
-    picoquic_esp_vlog(quic, ESP_LOG_INFO, fmt, vargs);
+    if (tag == NULL) {
+        return;
+    }
+    picoquic_esp_vlog(tag, ESP_LOG_INFO, fmt, vargs);
 }
 
 static void esp_log_quic_pdu(picoquic_quic_t* quic, int receiving, uint64_t current_time, uint64_t cid64,
     const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length)
 {
+    const char* tag = picoquic_esp_log_quic_tag(quic, PICOQUIC_ESP_LOG_EVENT_PDU,
+        (receiving != 0) ? picoquic_esp_log_sample_pdu_rx : picoquic_esp_log_sample_pdu_tx);
+
     (void)addr_peer;
     (void)addr_local;
     (void)current_time;
-    if (!picoquic_esp_log_get_log_packets(quic)) {
+    if (tag == NULL) {
         return;
     }
-    ESP_LOGD(picoquic_esp_log_get_tag(quic), "quic pdu %s cid64=%016llx len=%u",
+    picoquic_esp_log_printf(tag, ESP_LOG_DEBUG, "quic pdu %s cid64=%016llx len=%u",
         (receiving != 0) ? "RX" : "TX",
         (unsigned long long)cid64, (unsigned)packet_length);
 }
 
 static void esp_log_quic_close(picoquic_quic_t* quic)
 {
+    (void)picoquic_esp_log_set_slot(g_picoquic_esp_log_contexts, CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS, quic, NULL, NULL);
     quic->F_log = NULL;
     quic->text_log_fns = NULL;
     quic->should_close_log = 0;
@@ -77,22 +640,30 @@ static void esp_log_quic_close(picoquic_quic_t* quic)
 
 static void esp_log_app_message(picoquic_cnx_t* cnx, const char* fmt, va_list vargs)
 {
-    picoquic_esp_vlog(cnx->quic, ESP_LOG_INFO, fmt, vargs);
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_APP_MESSAGE);
+
+    if (tag == NULL) {
+        return;
+    }
+    picoquic_esp_vlog(tag, ESP_LOG_INFO, fmt, vargs);
 }
 
 static void esp_log_pdu(picoquic_cnx_t* cnx, int receiving, uint64_t current_time,
     const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length,
     uint64_t unique_path_id, unsigned char ecn)
 {
+    const char* tag = picoquic_esp_log_cnx_packet_tag(cnx, PICOQUIC_ESP_LOG_EVENT_PDU,
+        (receiving != 0) ? picoquic_esp_log_sample_pdu_rx : picoquic_esp_log_sample_pdu_tx);
+
     (void)addr_peer;
     (void)addr_local;
     (void)current_time;
     (void)unique_path_id;
     (void)ecn;
-    if (!picoquic_esp_log_get_log_packets(cnx->quic)) {
+    if (tag == NULL) {
         return;
     }
-    ESP_LOGD(picoquic_esp_log_get_tag(cnx->quic), "pdu %s len=%u", (receiving != 0) ? "RX" : "TX", (unsigned)packet_length);
+    picoquic_esp_log_printf(tag, ESP_LOG_DEBUG, "pdu %s len=%u", (receiving != 0) ? "RX" : "TX", (unsigned)packet_length);
 }
 
 static const char* esp_log_ptype_name(picoquic_packet_type_enum ptype)
@@ -111,47 +682,61 @@ static const char* esp_log_ptype_name(picoquic_packet_type_enum ptype)
 static void esp_log_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, int receiving, uint64_t current_time,
     struct st_picoquic_packet_header_t* ph, const uint8_t* bytes, size_t bytes_max)
 {
+    const char* tag = picoquic_esp_log_cnx_packet_tag(cnx, PICOQUIC_ESP_LOG_EVENT_PACKET, picoquic_esp_log_sample_packet);
+
     (void)path_x;
     (void)current_time;
     (void)bytes;
     (void)bytes_max;
-    if (!picoquic_esp_log_get_log_packets(cnx->quic)) {
+    if (tag == NULL) {
         return;
     }
-    ESP_LOGD(picoquic_esp_log_get_tag(cnx->quic), "pkt %s type=%s pn=%u",
+    picoquic_esp_log_printf(tag, ESP_LOG_DEBUG, "pkt %s type=%s pn=%u",
         (receiving != 0) ? "RX" : "TX", esp_log_ptype_name(ph->ptype), (unsigned)ph->pn);
 }
 
 static void esp_log_dropped_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
     struct st_picoquic_packet_header_t* ph, size_t packet_size, int err, uint64_t current_time)
 {
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_DROPPED);
+
     (void)path_x;
     (void)current_time;
-    ESP_LOGW(picoquic_esp_log_get_tag(cnx->quic), "dropped pkt type=%s pn=%u size=%u err=%d",
+    if (tag == NULL) {
+        return;
+    }
+    picoquic_esp_log_printf(tag, ESP_LOG_WARN, "dropped pkt type=%s pn=%u size=%u err=%d",
         esp_log_ptype_name(ph->ptype), (unsigned)ph->pn, (unsigned)packet_size, err);
 }
 
 static void esp_log_buffered_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_type_enum ptype, uint64_t current_time)
 {
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_BUFFERED);
+
     (void)path_x;
     (void)current_time;
-    ESP_LOGD(picoquic_esp_log_get_tag(cnx->quic), "buffered pkt type=%s (keys unavailable)", esp_log_ptype_name(ptype));
+    if (tag == NULL) {
+        return;
+    }
+    picoquic_esp_log_printf(tag, ESP_LOG_DEBUG, "buffered pkt type=%s (keys unavailable)", esp_log_ptype_name(ptype));
 }
 
 static void esp_log_outgoing_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
     uint8_t* bytes, uint64_t sequence_number, size_t pn_length, size_t length,
     uint8_t* send_buffer, size_t send_length, uint64_t current_time)
 {
+    const char* tag = picoquic_esp_log_cnx_packet_tag(cnx, PICOQUIC_ESP_LOG_EVENT_OUTGOING, picoquic_esp_log_sample_outgoing);
+
     (void)path_x;
     (void)bytes;
     (void)pn_length;
     (void)send_buffer;
     (void)send_length;
     (void)current_time;
-    if (!picoquic_esp_log_get_log_packets(cnx->quic)) {
+    if (tag == NULL) {
         return;
     }
-    ESP_LOGD(picoquic_esp_log_get_tag(cnx->quic), "outgoing pkt seq=%llu len=%u",
+    picoquic_esp_log_printf(tag, ESP_LOG_DEBUG, "outgoing pkt seq=%llu len=%u",
         (unsigned long long)sequence_number, (unsigned)length);
 }
 
@@ -159,10 +744,15 @@ static void esp_log_packet_lost(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
     picoquic_packet_type_enum ptype, uint64_t sequence_number, char const* trigger,
     picoquic_connection_id_t* dcid, size_t packet_size, uint64_t current_time)
 {
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_LOST);
+
     (void)path_x;
     (void)dcid;
     (void)current_time;
-    ESP_LOGI(picoquic_esp_log_get_tag(cnx->quic), "lost pkt type=%s seq=%llu size=%u reason=%s",
+    if (tag == NULL) {
+        return;
+    }
+    picoquic_esp_log_printf(tag, ESP_LOG_INFO, "lost pkt type=%s seq=%llu size=%u reason=%s",
         esp_log_ptype_name(ptype), (unsigned long long)sequence_number, (unsigned)packet_size,
         (trigger != NULL) ? trigger : "?");
 }
@@ -171,43 +761,83 @@ static void esp_log_negotiated_alpn(picoquic_cnx_t* cnx, int is_local,
     uint8_t const* sni, size_t sni_len, uint8_t const* alpn, size_t alpn_len,
     const ptls_iovec_t* alpn_list, size_t alpn_count)
 {
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_HANDSHAKE);
+
     (void)is_local;
     (void)sni;
     (void)sni_len;
     (void)alpn;
     (void)alpn_len;
     (void)alpn_list;
-    (void)alpn_count;
-    ESP_LOGD(picoquic_esp_log_get_tag(cnx->quic), "ALPN negotiation: count=%u", (unsigned)alpn_count);
+    if (tag == NULL) {
+        return;
+    }
+    picoquic_esp_log_printf(tag, ESP_LOG_DEBUG, "ALPN negotiation: count=%u", (unsigned)alpn_count);
 }
 
 static void esp_log_transport_extension(picoquic_cnx_t* cnx, int is_local, size_t param_length, uint8_t* params)
 {
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_HANDSHAKE);
+
     (void)is_local;
     (void)params;
-    ESP_LOGD(picoquic_esp_log_get_tag(cnx->quic), "transport params: %u bytes", (unsigned)param_length);
+    if (tag == NULL) {
+        return;
+    }
+    picoquic_esp_log_printf(tag, ESP_LOG_DEBUG, "transport params: %u bytes", (unsigned)param_length);
 }
 
 static void esp_log_tls_ticket(picoquic_cnx_t* cnx, uint8_t* ticket, uint16_t ticket_length)
 {
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_HANDSHAKE);
+
     (void)ticket;
-    ESP_LOGD(picoquic_esp_log_get_tag(cnx->quic), "TLS ticket: %u bytes", (unsigned)ticket_length);
+    if (tag == NULL) {
+        return;
+    }
+    picoquic_esp_log_printf(tag, ESP_LOG_DEBUG, "TLS ticket: %u bytes", (unsigned)ticket_length);
 }
 
 static void esp_log_new_connection(picoquic_cnx_t* cnx)
 {
-    ESP_LOGI(picoquic_esp_log_get_tag(cnx->quic), "new connection");
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_CONNECTION);
+
+    if (tag == NULL) {
+        return;
+    }
+    picoquic_esp_log_printf(tag, ESP_LOG_INFO, "new connection");
 }
 
 static void esp_log_close_connection(picoquic_cnx_t* cnx)
 {
-    ESP_LOGI(picoquic_esp_log_get_tag(cnx->quic), "connection closed");
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_CONNECTION);
+
+    if (tag != NULL) {
+        picoquic_esp_log_printf(tag, ESP_LOG_INFO, "connection closed");
+    }
+    /* The connection is about to be deleted, forget its configuration */
+    if (__atomic_load_n(&g_picoquic_esp_log_nb_cnx, __ATOMIC_RELAXED) > 0) {
+        (void)picoquic_set_esp_log_cnx_config(cnx, NULL);
+    }
 }
 
 static void esp_log_cc_dump(picoquic_cnx_t* cnx, uint64_t current_time)
 {
-    (void)current_time;
-    ESP_LOGD(picoquic_esp_log_get_tag(cnx->quic), "cc dump");
+    const char* tag = picoquic_esp_log_cnx_tag(cnx, PICOQUIC_ESP_LOG_EVENT_CC_DUMP);
+    picoquic_path_quality_t quality;
+    uint64_t cc_state = 0;
+    uint64_t cc_param = 0;
+
+    picoquic_esp_cc_trace_sample(cnx, current_time);
+    if (tag == NULL || !picoquic_esp_log_is_enabled(tag, ESP_LOG_DEBUG) || picoquic_get_default_path_quality(cnx, &quality) != 0) {
+        return;
+    }
+    if (cnx->congestion_alg != NULL && cnx->congestion_alg->alg_observe != NULL && cnx->nb_paths > 0) {
+        cnx->congestion_alg->alg_observe(cnx->path[0], &cc_state, &cc_param);
+    }
+    picoquic_esp_log_printf(tag, ESP_LOG_DEBUG, "cc state=%u cwin=%llu in_transit=%llu rtt_min=%llu srtt=%llu pacing=%llu",
+        (unsigned)cc_state, (unsigned long long)quality.cwin, (unsigned long long)quality.bytes_in_transit,
+        (unsigned long long)quality.rtt_min, (unsigned long long)quality.rtt, (unsigned long long)quality.pacing_rate);
 }
 
 static struct st_picoquic_unified_logging_t esp_log_functions = {
@@ -231,9 +861,9 @@ static struct st_picoquic_unified_logging_t esp_log_functions = {
     esp_log_cc_dump
 };
 
-int picoquic_set_esp_log(picoquic_quic_t* quic, const char* tag, int log_packets)
+int picoquic_set_esp_log_config(picoquic_quic_t* quic, const picoquic_esp_log_config_t* config)
 {
-    if (quic == NULL) {
+    if (quic == NULL || config == NULL) {
         return -1;
     }
 
@@ -242,16 +872,16 @@ int picoquic_set_esp_log(picoquic_quic_t* quic, const char* tag, int log_packets
         quic->text_log_fns->log_quic_close(quic);
     }
 
-    g_picoquic_esp_log_tag = (tag != NULL && tag[0] != 0) ? tag : "picoquic";
-    g_picoquic_esp_log_packets = (log_packets != 0);
-
-    /* If packet logs are requested, make sure DEBUG logs are visible for this tag.
-     * (Only works if ESP-IDF is built with dynamic log level control enabled.)
-     */
-    if (g_picoquic_esp_log_packets) {
-        esp_log_level_set(g_picoquic_esp_log_tag, ESP_LOG_DEBUG);
+    if (picoquic_esp_log_set_slot(g_picoquic_esp_log_contexts, CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS,
+        quic, config, NULL) != 0) {
+        ESP_LOGW("picoquic", "Too many logging contexts, see CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS");
+        return -1;
     }
 
+#if CONFIG_PICOQUIC_ESP_LOG_ASYNC
+    picoquic_esp_log_start_task();
+#endif
+
     /* Any non-NULL value enables unified text logging.
      * Keep this as a valid FILE* because picoquic will fflush() it in a few places.
      */
@@ -262,8 +892,35 @@ int picoquic_set_esp_log(picoquic_quic_t* quic, const char* tag, int log_packets
     return 0;
 }
 
+int picoquic_set_esp_log(picoquic_quic_t* quic, const char* tag, int log_packets)
+{
+    picoquic_esp_log_config_t config;
+
+    config.tag = tag;
+    config.event_mask = (log_packets != 0) ? PICOQUIC_ESP_LOG_EVENTS_ALL : PICOQUIC_ESP_LOG_EVENTS_DEFAULT;
+    config.packet_sampling = 1;
+
+    return picoquic_set_esp_log_config(quic, &config);
+}
+
+int picoquic_set_esp_log_cnx_config(picoquic_cnx_t* cnx, const picoquic_esp_log_config_t* config)
+{
+    if (cnx == NULL) {
+        return -1;
+    }
+    return picoquic_esp_log_set_slot(g_picoquic_esp_log_cnx, PICOQUIC_ESP_LOG_MAX_CNX_CONFIGS, cnx, config,
+        &g_picoquic_esp_log_nb_cnx);
+}
+
 #else /* ESP_PLATFORM */
 
+int picoquic_set_esp_log_config(picoquic_quic_t* quic, const picoquic_esp_log_config_t* config)
+{
+    (void)quic;
+    (void)config;
+    return -1;
+}
+
 int picoquic_set_esp_log(picoquic_quic_t* quic, const char* tag, int log_packets)
 {
     (void)quic;
@@ -272,6 +929,16 @@ int picoquic_set_esp_log(picoquic_quic_t* quic, const char* tag, int log_packets
     return -1;
 }
 
-#endif /* ESP_PLATFORM */
+int picoquic_set_esp_log_cnx_config(picoquic_cnx_t* cnx, const picoquic_esp_log_config_t* config)
+{
+    (void)cnx;
+    (void)config;
+    return -1;
+}
 
+uint32_t picoquic_esp_log_get_dropped(void)
+{
+    return 0;
+}
 
+#endif /* ESP_PLATFORM */
@@ -0,0 +1,599 @@
+/*
+ * Picoquic ESP-IDF connection metrics
+ *
+ * Implements a picoquic_unified_logging_t vtable that updates counters, then
+ * forwards each event to the logging backend installed before it.
+ */
+
+#include "picoquic_esp_metrics.h"
+#include "picoquic_esp_cc_trace.h"
+
+#ifdef ESP_PLATFORM
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "picoquic_internal.h"
+#include "picoquic_unified_log.h"
+
+#ifndef CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS
+#define CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS 4
+#endif
+
+/* Gauges are refreshed every this many outgoing packets, and on losses */
+#define PICOQUIC_ESP_METRICS_GAUGE_INTERVAL 16
+
+/* As for the logging configurations, the metrics of each context are found
+ * through a static table keyed by the context. */
+static picoquic_esp_metrics_t* g_picoquic_esp_metrics[CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS];
+static pthread_mutex_t g_picoquic_esp_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static picoquic_esp_metrics_t* picoquic_esp_metrics_find(picoquic_quic_t* quic)
+{
+    for (int i = 0; i < CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS; i++) {
+        picoquic_esp_metrics_t* metrics = __atomic_load_n(&g_picoquic_esp_metrics[i], __ATOMIC_ACQUIRE);
+        if (metrics != NULL && metrics->quic == quic) {
+            return metrics;
+        }
+    }
+    return NULL;
+}
+
+static picoquic_esp_metrics_cnx_t* picoquic_esp_metrics_find_cnx(picoquic_esp_metrics_t* metrics,
+    picoquic_cnx_t* cnx, int create)
+{
+    picoquic_esp_metrics_cnx_t* free_slot = NULL;
+
+    for (int i = 0; i < CONFIG_PICOQUIC_ESP_METRICS_MAX_CONNECTIONS; i++) {
+        if (metrics->cnx[i].cnx == cnx) {
+            return &metrics->cnx[i];
+        }
+        if (free_slot == NULL && metrics->cnx[i].cnx == NULL) {
+            free_slot = &metrics->cnx[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    metrics->nb_connections++;
+    if (free_slot == NULL) {
+        metrics->nb_untracked++;
+    }
+    else {
+        memset(free_slot, 0, sizeof(picoquic_esp_metrics_cnx_t));
+        free_slot->cnx = cnx;
+        free_slot->cid64 = picoquic_val64_connection_id(picoquic_get_logging_cnxid(cnx));
+        free_slot->start_time = picoquic_get_quic_time(cnx->quic);
+    }
+    return free_slot;
+}
+
+static void picoquic_esp_metrics_update_gauges(picoquic_esp_metrics_cnx_t* mcnx, uint64_t current_time)
+{
+    picoquic_path_quality_t quality;
+
+    if (picoquic_get_default_path_quality(mcnx->cnx, &quality) == 0) {
+        mcnx->update_time = current_time;
+        mcnx->smoothed_rtt = quality.rtt;
+        mcnx->cwin = quality.cwin;
+        mcnx->pacing_rate = quality.pacing_rate;
+        mcnx->bytes_in_transit = quality.bytes_in_transit;
+    }
+}
+
+static void picoquic_esp_metrics_update_latency(picoquic_esp_metrics_t* metrics, picoquic_esp_metrics_cnx_t* mcnx,
+    uint64_t current_time)
+{
+    picoquic_esp_latency_t* latency = __atomic_load_n(&metrics->latency, __ATOMIC_ACQUIRE);
+    picoquic_path_quality_t quality;
+
+    if (latency == NULL || mcnx == NULL) {
+        return;
+    }
+    if (!mcnx->handshake_recorded && picoquic_get_cnx_state(mcnx->cnx) == picoquic_state_ready) {
+        picoquic_esp_latency_on_ready(latency, mcnx->cnx, current_time);
+        mcnx->handshake_recorded = 1;
+    }
+    if (picoquic_get_default_path_quality(mcnx->cnx, &quality) == 0 &&
+        quality.rtt_sample != 0 && quality.rtt_sample != mcnx->last_rtt_sample) {
+        picoquic_esp_histogram_record(&latency->rtt, quality.rtt_sample);
+        mcnx->last_rtt_sample = quality.rtt_sample;
+    }
+}
+
+static int picoquic_esp_metrics_trigger_index(picoquic_esp_metrics_t* metrics, char const* trigger)
+{
+    if (trigger == NULL) {
+        return PICOQUIC_ESP_METRICS_MAX_TRIGGERS;
+    }
+    for (int i = 0; i < PICOQUIC_ESP_METRICS_MAX_TRIGGERS; i++) {
+        if (metrics->triggers[i] == NULL) {
+            metrics->triggers[i] = trigger;
+            return i;
+        }
+        /* Triggers are string constants, compare by address first */
+        if (metrics->triggers[i] == trigger || strcmp(metrics->triggers[i], trigger) == 0) {
+            return i;
+        }
+    }
+    return PICOQUIC_ESP_METRICS_MAX_TRIGGERS;
+}
+
+static int picoquic_esp_metrics_error_index(picoquic_esp_metrics_t* metrics, int err)
+{
+    for (int i = 0; i < metrics->nb_errors; i++) {
+        if (metrics->errors[i] == err) {
+            return i;
+        }
+    }
+    if (metrics->nb_errors < PICOQUIC_ESP_METRICS_MAX_ERRORS) {
+        metrics->errors[metrics->nb_errors] = err;
+        return metrics->nb_errors++;
+    }
+    return PICOQUIC_ESP_METRICS_MAX_ERRORS;
+}
+
+/* Apply f to the totals and, if the connection is tracked, to its counters */
+#define PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, f) \
+    do {                                             \
+        (metrics)->totals.f;                         \
+        if ((mcnx) != NULL) {                        \
+            (mcnx)->counters.f;                      \
+        }                                            \
+    } while (0)
+
+static void metrics_quic_app_message(picoquic_quic_t* quic, const picoquic_connection_id_t* cid,
+    const char* fmt, va_list vargs)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(quic);
+
+    if (metrics != NULL && metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_quic_app_message(quic, cid, fmt, vargs);
+    }
+}
+
+static void metrics_quic_pdu(picoquic_quic_t* quic, int receiving, uint64_t current_time, uint64_t cid64,
+    const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(quic);
+
+    if (metrics == NULL) {
+        return;
+    }
+    /* Datagrams not attributed to a connection, e.g. stateless resets */
+    if (receiving) {
+        metrics->totals.bytes_received += packet_length;
+    }
+    else {
+        metrics->totals.bytes_sent += packet_length;
+    }
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_quic_pdu(quic, receiving, current_time, cid64, addr_peer, addr_local, packet_length);
+    }
+}
+
+static void metrics_quic_close(picoquic_quic_t* quic)
+{
+    (void)picoquic_set_esp_metrics(quic, NULL);
+    if (quic->text_log_fns != NULL && quic->text_log_fns->log_quic_close != NULL) {
+        quic->text_log_fns->log_quic_close(quic);
+    }
+}
+
+static void metrics_app_message(picoquic_cnx_t* cnx, const char* fmt, va_list vargs)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+
+    if (metrics != NULL && metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_app_message(cnx, fmt, vargs);
+    }
+}
+
+static void metrics_pdu(picoquic_cnx_t* cnx, int receiving, uint64_t current_time,
+    const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length,
+    uint64_t unique_path_id, unsigned char ecn)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+    picoquic_esp_metrics_cnx_t* mcnx;
+
+    if (metrics == NULL) {
+        return;
+    }
+    mcnx = picoquic_esp_metrics_find_cnx(metrics, cnx, 0);
+    if (receiving) {
+        PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, bytes_received += packet_length);
+    }
+    else {
+        PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, bytes_sent += packet_length);
+    }
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_pdu(cnx, receiving, current_time, addr_peer, addr_local, packet_length,
+            unique_path_id, ecn);
+    }
+}
+
+static void metrics_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, int receiving, uint64_t current_time,
+    struct st_picoquic_packet_header_t* ph, const uint8_t* bytes, size_t bytes_max)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+
+    if (metrics == NULL) {
+        return;
+    }
+    if (receiving) {
+        picoquic_esp_metrics_cnx_t* mcnx = picoquic_esp_metrics_find_cnx(metrics, cnx, 0);
+        PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, packets_received++);
+        picoquic_esp_metrics_update_latency(metrics, mcnx, current_time);
+    }
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_packet(cnx, path_x, receiving, current_time, ph, bytes, bytes_max);
+    }
+}
+
+static void metrics_dropped_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    struct st_picoquic_packet_header_t* ph, size_t packet_size, int err, uint64_t current_time)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+    picoquic_esp_metrics_cnx_t* mcnx;
+    int index;
+
+    if (metrics == NULL) {
+        return;
+    }
+    mcnx = picoquic_esp_metrics_find_cnx(metrics, cnx, 0);
+    index = picoquic_esp_metrics_error_index(metrics, err);
+    PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, packets_dropped++);
+    PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, dropped_by_error[index]++);
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_dropped_packet(cnx, path_x, ph, packet_size, err, current_time);
+    }
+}
+
+static void metrics_buffered_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, picoquic_packet_type_enum ptype, uint64_t current_time)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+    picoquic_esp_metrics_cnx_t* mcnx;
+
+    if (metrics == NULL) {
+        return;
+    }
+    mcnx = picoquic_esp_metrics_find_cnx(metrics, cnx, 0);
+    PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, packets_buffered++);
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_buffered_packet(cnx, path_x, ptype, current_time);
+    }
+}
+
+static void metrics_outgoing_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    uint8_t* bytes, uint64_t sequence_number, size_t pn_length, size_t length,
+    uint8_t* send_buffer, size_t send_length, uint64_t current_time)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+    picoquic_esp_metrics_cnx_t* mcnx;
+
+    if (metrics == NULL) {
+        return;
+    }
+    mcnx = picoquic_esp_metrics_find_cnx(metrics, cnx, 0);
+    PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, packets_sent++);
+    picoquic_esp_metrics_update_latency(metrics, mcnx, current_time);
+    if (mcnx != NULL && (++mcnx->nb_outgoing % PICOQUIC_ESP_METRICS_GAUGE_INTERVAL) == 0) {
+        picoquic_esp_metrics_update_gauges(mcnx, current_time);
+    }
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_outgoing_packet(cnx, path_x, bytes, sequence_number, pn_length, length,
+            send_buffer, send_length, current_time);
+    }
+}
+
+static void metrics_packet_lost(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    picoquic_packet_type_enum ptype, uint64_t sequence_number, char const* trigger,
+    picoquic_connection_id_t* dcid, size_t packet_size, uint64_t current_time)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+    picoquic_esp_metrics_cnx_t* mcnx;
+    int index;
+
+    if (metrics == NULL) {
+        return;
+    }
+    mcnx = picoquic_esp_metrics_find_cnx(metrics, cnx, 0);
+    index = picoquic_esp_metrics_trigger_index(metrics, trigger);
+    PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, packets_lost++);
+    PICOQUIC_ESP_METRICS_COUNT(metrics, mcnx, lost_by_trigger[index]++);
+    if (mcnx != NULL) {
+        picoquic_esp_metrics_update_gauges(mcnx, current_time);
+    }
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_packet_lost(cnx, path_x, ptype, sequence_number, trigger, dcid,
+            packet_size, current_time);
+    }
+}
+
+static void metrics_negotiated_alpn(picoquic_cnx_t* cnx, int is_local,
+    uint8_t const* sni, size_t sni_len, uint8_t const* alpn, size_t alpn_len,
+    const ptls_iovec_t* alpn_list, size_t alpn_count)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+
+    if (metrics != NULL && metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_negotiated_alpn(cnx, is_local, sni, sni_len, alpn, alpn_len, alpn_list, alpn_count);
+    }
+}
+
+static void metrics_transport_extension(picoquic_cnx_t* cnx, int is_local, size_t param_length, uint8_t* params)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+
+    if (metrics != NULL && metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_transport_extension(cnx, is_local, param_length, params);
+    }
+}
+
+static void metrics_tls_ticket(picoquic_cnx_t* cnx, uint8_t* ticket, uint16_t ticket_length)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+
+    if (metrics != NULL && metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_tls_ticket(cnx, ticket, ticket_length);
+    }
+}
+
+static void metrics_new_connection(picoquic_cnx_t* cnx)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+
+    if (metrics == NULL) {
+        return;
+    }
+    (void)picoquic_esp_metrics_find_cnx(metrics, cnx, 1);
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_new_connection(cnx);
+    }
+}
+
+static void metrics_close_connection(picoquic_cnx_t* cnx)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+    picoquic_esp_metrics_cnx_t* mcnx;
+
+    if (metrics == NULL) {
+        return;
+    }
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_close_connection(cnx);
+    }
+    /* The connection is about to be deleted; its counters remain in the totals */
+    mcnx = picoquic_esp_metrics_find_cnx(metrics, cnx, 0);
+    if (mcnx != NULL) {
+        mcnx->cnx = NULL;
+    }
+}
+
+static void metrics_cc_dump(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    picoquic_esp_metrics_t* metrics = picoquic_esp_metrics_find(cnx->quic);
+    picoquic_esp_metrics_cnx_t* mcnx;
+
+    if (metrics == NULL) {
+        return;
+    }
+    mcnx = picoquic_esp_metrics_find_cnx(metrics, cnx, 0);
+    if (mcnx != NULL) {
+        picoquic_esp_metrics_update_gauges(mcnx, current_time);
+    }
+    if (metrics->next_log_fns != NULL) {
+        metrics->next_log_fns->log_cc_dump(cnx, current_time);
+    }
+    else {
+        picoquic_esp_cc_trace_sample(cnx, current_time);
+    }
+}
+
+static struct st_picoquic_unified_logging_t metrics_functions = {
+    /* Per context log function */
+    metrics_quic_app_message,
+    metrics_quic_pdu,
+    metrics_quic_close,
+    /* Per connection functions */
+    metrics_app_message,
+    metrics_pdu,
+    metrics_packet,
+    metrics_dropped_packet,
+    metrics_buffered_packet,
+    metrics_outgoing_packet,
+    metrics_packet_lost,
+    metrics_negotiated_alpn,
+    metrics_transport_extension,
+    metrics_tls_ticket,
+    metrics_new_connection,
+    metrics_close_connection,
+    metrics_cc_dump
+};
+
+int picoquic_set_esp_metrics(picoquic_quic_t* quic, picoquic_esp_metrics_t* metrics)
+{
+    int ret = -1;
+    picoquic_esp_metrics_t* previous;
+
+    if (quic == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_picoquic_esp_metrics_mutex);
+    previous = picoquic_esp_metrics_find(quic);
+    if (previous != NULL) {
+        /* Uninstall, handing the events back to the logging backend */
+        for (int i = 0; i < CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS; i++) {
+            if (g_picoquic_esp_metrics[i] == previous) {
+                __atomic_store_n(&g_picoquic_esp_metrics[i], NULL, __ATOMIC_RELEASE);
+            }
+        }
+        quic->text_log_fns = (struct st_picoquic_unified_logging_t*)previous->next_log_fns;
+        if (quic->text_log_fns == NULL) {
+            quic->F_log = NULL;
+        }
+        picoquic_set_log_level(quic, previous->previous_log_level);
+    }
+    if (metrics == NULL) {
+        ret = 0;
+    }
+    else {
+        for (int i = 0; i < CONFIG_PICOQUIC_ESP_LOG_MAX_CONTEXTS; i++) {
+            if (g_picoquic_esp_metrics[i] == NULL) {
+                memset(metrics, 0, sizeof(picoquic_esp_metrics_t));
+                metrics->quic = quic;
+                metrics->next_log_fns = quic->text_log_fns;
+                /* Otherwise the packet events stop after the first packets of each connection */
+                metrics->previous_log_level = quic->use_long_log;
+                picoquic_set_log_level(quic, 1);
+                /* Any valid FILE* enables unified logging, the metrics do not write to it */
+                if (quic->F_log == NULL) {
+                    quic->F_log = stdout;
+                    quic->should_close_log = 0;
+                }
+                quic->text_log_fns = &metrics_functions;
+                __atomic_store_n(&g_picoquic_esp_metrics[i], metrics, __ATOMIC_RELEASE);
+                ret = 0;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_picoquic_esp_metrics_mutex);
+
+    return ret;
+}
+
+void picoquic_esp_metrics_set_latency(picoquic_esp_metrics_t* metrics, picoquic_esp_latency_t* latency)
+{
+    __atomic_store_n(&metrics->latency, latency, __ATOMIC_RELEASE);
+}
+
+const picoquic_esp_metrics_cnx_t* picoquic_esp_metrics_get_cnx(picoquic_esp_metrics_t* metrics, picoquic_cnx_t* cnx)
+{
+    picoquic_esp_metrics_cnx_t* mcnx = picoquic_esp_metrics_find_cnx(metrics, cnx, 0);
+
+    if (mcnx != NULL) {
+        picoquic_esp_metrics_update_gauges(mcnx, picoquic_get_quic_time(cnx->quic));
+    }
+    return mcnx;
+}
+
+const char* picoquic_esp_metrics_trigger_name(const picoquic_esp_metrics_t* metrics, int index)
+{
+    if (index == PICOQUIC_ESP_METRICS_MAX_TRIGGERS) {
+        return "other";
+    }
+    return (index >= 0 && index < PICOQUIC_ESP_METRICS_MAX_TRIGGERS) ? metrics->triggers[index] : NULL;
+}
+
+static void picoquic_esp_metrics_log_counters(const picoquic_esp_metrics_t* metrics, const char* tag,
+    const char* name, const picoquic_esp_metrics_counters_t* counters)
+{
+    char buf[192];
+    size_t pos = 0;
+    unsigned loss_permille = (counters->packets_sent > 0) ?
+        (unsigned)((counters->packets_lost * 1000) / counters->packets_sent) : 0;
+
+    ESP_LOGI(tag, "%s: rx %llu pkts %llu bytes, tx %llu pkts %llu bytes, lost %llu (%u.%u%%), dropped %llu, buffered %llu",
+        name, (unsigned long long)counters->packets_received, (unsigned long long)counters->bytes_received,
+        (unsigned long long)counters->packets_sent, (unsigned long long)counters->bytes_sent,
+        (unsigned long long)counters->packets_lost, loss_permille / 10, loss_permille % 10,
+        (unsigned long long)counters->packets_dropped, (unsigned long long)counters->packets_buffered);
+
+    for (int i = 0; i <= PICOQUIC_ESP_METRICS_MAX_TRIGGERS && pos < sizeof(buf); i++) {
+        if (counters->lost_by_trigger[i] != 0) {
+            const char* trigger = picoquic_esp_metrics_trigger_name(metrics, i);
+            int ret = snprintf(buf + pos, sizeof(buf) - pos, " %s=%u", (trigger != NULL) ? trigger : "?",
+                (unsigned)counters->lost_by_trigger[i]);
+            pos += (ret > 0) ? (size_t)ret : 0;
+        }
+    }
+    if (pos > 0) {
+        ESP_LOGI(tag, "%s: lost by trigger:%s", name, buf);
+    }
+
+    pos = 0;
+    for (int i = 0; i <= PICOQUIC_ESP_METRICS_MAX_ERRORS && pos < sizeof(buf); i++) {
+        if (counters->dropped_by_error[i] != 0) {
+            int ret = (i < PICOQUIC_ESP_METRICS_MAX_ERRORS) ?
+                snprintf(buf + pos, sizeof(buf) - pos, " 0x%x=%u", (unsigned)metrics->errors[i],
+                    (unsigned)counters->dropped_by_error[i]) :
+                snprintf(buf + pos, sizeof(buf) - pos, " other=%u", (unsigned)counters->dropped_by_error[i]);
+            pos += (ret > 0) ? (size_t)ret : 0;
+        }
+    }
+    if (pos > 0) {
+        ESP_LOGI(tag, "%s: dropped by error:%s", name, buf);
+    }
+}
+
+void picoquic_esp_metrics_log(picoquic_esp_metrics_t* metrics, const char* tag)
+{
+    char name[32];
+
+    if (metrics == NULL) {
+        return;
+    }
+    if (tag == NULL || tag[0] == 0) {
+        tag = "picoquic";
+    }
+
+    ESP_LOGI(tag, "metrics: %llu connections, %llu untracked",
+        (unsigned long long)metrics->nb_connections, (unsigned long long)metrics->nb_untracked);
+    picoquic_esp_metrics_log_counters(metrics, tag, "total", &metrics->totals);
+
+    for (int i = 0; i < CONFIG_PICOQUIC_ESP_METRICS_MAX_CONNECTIONS; i++) {
+        picoquic_esp_metrics_cnx_t* mcnx = &metrics->cnx[i];
+
+        if (mcnx->cnx == NULL) {
+            continue;
+        }
+        (void)snprintf(name, sizeof(name), "cnx %016llx", (unsigned long long)mcnx->cid64);
+        picoquic_esp_metrics_log_counters(metrics, tag, name, &mcnx->counters);
+        ESP_LOGI(tag, "%s: srtt %lluus, cwin %llu, pacing %llu B/s, in transit %llu", name,
+            (unsigned long long)mcnx->smoothed_rtt, (unsigned long long)mcnx->cwin,
+            (unsigned long long)mcnx->pacing_rate, (unsigned long long)mcnx->bytes_in_transit);
+    }
+}
+
+#else /* ESP_PLATFORM */
+
+int picoquic_set_esp_metrics(picoquic_quic_t* quic, picoquic_esp_metrics_t* metrics)
+{
+    (void)quic;
+    (void)metrics;
+    return -1;
+}
+
+void picoquic_esp_metrics_set_latency(picoquic_esp_metrics_t* metrics, picoquic_esp_latency_t* latency)
+{
+    (void)metrics;
+    (void)latency;
+}
+
+const picoquic_esp_metrics_cnx_t* picoquic_esp_metrics_get_cnx(picoquic_esp_metrics_t* metrics, picoquic_cnx_t* cnx)
+{
+    (void)metrics;
+    (void)cnx;
+    return NULL;
+}
+
+const char* picoquic_esp_metrics_trigger_name(const picoquic_esp_metrics_t* metrics, int index)
+{
+    (void)metrics;
+    (void)index;
+    return NULL;
+}
+
+void picoquic_esp_metrics_log(picoquic_esp_metrics_t* metrics, const char* tag)
+{
+    (void)metrics;
+    (void)tag;
+}
+
+#endif /* ESP_PLATFORM */
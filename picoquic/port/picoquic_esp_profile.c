@@ -0,0 +1,291 @@
+/*
+ * Picoquic ESP-IDF hot path profiling
+ *
+ * The __wrap_ functions below are only linked in place of the picoquic ones
+ * when CONFIG_PICOQUIC_PROFILING adds the -Wl,--wrap options, see
+ * CMakeLists.txt.
+ */
+
+#include "picoquic_esp_profile.h"
+
+#include <string.h>
+
+#include "picoquic_internal.h"
+#include "sdkconfig.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_log.h"
+#endif
+
+#if CONFIG_PICOQUIC_PROFILING
+
+#if defined(ESP_PLATFORM) && !CONFIG_IDF_TARGET_LINUX
+#include "esp_cpu.h"
+
+/* 32 bit counter, the differences are right across a wrap around */
+typedef uint32_t picoquic_esp_cycles_t;
+#define PICOQUIC_ESP_PROFILE_CYCLES() ((picoquic_esp_cycles_t)esp_cpu_get_cycle_count())
+#define PICOQUIC_ESP_PROFILE_UNIT "cycles"
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+typedef uint64_t picoquic_esp_cycles_t;
+#define PICOQUIC_ESP_PROFILE_CYCLES() ((picoquic_esp_cycles_t)__rdtsc())
+#define PICOQUIC_ESP_PROFILE_UNIT "cycles"
+#else
+#include <time.h>
+
+typedef uint64_t picoquic_esp_cycles_t;
+static inline picoquic_esp_cycles_t picoquic_esp_profile_ns(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (picoquic_esp_cycles_t)ts.tv_sec * 1000000000ull + (picoquic_esp_cycles_t)ts.tv_nsec;
+}
+#define PICOQUIC_ESP_PROFILE_CYCLES() picoquic_esp_profile_ns()
+#define PICOQUIC_ESP_PROFILE_UNIT "ns"
+#endif
+
+static picoquic_esp_profile_t g_picoquic_esp_profile;
+
+static inline void picoquic_esp_profile_add(int stage, picoquic_esp_cycles_t start, size_t bytes)
+{
+    picoquic_esp_profile_stage_t* s = &g_picoquic_esp_profile.stages[stage];
+
+    s->cycles += (picoquic_esp_cycles_t)(PICOQUIC_ESP_PROFILE_CYCLES() - start);
+    s->bytes += bytes;
+    s->calls++;
+}
+
+int __real_picoquic_incoming_packet_ex(picoquic_quic_t* quic, uint8_t* bytes, size_t packet_length,
+    struct sockaddr* addr_from, struct sockaddr* addr_to, int if_index_to, unsigned char received_ecn,
+    picoquic_cnx_t** first_cnx, uint64_t current_time);
+
+int __wrap_picoquic_incoming_packet_ex(picoquic_quic_t* quic, uint8_t* bytes, size_t packet_length,
+    struct sockaddr* addr_from, struct sockaddr* addr_to, int if_index_to, unsigned char received_ecn,
+    picoquic_cnx_t** first_cnx, uint64_t current_time)
+{
+    picoquic_esp_cycles_t start = PICOQUIC_ESP_PROFILE_CYCLES();
+    int ret = __real_picoquic_incoming_packet_ex(quic, bytes, packet_length, addr_from, addr_to, if_index_to,
+        received_ecn, first_cnx, current_time);
+
+    picoquic_esp_profile_add(picoquic_esp_profile_incoming, start, packet_length);
+    g_picoquic_esp_profile.packets_received++;
+    g_picoquic_esp_profile.bytes_received += packet_length;
+
+    return ret;
+}
+
+int __real_picoquic_prepare_next_packet_ex(picoquic_quic_t* quic, uint64_t current_time,
+    uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
+    struct sockaddr_storage* p_addr_to, struct sockaddr_storage* p_addr_from, int* if_index,
+    picoquic_connection_id_t* log_cid, picoquic_cnx_t** p_last_cnx, size_t* send_msg_size);
+
+int __wrap_picoquic_prepare_next_packet_ex(picoquic_quic_t* quic, uint64_t current_time,
+    uint8_t* send_buffer, size_t send_buffer_max, size_t* send_length,
+    struct sockaddr_storage* p_addr_to, struct sockaddr_storage* p_addr_from, int* if_index,
+    picoquic_connection_id_t* log_cid, picoquic_cnx_t** p_last_cnx, size_t* send_msg_size)
+{
+    picoquic_esp_cycles_t start = PICOQUIC_ESP_PROFILE_CYCLES();
+    int ret = __real_picoquic_prepare_next_packet_ex(quic, current_time, send_buffer, send_buffer_max,
+        send_length, p_addr_to, p_addr_from, if_index, log_cid, p_last_cnx, send_msg_size);
+    size_t length = (ret == 0) ? *send_length : 0;
+
+    picoquic_esp_profile_add(picoquic_esp_profile_prepare, start, length);
+    if (length > 0) {
+        /* With GSO, send_msg_size splits the buffer in several packets */
+        size_t msg_size = (send_msg_size != NULL && *send_msg_size > 0) ? *send_msg_size : length;
+        g_picoquic_esp_profile.packets_sent += (length + msg_size - 1) / msg_size;
+        g_picoquic_esp_profile.bytes_sent += length;
+    }
+
+    return ret;
+}
+
+size_t __real_picoquic_aead_decrypt_generic(uint8_t* output, const uint8_t* input, size_t input_length,
+    uint64_t seq_num, const uint8_t* auth_data, size_t auth_data_length, void* aead_ctx);
+
+size_t __wrap_picoquic_aead_decrypt_generic(uint8_t* output, const uint8_t* input, size_t input_length,
+    uint64_t seq_num, const uint8_t* auth_data, size_t auth_data_length, void* aead_ctx)
+{
+    picoquic_esp_cycles_t start = PICOQUIC_ESP_PROFILE_CYCLES();
+    size_t ret = __real_picoquic_aead_decrypt_generic(output, input, input_length, seq_num,
+        auth_data, auth_data_length, aead_ctx);
+
+    picoquic_esp_profile_add(picoquic_esp_profile_aead_decrypt, start, input_length);
+    return ret;
+}
+
+size_t __real_picoquic_aead_encrypt_generic(uint8_t* output, const uint8_t* input, size_t input_length,
+    uint64_t seq_num, const uint8_t* auth_data, size_t auth_data_length, void* aead_ctx);
+
+size_t __wrap_picoquic_aead_encrypt_generic(uint8_t* output, const uint8_t* input, size_t input_length,
+    uint64_t seq_num, const uint8_t* auth_data, size_t auth_data_length, void* aead_ctx)
+{
+    picoquic_esp_cycles_t start = PICOQUIC_ESP_PROFILE_CYCLES();
+    size_t ret = __real_picoquic_aead_encrypt_generic(output, input, input_length, seq_num,
+        auth_data, auth_data_length, aead_ctx);
+
+    picoquic_esp_profile_add(picoquic_esp_profile_aead_encrypt, start, input_length);
+    return ret;
+}
+
+void __real_picoquic_pn_encrypt(void* pn_enc, const void* iv, void* output, const void* input, size_t len);
+
+void __wrap_picoquic_pn_encrypt(void* pn_enc, const void* iv, void* output, const void* input, size_t len)
+{
+    picoquic_esp_cycles_t start = PICOQUIC_ESP_PROFILE_CYCLES();
+
+    __real_picoquic_pn_encrypt(pn_enc, iv, output, input, len);
+    picoquic_esp_profile_add(picoquic_esp_profile_header_protection, start, 0);
+}
+
+int __real_picoquic_decode_frames(picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes,
+    size_t bytes_max, picoquic_stream_data_node_t* received_data, int epoch,
+    struct sockaddr* addr_from, struct sockaddr* addr_to, uint64_t pn64, int path_is_not_allocated,
+    uint64_t current_time);
+
+int __wrap_picoquic_decode_frames(picoquic_cnx_t* cnx, picoquic_path_t* path_x, const uint8_t* bytes,
+    size_t bytes_max, picoquic_stream_data_node_t* received_data, int epoch,
+    struct sockaddr* addr_from, struct sockaddr* addr_to, uint64_t pn64, int path_is_not_allocated,
+    uint64_t current_time)
+{
+    picoquic_esp_cycles_t start = PICOQUIC_ESP_PROFILE_CYCLES();
+    int ret = __real_picoquic_decode_frames(cnx, path_x, bytes, bytes_max, received_data, epoch,
+        addr_from, addr_to, pn64, path_is_not_allocated, current_time);
+
+    picoquic_esp_profile_add(picoquic_esp_profile_frames, start, bytes_max);
+    return ret;
+}
+
+/* The congestion control algorithms are called through their vtable, so
+ * they are profiled through a copy of it. */
+static picoquic_congestion_algorithm_t g_picoquic_esp_profile_cc;
+static picoquic_congestion_algorithm_notify g_picoquic_esp_profile_cc_notify;
+
+static void picoquic_esp_profile_cc_notify(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    picoquic_congestion_notification_t notification, picoquic_per_ack_state_t* ack_state, uint64_t current_time)
+{
+    picoquic_esp_cycles_t start = PICOQUIC_ESP_PROFILE_CYCLES();
+
+    g_picoquic_esp_profile_cc_notify(cnx, path_x, notification, ack_state, current_time);
+    picoquic_esp_profile_add(picoquic_esp_profile_congestion, start, 0);
+}
+
+const picoquic_congestion_algorithm_t* picoquic_esp_profile_congestion_algorithm(const picoquic_congestion_algorithm_t* alg)
+{
+    if (alg == NULL || alg->alg_notify == NULL) {
+        return alg;
+    }
+    if (alg == &g_picoquic_esp_profile_cc) {
+        return alg;
+    }
+    memcpy(&g_picoquic_esp_profile_cc, alg, sizeof(picoquic_congestion_algorithm_t));
+    g_picoquic_esp_profile_cc_notify = alg->alg_notify;
+    g_picoquic_esp_profile_cc.alg_notify = picoquic_esp_profile_cc_notify;
+
+    return &g_picoquic_esp_profile_cc;
+}
+
+int picoquic_esp_profile_get(picoquic_esp_profile_t* profile)
+{
+    memcpy(profile, &g_picoquic_esp_profile, sizeof(picoquic_esp_profile_t));
+    return 0;
+}
+
+void picoquic_esp_profile_reset(void)
+{
+    memset(&g_picoquic_esp_profile, 0, sizeof(picoquic_esp_profile_t));
+}
+
+const char* picoquic_esp_profile_unit(void)
+{
+    return PICOQUIC_ESP_PROFILE_UNIT;
+}
+
+#else /* CONFIG_PICOQUIC_PROFILING */
+
+const picoquic_congestion_algorithm_t* picoquic_esp_profile_congestion_algorithm(const picoquic_congestion_algorithm_t* alg)
+{
+    return alg;
+}
+
+int picoquic_esp_profile_get(picoquic_esp_profile_t* profile)
+{
+    memset(profile, 0, sizeof(picoquic_esp_profile_t));
+    return -1;
+}
+
+void picoquic_esp_profile_reset(void)
+{
+}
+
+const char* picoquic_esp_profile_unit(void)
+{
+    return "cycles";
+}
+
+#endif /* CONFIG_PICOQUIC_PROFILING */
+
+const char* picoquic_esp_profile_stage_name(int stage)
+{
+    static const char* names[picoquic_esp_profile_nb_stages] = {
+        "incoming", "prepare", "aead decrypt", "aead encrypt", "header protection", "frames", "congestion"
+    };
+
+    return (stage >= 0 && stage < picoquic_esp_profile_nb_stages) ? names[stage] : NULL;
+}
+
+void picoquic_esp_profile_log(const char* tag)
+{
+#ifdef ESP_PLATFORM
+    picoquic_esp_profile_t profile;
+    const char* unit = picoquic_esp_profile_unit();
+    uint64_t nb_packets;
+    uint64_t stage_packets;
+
+    if (tag == NULL || tag[0] == 0) {
+        tag = "picoquic";
+    }
+    if (picoquic_esp_profile_get(&profile) != 0) {
+        ESP_LOGI(tag, "profile: not built, set CONFIG_PICOQUIC_PROFILING");
+        return;
+    }
+    nb_packets = profile.packets_received + profile.packets_sent;
+    ESP_LOGI(tag, "profile: rx %llu pkts %llu bytes, tx %llu pkts %llu bytes",
+        (unsigned long long)profile.packets_received, (unsigned long long)profile.bytes_received,
+        (unsigned long long)profile.packets_sent, (unsigned long long)profile.bytes_sent);
+
+    for (int i = 0; i < picoquic_esp_profile_nb_stages; i++) {
+        const picoquic_esp_profile_stage_t* s = &profile.stages[i];
+        /* Hundredths of a cycle per byte, AEAD costs are a few cycles per byte */
+        uint64_t per_byte_x100 = (s->bytes > 0) ? (s->cycles * 100) / s->bytes : 0;
+
+        if (s->calls == 0) {
+            continue;
+        }
+        /* Per packet of the direction the stage processes */
+        switch (i) {
+        case picoquic_esp_profile_incoming:
+        case picoquic_esp_profile_aead_decrypt:
+        case picoquic_esp_profile_frames:
+            stage_packets = profile.packets_received;
+            break;
+        case picoquic_esp_profile_prepare:
+        case picoquic_esp_profile_aead_encrypt:
+            stage_packets = profile.packets_sent;
+            break;
+        default:
+            stage_packets = nb_packets;
+            break;
+        }
+        ESP_LOGI(tag, "profile: %-17s %8llu calls, %7llu %s/call, %7llu %s/pkt, %llu.%02u %s/byte",
+            picoquic_esp_profile_stage_name(i), (unsigned long long)s->calls,
+            (unsigned long long)(s->cycles / s->calls), unit,
+            (unsigned long long)((stage_packets > 0) ? s->cycles / stage_packets : 0), unit,
+            (unsigned long long)(per_byte_x100 / 100), (unsigned)(per_byte_x100 % 100), unit);
+    }
+#else
+    (void)tag;
+#endif
+}
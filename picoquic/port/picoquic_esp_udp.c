@@ -0,0 +1,667 @@
+/*
+ * Picoquic ESP-IDF lwIP raw UDP transport
+ *
+ * Receives datagrams in lwIP's raw UDP callback and passes the pbufs to the
+ * picoquic network task through a FreeRTOS queue, without copying them.
+ * The network task blocks on its task notification, given by the TCP/IP
+ * task after queuing a datagram or by picoquic_esp_udp_wake_up().
+ */
+
+#include "picoquic_esp_udp.h"
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "lwip/err.h"
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "picoquic_utils.h"
+#include "picosocks_esp32.h"
+#include "sdkconfig.h"
+
+#ifndef CONFIG_PICOQUIC_ESP_UDP_TASK_STACK_SIZE
+#define CONFIG_PICOQUIC_ESP_UDP_TASK_STACK_SIZE 16384
+#endif
+#ifndef CONFIG_PICOQUIC_ESP_UDP_TASK_PRIORITY
+#define CONFIG_PICOQUIC_ESP_UDP_TASK_PRIORITY 5
+#endif
+
+/* Maximum number of queued datagrams processed before preparing packets */
+#define PICOQUIC_ESP_UDP_RECV_BATCH 32
+
+typedef struct st_picoquic_esp_udp_item_t {
+    struct pbuf* p;
+    ip_addr_t addr_from;
+    ip_addr_t addr_dest;
+    u16_t port_from;
+    u8_t dest_if;
+    u8_t tos;
+    uint64_t rx_time;
+} picoquic_esp_udp_item_t;
+
+struct st_picoquic_esp_udp_t {
+    struct udp_pcb* pcb;
+    QueueHandle_t queue;
+    int af;
+    u16_t local_port;
+    /* Only written in the TCP/IP task */
+    volatile uint32_t nb_dropped;
+    /* Task blocked in picoquic_esp_udp_recv(), if any */
+    volatile TaskHandle_t wait_task;
+    volatile int wake_up_requested;
+};
+
+struct st_picoquic_esp_udp_thread_t {
+    picoquic_quic_t* quic;
+    picoquic_esp_udp_t* udp_ctx;
+    picoquic_packet_loop_param_t param;
+    picoquic_packet_loop_cb_fn loop_callback;
+    void* loop_callback_ctx;
+    TaskHandle_t task;
+    SemaphoreHandle_t exit_sem;
+    volatile int should_close;
+    int loop_ret;
+};
+
+/* Raw API calls must run in the TCP/IP task, or with the core lock held */
+typedef struct st_picoquic_esp_udp_call_t {
+    struct tcpip_api_call_data call;
+    picoquic_esp_udp_t* udp_ctx;
+    struct pbuf* p;
+    ip_addr_t addr;
+    u16_t port;
+    int route_mtu;
+} picoquic_esp_udp_call_t;
+
+static void picoquic_esp_udp_to_sockaddr(const ip_addr_t* ip, u16_t port, struct sockaddr_storage* addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+#if LWIP_IPV6
+    if (IP_IS_V6(ip)) {
+        struct sockaddr_in6* s6 = (struct sockaddr_in6*)addr;
+        s6->sin6_family = AF_INET6;
+        s6->sin6_port = lwip_htons(port);
+        memcpy(&s6->sin6_addr, ip_2_ip6(ip)->addr, sizeof(s6->sin6_addr));
+        s6->sin6_scope_id = ip6_addr_zone(ip_2_ip6(ip));
+        return;
+    }
+#endif
+    struct sockaddr_in* s4 = (struct sockaddr_in*)addr;
+    s4->sin_family = AF_INET;
+    s4->sin_port = lwip_htons(port);
+    s4->sin_addr.s_addr = ip4_addr_get_u32(ip_2_ip4(ip));
+}
+
+static int picoquic_esp_udp_from_sockaddr(const struct sockaddr* addr, ip_addr_t* ip, u16_t* port)
+{
+    int ret = 0;
+
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in* s4 = (const struct sockaddr_in*)addr;
+        ip_addr_set_ip4_u32_val(*ip, s4->sin_addr.s_addr);
+        *port = lwip_ntohs(s4->sin_port);
+    }
+#if LWIP_IPV6
+    else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6* s6 = (const struct sockaddr_in6*)addr;
+        IP_SET_TYPE_VAL(*ip, IPADDR_TYPE_V6);
+        memcpy(ip_2_ip6(ip)->addr, &s6->sin6_addr, sizeof(s6->sin6_addr));
+        ip6_addr_set_zone(ip_2_ip6(ip), (u8_t)s6->sin6_scope_id);
+        *port = lwip_ntohs(s6->sin6_port);
+    }
+#endif
+    else {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+__attribute__((weak)) uint64_t picoquic_esp_udp_get_rx_time(const struct pbuf* p)
+{
+    (void)p;
+    return picoquic_current_time();
+}
+
+/* Runs in the TCP/IP task, right after the datagram was demultiplexed */
+static void picoquic_esp_udp_recv_cb(void* arg, struct udp_pcb* pcb, struct pbuf* p,
+    const ip_addr_t* addr, u16_t port)
+{
+    picoquic_esp_udp_t* udp_ctx = (picoquic_esp_udp_t*)arg;
+    picoquic_esp_udp_item_t item;
+
+    (void)pcb;
+
+    /* Before the clone below, which loses any driver data kept in the pbuf */
+    item.rx_time = picoquic_esp_udp_get_rx_time(p);
+
+    if (p->next != NULL) {
+        /* Chained pbufs are rare (IP reassembly); make them contiguous so
+         * that picoquic can always decode in place. */
+        struct pbuf* q = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+        pbuf_free(p);
+        if (q == NULL) {
+            udp_ctx->nb_dropped++;
+            return;
+        }
+        p = q;
+    }
+
+    item.p = p;
+    ip_addr_copy(item.addr_from, *addr);
+    ip_addr_copy(item.addr_dest, *ip_current_dest_addr());
+    item.port_from = port;
+    item.dest_if = netif_get_index(ip_current_input_netif());
+    item.tos = 0;
+#if LWIP_IPV4
+    if (!ip_current_is_v6() && ip4_current_header() != NULL) {
+        item.tos = IPH_TOS(ip4_current_header());
+    }
+#endif
+
+    if (xQueueSend(udp_ctx->queue, &item, 0) != pdTRUE) {
+        /* Same situation as a full recvmbox on the socket path */
+        udp_ctx->nb_dropped++;
+        pbuf_free(p);
+    }
+    else {
+        TaskHandle_t wait_task = udp_ctx->wait_task;
+        if (wait_task != NULL) {
+            xTaskNotifyGive(wait_task);
+        }
+    }
+}
+
+static err_t picoquic_esp_udp_open_fn(struct tcpip_api_call_data* call)
+{
+    picoquic_esp_udp_call_t* msg = (picoquic_esp_udp_call_t*)call;
+    picoquic_esp_udp_t* udp_ctx = msg->udp_ctx;
+    struct udp_pcb* pcb;
+    err_t err;
+
+#if LWIP_IPV6
+    if (udp_ctx->af == AF_INET6) {
+        pcb = udp_new_ip_type(IPADDR_TYPE_V6);
+        err = (pcb == NULL) ? ERR_MEM : udp_bind(pcb, IP6_ADDR_ANY, msg->port);
+    }
+    else if (udp_ctx->af == AF_UNSPEC) {
+        /* Dual stack endpoint, for racing IPv6 and IPv4 attempts */
+        pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+        err = (pcb == NULL) ? ERR_MEM : udp_bind(pcb, IP_ANY_TYPE, msg->port);
+    }
+    else
+#endif
+    {
+        pcb = udp_new_ip_type(IPADDR_TYPE_V4);
+        err = (pcb == NULL) ? ERR_MEM : udp_bind(pcb, IP4_ADDR_ANY, msg->port);
+    }
+
+    if (err != ERR_OK) {
+        if (pcb != NULL) {
+            udp_remove(pcb);
+        }
+        return err;
+    }
+
+    /* Same ECN marking as the BSD socket path */
+    pcb->tos = PICOQUIC_ECN_ECT_1;
+    udp_recv(pcb, picoquic_esp_udp_recv_cb, udp_ctx);
+    udp_ctx->pcb = pcb;
+    udp_ctx->local_port = pcb->local_port;
+
+    return ERR_OK;
+}
+
+static err_t picoquic_esp_udp_close_fn(struct tcpip_api_call_data* call)
+{
+    picoquic_esp_udp_call_t* msg = (picoquic_esp_udp_call_t*)call;
+
+    udp_remove(msg->udp_ctx->pcb);
+    msg->udp_ctx->pcb = NULL;
+
+    return ERR_OK;
+}
+
+static err_t picoquic_esp_udp_send_fn(struct tcpip_api_call_data* call)
+{
+    picoquic_esp_udp_call_t* msg = (picoquic_esp_udp_call_t*)call;
+    struct netif* netif = ip_route(&msg->udp_ctx->pcb->local_ip, &msg->addr);
+
+    if (netif != NULL) {
+#if LWIP_IPV6
+        int mtu = IP_IS_V6(&msg->addr) ? netif_mtu6(netif) : netif->mtu;
+#else
+        int mtu = netif->mtu;
+#endif
+        /* Do not let lwIP fragment the datagram, as if DF was set */
+        if (msg->p->tot_len + picoquic_datagram_overhead(IP_IS_V6(&msg->addr) ? AF_INET6 : AF_INET) > mtu) {
+            msg->route_mtu = mtu;
+            return ERR_VAL;
+        }
+    }
+
+    return udp_sendto(msg->udp_ctx->pcb, msg->p, &msg->addr, msg->port);
+}
+
+picoquic_esp_udp_t* picoquic_esp_udp_open(int af, int local_port, int queue_len)
+{
+    picoquic_esp_udp_t* udp_ctx = (picoquic_esp_udp_t*)malloc(sizeof(picoquic_esp_udp_t));
+
+    if (queue_len <= 0) {
+        queue_len = CONFIG_PICOQUIC_ESP_UDP_QUEUE_LEN;
+    }
+
+    if (udp_ctx != NULL) {
+        memset(udp_ctx, 0, sizeof(picoquic_esp_udp_t));
+        udp_ctx->af = af;
+        udp_ctx->queue = xQueueCreate(queue_len, sizeof(picoquic_esp_udp_item_t));
+        if (udp_ctx->queue == NULL) {
+            free(udp_ctx);
+            udp_ctx = NULL;
+        }
+        else {
+            picoquic_esp_udp_call_t msg;
+            err_t err;
+
+            memset(&msg, 0, sizeof(msg));
+            msg.udp_ctx = udp_ctx;
+            msg.port = (u16_t)local_port;
+            err = tcpip_api_call(picoquic_esp_udp_open_fn, &msg.call);
+            if (err != ERR_OK) {
+                DBG_PRINTF("Cannot open raw UDP endpoint (af=%d, port=%d), err: %d\n", af, local_port, err);
+                vQueueDelete(udp_ctx->queue);
+                free(udp_ctx);
+                udp_ctx = NULL;
+            }
+        }
+    }
+
+    return udp_ctx;
+}
+
+void picoquic_esp_udp_close(picoquic_esp_udp_t* udp_ctx)
+{
+    picoquic_esp_udp_item_t item;
+
+    if (udp_ctx == NULL) {
+        return;
+    }
+
+    if (udp_ctx->pcb != NULL) {
+        picoquic_esp_udp_call_t msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.udp_ctx = udp_ctx;
+        (void)tcpip_api_call(picoquic_esp_udp_close_fn, &msg.call);
+    }
+
+    /* The callback is removed, drain what is left in the queue */
+    while (xQueueReceive(udp_ctx->queue, &item, 0) == pdTRUE) {
+        pbuf_free(item.p);
+    }
+    vQueueDelete(udp_ctx->queue);
+    free(udp_ctx);
+}
+
+int picoquic_esp_udp_get_local_port(picoquic_esp_udp_t* udp_ctx)
+{
+    return (int)udp_ctx->local_port;
+}
+
+uint32_t picoquic_esp_udp_get_drop_count(picoquic_esp_udp_t* udp_ctx)
+{
+    return udp_ctx->nb_dropped;
+}
+
+int picoquic_esp_udp_recv(picoquic_esp_udp_t* udp_ctx, picoquic_esp_udp_packet_t* packet, int64_t delta_t)
+{
+    picoquic_esp_udp_item_t item;
+    TickType_t ticks = 0;
+
+    if (delta_t > 10000000) {
+        delta_t = 10000000;
+    }
+    if (delta_t > 0) {
+        /* Round up, so that a short wait does not turn into a busy loop */
+        ticks = (TickType_t)((delta_t * configTICK_RATE_HZ + 999999) / 1000000);
+    }
+
+    if (xQueueReceive(udp_ctx->queue, &item, 0) != pdTRUE) {
+        if (ticks == 0) {
+            return 0;
+        }
+        /* Publish the task before checking again, so that a datagram or a
+         * wake up posted in between notifies it */
+        udp_ctx->wait_task = xTaskGetCurrentTaskHandle();
+        if (!udp_ctx->wake_up_requested && uxQueueMessagesWaiting(udp_ctx->queue) == 0) {
+            (void)ulTaskNotifyTake(pdTRUE, ticks);
+        }
+        udp_ctx->wait_task = NULL;
+        if (xQueueReceive(udp_ctx->queue, &item, 0) != pdTRUE) {
+            return 0;
+        }
+    }
+
+    packet->pbuf = item.p;
+    packet->bytes = (uint8_t*)item.p->payload;
+    packet->length = item.p->len;
+    picoquic_esp_udp_to_sockaddr(&item.addr_from, item.port_from, &packet->addr_from);
+    picoquic_esp_udp_to_sockaddr(&item.addr_dest, udp_ctx->local_port, &packet->addr_dest);
+    packet->dest_if = item.dest_if;
+    packet->received_ecn = item.tos & 0x03;
+    packet->rx_time = item.rx_time;
+
+    return 1;
+}
+
+void picoquic_esp_udp_wake_up(picoquic_esp_udp_t* udp_ctx)
+{
+    TaskHandle_t wait_task;
+
+    udp_ctx->wake_up_requested = 1;
+    wait_task = udp_ctx->wait_task;
+    if (wait_task != NULL) {
+        xTaskNotifyGive(wait_task);
+    }
+}
+
+int picoquic_esp_udp_take_wake_up(picoquic_esp_udp_t* udp_ctx)
+{
+    int wake_up_requested = udp_ctx->wake_up_requested;
+
+    if (wake_up_requested) {
+        udp_ctx->wake_up_requested = 0;
+    }
+    return wake_up_requested;
+}
+
+void picoquic_esp_udp_release(picoquic_esp_udp_t* udp_ctx, picoquic_esp_udp_packet_t* packet)
+{
+    (void)udp_ctx;
+    if (packet->pbuf != NULL) {
+        pbuf_free((struct pbuf*)packet->pbuf);
+        packet->pbuf = NULL;
+        packet->bytes = NULL;
+    }
+}
+
+int picoquic_esp_udp_send(picoquic_esp_udp_t* udp_ctx,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int dest_if,
+    const uint8_t* bytes, int length, int* sock_err)
+{
+    picoquic_esp_udp_call_t msg;
+    err_t err;
+    int pmtu;
+
+    (void)addr_from;
+    (void)dest_if;
+
+    pmtu = picoquic_pmtu_cache_get_limit(addr_dest);
+    if (pmtu > 0 && length + picoquic_datagram_overhead(addr_dest->sa_family) > pmtu) {
+        /* Known to be too large, e.g. a PMTUD probe: lost, not fatal */
+        if (sock_err != NULL) {
+            *sock_err = EMSGSIZE;
+        }
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.udp_ctx = udp_ctx;
+    if (picoquic_esp_udp_from_sockaddr(addr_dest, &msg.addr, &msg.port) != 0) {
+        if (sock_err != NULL) {
+            *sock_err = EAFNOSUPPORT;
+        }
+        return -1;
+    }
+
+    msg.p = pbuf_alloc(PBUF_TRANSPORT, (u16_t)length, PBUF_RAM);
+    if (msg.p == NULL) {
+        if (sock_err != NULL) {
+            *sock_err = ENOBUFS;
+        }
+        return -1;
+    }
+    memcpy(msg.p->payload, bytes, length);
+
+    err = tcpip_api_call(picoquic_esp_udp_send_fn, &msg.call);
+    pbuf_free(msg.p);
+
+    if (msg.route_mtu > 0) {
+        picoquic_pmtu_cache_set_route_mtu(addr_dest, msg.route_mtu);
+        if (sock_err != NULL) {
+            *sock_err = EMSGSIZE;
+        }
+        return -1;
+    }
+    if (err != ERR_OK) {
+        DBG_PRINTF("Could not send packet on raw UDP endpoint[AF=%d]= %d!\n",
+            addr_dest->sa_family, err);
+        if (sock_err != NULL) {
+            *sock_err = err_to_errno(err);
+        }
+        return -1;
+    }
+
+    return length;
+}
+
+static picoquic_esp_udp_t* picoquic_esp_udp_open_for_loop(picoquic_packet_loop_param_t* param)
+{
+#if LWIP_IPV6
+    return picoquic_esp_udp_open((param->local_af == AF_INET6 || param->local_af == AF_INET) ?
+        param->local_af : AF_UNSPEC, param->local_port, 0);
+#else
+    return picoquic_esp_udp_open(AF_INET, param->local_port, 0);
+#endif
+}
+
+/* Packet loop on an open endpoint, until an error, a loop callback asks to
+ * terminate, or *should_close is set and the loop is woken up.
+ */
+static int picoquic_esp_udp_run_loop(picoquic_quic_t* quic,
+    picoquic_esp_udp_t* udp_ctx,
+    picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void* loop_callback_ctx,
+    volatile int* should_close)
+{
+    int ret = 0;
+    uint64_t current_time = picoquic_get_quic_time(quic);
+    uint64_t last_time = current_time;
+    const int64_t delay_max = 10000000;
+    picoquic_packet_loop_options_t options;
+    uint8_t* send_buffer = (uint8_t*)malloc(PICOQUIC_MAX_PACKET_SIZE);
+
+    memset(&options, 0, sizeof(options));
+    if (udp_ctx == NULL || send_buffer == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if (loop_callback != NULL) {
+        ret = loop_callback(quic, picoquic_packet_loop_ready, loop_callback_ctx, &options);
+    }
+
+    while (ret == 0) {
+        picoquic_esp_udp_packet_t packet;
+        picoquic_cnx_t* last_cnx = NULL;
+        int64_t delta_t = picoquic_get_next_wake_delay(quic, current_time, delay_max);
+        size_t nb_packets_received = 0;
+        size_t bytes_sent = 0;
+
+        if (options.do_time_check && loop_callback != NULL) {
+            packet_loop_time_check_arg_t time_check_arg;
+            time_check_arg.current_time = current_time;
+            time_check_arg.delta_t = delta_t;
+            ret = loop_callback(quic, picoquic_packet_loop_time_check, loop_callback_ctx, &time_check_arg);
+            if (time_check_arg.delta_t < delta_t) {
+                delta_t = time_check_arg.delta_t;
+            }
+        }
+
+        /* Time of the last prepare, received packets are not stamped earlier */
+        last_time = current_time;
+        /* Wait for the first packet, then drain the queue without blocking */
+        while (ret == 0 && nb_packets_received < PICOQUIC_ESP_UDP_RECV_BATCH &&
+            picoquic_esp_udp_recv(udp_ctx, &packet, (nb_packets_received == 0) ? delta_t : 0) > 0) {
+            if (nb_packets_received == 0) {
+                current_time = picoquic_current_time();
+            }
+            (void)picoquic_incoming_packet_ex(quic, packet.bytes, packet.length,
+                (struct sockaddr*)&packet.addr_from, (struct sockaddr*)&packet.addr_dest,
+                packet.dest_if, packet.received_ecn, &last_cnx,
+                picoquic_rx_time_or_current(packet.rx_time, current_time, last_time));
+            picoquic_esp_udp_release(udp_ctx, &packet);
+            nb_packets_received++;
+        }
+
+        current_time = picoquic_current_time();
+        if (ret == 0 && nb_packets_received > 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_receive, loop_callback_ctx, &nb_packets_received);
+        }
+
+        if (ret == 0 && picoquic_esp_udp_take_wake_up(udp_ctx)) {
+            if (should_close != NULL && *should_close) {
+                ret = PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP;
+            }
+            else if (loop_callback != NULL) {
+                ret = loop_callback(quic, picoquic_packet_loop_wake_up, loop_callback_ctx, NULL);
+            }
+        }
+
+        while (ret == 0) {
+            struct sockaddr_storage peer_addr;
+            struct sockaddr_storage local_addr;
+            picoquic_connection_id_t log_cid;
+            int if_index = param->dest_if;
+            size_t send_length = 0;
+            size_t send_msg_size = 0;
+            int sock_err = 0;
+
+            last_cnx = NULL;
+            ret = picoquic_prepare_next_packet_ex(quic, current_time, send_buffer, PICOQUIC_MAX_PACKET_SIZE,
+                &send_length, &peer_addr, &local_addr, &if_index, &log_cid, &last_cnx, &send_msg_size);
+            if (ret != 0 || send_length == 0) {
+                break;
+            }
+            if (picoquic_esp_udp_send(udp_ctx, (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr,
+                if_index, send_buffer, (int)send_length, &sock_err) <= 0) {
+                if (last_cnx != NULL && picoquic_socket_error_implies_unreachable(sock_err)) {
+                    picoquic_notify_destination_unreachable(last_cnx, current_time,
+                        (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr, if_index, sock_err);
+                }
+            }
+            else {
+                bytes_sent += send_length;
+            }
+        }
+
+        if (ret == 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_send, loop_callback_ctx, &bytes_sent);
+        }
+    }
+
+    if (ret == PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP) {
+        ret = 0;
+    }
+
+    free(send_buffer);
+
+    return ret;
+}
+
+int picoquic_esp_udp_packet_loop(picoquic_quic_t* quic,
+    picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void* loop_callback_ctx)
+{
+    picoquic_esp_udp_t* udp_ctx = picoquic_esp_udp_open_for_loop(param);
+    int ret = picoquic_esp_udp_run_loop(quic, udp_ctx, param, loop_callback, loop_callback_ctx, NULL);
+
+    picoquic_esp_udp_close(udp_ctx);
+
+    return ret;
+}
+
+static void picoquic_esp_udp_thread_task(void* arg)
+{
+    picoquic_esp_udp_thread_t* thread = (picoquic_esp_udp_thread_t*)arg;
+
+    thread->loop_ret = picoquic_esp_udp_run_loop(thread->quic, thread->udp_ctx, &thread->param,
+        thread->loop_callback, thread->loop_callback_ctx, &thread->should_close);
+    DBG_PRINTF("Network task exits, ret = %d\n", thread->loop_ret);
+    xSemaphoreGive(thread->exit_sem);
+    vTaskDelete(NULL);
+}
+
+picoquic_esp_udp_thread_t* picoquic_esp_udp_start_network_thread(picoquic_quic_t* quic,
+    picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void* loop_callback_ctx,
+    int* ret)
+{
+    picoquic_esp_udp_thread_t* thread = (picoquic_esp_udp_thread_t*)malloc(sizeof(picoquic_esp_udp_thread_t));
+
+    *ret = 0;
+    if (thread == NULL) {
+        *ret = PICOQUIC_ERROR_MEMORY;
+        return NULL;
+    }
+    memset(thread, 0, sizeof(picoquic_esp_udp_thread_t));
+    thread->quic = quic;
+    thread->param = *param;
+    thread->loop_callback = loop_callback;
+    thread->loop_callback_ctx = loop_callback_ctx;
+    thread->exit_sem = xSemaphoreCreateBinary();
+    /* Opened here, so that a wake up before the task runs is not lost */
+    thread->udp_ctx = picoquic_esp_udp_open_for_loop(param);
+
+    if (thread->exit_sem == NULL || thread->udp_ctx == NULL) {
+        *ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if (xTaskCreate(picoquic_esp_udp_thread_task, "picoquic", CONFIG_PICOQUIC_ESP_UDP_TASK_STACK_SIZE,
+        thread, CONFIG_PICOQUIC_ESP_UDP_TASK_PRIORITY, &thread->task) != pdPASS) {
+        DBG_PRINTF("%s", "Cannot create the network task\n");
+        *ret = PICOQUIC_ERROR_MEMORY;
+    }
+
+    if (*ret != 0) {
+        picoquic_esp_udp_close(thread->udp_ctx);
+        if (thread->exit_sem != NULL) {
+            vSemaphoreDelete(thread->exit_sem);
+        }
+        free(thread);
+        thread = NULL;
+    }
+
+    return thread;
+}
+
+int picoquic_esp_udp_wake_up_network_thread(picoquic_esp_udp_thread_t* thread)
+{
+    picoquic_esp_udp_wake_up(thread->udp_ctx);
+    return 0;
+}
+
+int picoquic_esp_udp_delete_network_thread(picoquic_esp_udp_thread_t* thread)
+{
+    int ret;
+
+    thread->should_close = 1;
+    picoquic_esp_udp_wake_up(thread->udp_ctx);
+    (void)xSemaphoreTake(thread->exit_sem, portMAX_DELAY);
+    ret = thread->loop_ret;
+
+    picoquic_esp_udp_close(thread->udp_ctx);
+    vSemaphoreDelete(thread->exit_sem);
+    free(thread);
+
+    return ret;
+}
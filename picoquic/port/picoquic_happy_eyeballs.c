@@ -0,0 +1,171 @@
+/*
+ * Picoquic happy eyeballs connection racing
+ *
+ * Each attempt is a regular client connection whose callback is intercepted
+ * until one of them completes the handshake. The winner is then handed back
+ * to the application callback, and the other attempts are closed.
+ */
+
+#include "picoquic_happy_eyeballs.h"
+
+#include <string.h>
+
+#include "picoquic_utils.h"
+#include "sdkconfig.h"
+
+#ifndef CONFIG_PICOQUIC_HAPPY_EYEBALLS_DELAY_MS
+#define CONFIG_PICOQUIC_HAPPY_EYEBALLS_DELAY_MS 100
+#endif
+
+static int picoquic_happy_eyeballs_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* stream_ctx);
+
+static int picoquic_happy_eyeballs_rank(picoquic_happy_eyeballs_t* he, picoquic_cnx_t* cnx)
+{
+    for (int i = 0; i < he->nb_started; i++) {
+        if (he->cnx[i] == cnx) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Start the next attempt. An attempt that cannot be created counts as failed,
+ * and the one after it is tried immediately.
+ */
+static void picoquic_happy_eyeballs_start_next(picoquic_happy_eyeballs_t* he, uint64_t current_time)
+{
+    while (he->winner == NULL && he->nb_started < he->nb_addresses) {
+        int rank = he->nb_started++;
+        picoquic_cnx_t* cnx = picoquic_create_cnx(he->quic, picoquic_null_connection_id, picoquic_null_connection_id,
+            (struct sockaddr*)&he->addresses[rank], current_time, 0, he->sni, he->alpn, 1);
+
+        if (cnx != NULL) {
+            picoquic_set_callback(cnx, picoquic_happy_eyeballs_callback, he);
+            he->cnx[rank] = cnx;
+            if (picoquic_start_client_cnx(cnx) == 0) {
+                DBG_PRINTF("Happy eyeballs attempt %d started (af=%d)\n", rank, he->addresses[rank].ss_family);
+                he->next_start_time = current_time + he->stagger_delay;
+                break;
+            }
+            he->cnx[rank] = NULL;
+            picoquic_set_callback(cnx, NULL, NULL);
+            picoquic_delete_cnx(cnx);
+        }
+        DBG_PRINTF("Cannot start happy eyeballs attempt %d (af=%d)\n", rank, he->addresses[rank].ss_family);
+        he->nb_failed++;
+    }
+}
+
+static int picoquic_happy_eyeballs_callback(picoquic_cnx_t* cnx,
+    uint64_t stream_id, uint8_t* bytes, size_t length,
+    picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* stream_ctx)
+{
+    int ret = 0;
+    picoquic_happy_eyeballs_t* he = (picoquic_happy_eyeballs_t*)callback_ctx;
+    int rank = picoquic_happy_eyeballs_rank(he, cnx);
+
+    switch (fin_or_event) {
+    case picoquic_callback_almost_ready:
+    case picoquic_callback_ready:
+        if (he->winner == NULL && rank >= 0) {
+            /* First completed handshake: hand it to the application, close the others */
+            he->winner = cnx;
+            picoquic_set_callback(cnx, he->callback_fn, he->callback_ctx);
+            picoquic_happy_eyeballs_abort(he);
+            DBG_PRINTF("Happy eyeballs attempt %d won (af=%d)\n", rank, he->addresses[rank].ss_family);
+            ret = he->callback_fn(cnx, stream_id, bytes, length, fin_or_event, he->callback_ctx, stream_ctx);
+        }
+        break;
+    case picoquic_callback_close:
+    case picoquic_callback_application_close:
+    case picoquic_callback_stateless_reset:
+        if (rank >= 0) {
+            he->cnx[rank] = NULL;
+            if (he->winner == NULL) {
+                he->nb_failed++;
+                if (he->nb_failed >= he->nb_addresses) {
+                    /* Last attempt failed, report it as a regular connection failure */
+                    ret = he->callback_fn(cnx, stream_id, bytes, length, fin_or_event, he->callback_ctx, stream_ctx);
+                }
+                else if (he->nb_started < he->nb_addresses) {
+                    /* No need to wait for the stagger delay */
+                    picoquic_happy_eyeballs_start_next(he, picoquic_get_quic_time(he->quic));
+                }
+            }
+        }
+        picoquic_set_callback(cnx, NULL, NULL);
+        break;
+    default:
+        /* Events of attempts that did not win are dropped */
+        break;
+    }
+
+    return ret;
+}
+
+int picoquic_happy_eyeballs_start(picoquic_happy_eyeballs_t* he, picoquic_quic_t* quic,
+    const struct sockaddr_storage* addresses, int nb_addresses,
+    const char* sni, const char* alpn,
+    picoquic_callback_fn callback_fn, void* callback_ctx,
+    uint64_t stagger_delay, uint64_t current_time)
+{
+    memset(he, 0, sizeof(picoquic_happy_eyeballs_t));
+    he->quic = quic;
+    he->sni = sni;
+    he->alpn = alpn;
+    he->callback_fn = callback_fn;
+    he->callback_ctx = callback_ctx;
+    he->stagger_delay = (stagger_delay > 0) ? stagger_delay : (uint64_t)CONFIG_PICOQUIC_HAPPY_EYEBALLS_DELAY_MS * 1000;
+
+    for (int i = 0; i < nb_addresses && he->nb_addresses < PICOQUIC_HAPPY_EYEBALLS_MAX; i++) {
+        memcpy(&he->addresses[he->nb_addresses++], &addresses[i], sizeof(struct sockaddr_storage));
+    }
+
+    picoquic_happy_eyeballs_start_next(he, current_time);
+
+    return (he->nb_failed < he->nb_addresses) ? 0 : -1;
+}
+
+picoquic_cnx_t* picoquic_happy_eyeballs_check(picoquic_happy_eyeballs_t* he,
+    uint64_t current_time, int64_t* delta_t)
+{
+    if (he->winner == NULL && he->nb_started < he->nb_addresses) {
+        if (current_time >= he->next_start_time) {
+            picoquic_happy_eyeballs_start_next(he, current_time);
+        }
+        if (delta_t != NULL && he->nb_started < he->nb_addresses) {
+            int64_t start_delay = (int64_t)(he->next_start_time - current_time);
+            if (start_delay < *delta_t) {
+                *delta_t = start_delay;
+            }
+        }
+    }
+
+    return he->winner;
+}
+
+int picoquic_happy_eyeballs_is_failed(picoquic_happy_eyeballs_t* he)
+{
+    return he->winner == NULL && he->nb_addresses > 0 && he->nb_failed >= he->nb_addresses;
+}
+
+void picoquic_happy_eyeballs_abort(picoquic_happy_eyeballs_t* he)
+{
+    /* No further attempts */
+    he->nb_addresses = he->nb_started;
+
+    for (int i = 0; i < he->nb_started; i++) {
+        if (he->cnx[i] != NULL && he->cnx[i] != he->winner) {
+            picoquic_cnx_t* cnx = he->cnx[i];
+            he->cnx[i] = NULL;
+            picoquic_set_callback(cnx, NULL, NULL);
+            (void)picoquic_close(cnx, 0);
+        }
+    }
+
+    if (he->winner == NULL) {
+        he->nb_failed = he->nb_addresses;
+    }
+}
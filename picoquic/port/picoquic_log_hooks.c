@@ -0,0 +1,75 @@
+/*
+ * Picoquic per-packet logging hooks, compiled out
+ *
+ * Built when CONFIG_PICOQUIC_LOG_HOOKS_NO_PACKETS is set: the per-packet
+ * functions of unified_log.c are replaced at link time (-Wl,--wrap) by the
+ * empty functions below. The calls from the packet and sender code then no
+ * longer test the logging state nor go through the text or binary log
+ * vtables. The other events (losses, drops, connection lifecycle, app
+ * messages) are unchanged.
+ */
+
+#include "picoquic_internal.h"
+#include "picoquic_unified_log.h"
+#include "sdkconfig.h"
+
+void __wrap_picoquic_log_quic_pdu(picoquic_quic_t* quic, int receiving, uint64_t current_time, uint64_t cid64,
+    const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length)
+{
+    (void)quic;
+    (void)receiving;
+    (void)current_time;
+    (void)cid64;
+    (void)addr_peer;
+    (void)addr_local;
+    (void)packet_length;
+}
+
+void __wrap_picoquic_log_pdu(picoquic_cnx_t* cnx, int receiving, uint64_t current_time,
+    const struct sockaddr* addr_peer, const struct sockaddr* addr_local, size_t packet_length,
+    uint64_t unique_path_id, unsigned char ecn)
+{
+    (void)cnx;
+    (void)receiving;
+    (void)current_time;
+    (void)addr_peer;
+    (void)addr_local;
+    (void)packet_length;
+    (void)unique_path_id;
+    (void)ecn;
+}
+
+void __wrap_picoquic_log_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x, int receiving, uint64_t current_time,
+    struct st_picoquic_packet_header_t* ph, const uint8_t* bytes, size_t bytes_max)
+{
+    (void)cnx;
+    (void)path_x;
+    (void)receiving;
+    (void)current_time;
+    (void)ph;
+    (void)bytes;
+    (void)bytes_max;
+}
+
+void __wrap_picoquic_log_outgoing_packet(picoquic_cnx_t* cnx, picoquic_path_t* path_x,
+    uint8_t* bytes, uint64_t sequence_number, size_t pn_length, size_t length,
+    uint8_t* send_buffer, size_t send_length, uint64_t current_time)
+{
+    (void)cnx;
+    (void)path_x;
+    (void)bytes;
+    (void)sequence_number;
+    (void)pn_length;
+    (void)length;
+    (void)send_buffer;
+    (void)send_length;
+    (void)current_time;
+}
+
+#if !CONFIG_PICOQUIC_LOG_HOOKS_CC_DUMP
+void __wrap_picoquic_log_cc_dump(picoquic_cnx_t* cnx, uint64_t current_time)
+{
+    (void)cnx;
+    (void)current_time;
+}
+#endif
@@ -0,0 +1,279 @@
+/*
+ * Picoquic sharded server (Linux target)
+ *
+ * Each worker runs a packet loop on its own socket and context, using the
+ * batch receive and GSO send helpers of the socket shim.
+ */
+
+#include "picoquic_sharded_server.h"
+
+#include <string.h>
+
+#include "picoquic_utils.h"
+#include "sdkconfig.h"
+
+#ifndef CONFIG_PICOQUIC_TXTIME_HORIZON_US
+#define CONFIG_PICOQUIC_TXTIME_HORIZON_US 0
+#endif
+
+/* Datagrams prepared by picoquic per GSO send */
+#define PICOQUIC_SHARD_SEND_BUFFER_SIZE 0xFFFF
+/* Sends prepared ahead of their pacing time per loop iteration */
+#define PICOQUIC_SHARD_TXTIME_AHEAD_MAX 64
+
+void picoquic_shard_cnx_id_callback(picoquic_quic_t* quic, picoquic_connection_id_t cnx_id_local,
+    picoquic_connection_id_t cnx_id_remote, void* cnx_id_cb_data, picoquic_connection_id_t* cnx_id_returned)
+{
+    picoquic_shard_t* shard = (picoquic_shard_t*)cnx_id_cb_data;
+    int nb_shards = shard->server->nb_shards;
+
+    (void)quic;
+    (void)cnx_id_remote;
+
+    *cnx_id_returned = cnx_id_local;
+    if (cnx_id_returned->id_len > 0 && nb_shards > 1) {
+        /* Same value modulo nb_shards as the reuseport program computes */
+        int first_byte = cnx_id_local.id[0] - (cnx_id_local.id[0] % nb_shards) + shard->shard_id;
+        if (first_byte > 0xFF) {
+            first_byte -= nb_shards;
+        }
+        cnx_id_returned->id[0] = (uint8_t)first_byte;
+    }
+}
+
+static int picoquic_shard_packet_loop(picoquic_shard_t* shard,
+    picoquic_recv_slot_t* slots, uint8_t* send_buffer)
+{
+    int ret = 0;
+    picoquic_sharded_server_t* server = shard->server;
+    picoquic_quic_t* quic = shard->quic;
+    uint64_t current_time = picoquic_current_time();
+    uint64_t send_time = current_time;
+    picoquic_packet_loop_options_t options;
+    int gso_disabled = 0;
+
+    memset(&options, 0, sizeof(options));
+    if (server->loop_callback != NULL) {
+        ret = server->loop_callback(quic, picoquic_packet_loop_ready, server->loop_callback_ctx, &options);
+    }
+
+    while (ret == 0 && !server->stop_requested) {
+        picoquic_cnx_t* last_cnx = NULL;
+        int64_t delta_t = picoquic_get_next_wake_delay(quic, current_time, PICOQUIC_SHARD_STOP_DELAY);
+        int nb_slots;
+        size_t bytes_sent = 0;
+
+        if (options.do_time_check && server->loop_callback != NULL) {
+            packet_loop_time_check_arg_t time_check_arg;
+            time_check_arg.current_time = current_time;
+            time_check_arg.delta_t = delta_t;
+            ret = server->loop_callback(quic, picoquic_packet_loop_time_check, server->loop_callback_ctx, &time_check_arg);
+            if (time_check_arg.delta_t < delta_t) {
+                delta_t = time_check_arg.delta_t;
+            }
+        }
+
+        nb_slots = picoquic_select_batch(&shard->fd, 1, slots, PICOQUIC_RECV_BATCH_MAX, delta_t, &current_time);
+        if (nb_slots < 0) {
+            ret = -1;
+            break;
+        }
+        for (int i = 0; i < nb_slots; i++) {
+            (void)picoquic_incoming_recv_slot(quic, &slots[i], shard->local_port, &last_cnx, current_time, send_time);
+        }
+
+        current_time = picoquic_current_time();
+        if (ret == 0 && nb_slots > 0 && server->loop_callback != NULL) {
+            size_t nb_packets_received = (size_t)nb_slots;
+            ret = server->loop_callback(quic, picoquic_packet_loop_after_receive, server->loop_callback_ctx, &nb_packets_received);
+        }
+
+        /* Never prepare before the departure time of packets already handed
+         * to the kernel, so that picoquic sees a monotonic clock. */
+        if (send_time < current_time) {
+            send_time = current_time;
+        }
+        for (int nb_ahead = 0; ret == 0;) {
+            struct sockaddr_storage peer_addr;
+            struct sockaddr_storage local_addr;
+            picoquic_connection_id_t log_cid;
+            int if_index = 0;
+            size_t send_length = 0;
+            size_t send_msg_size = 0;
+            int sock_err = 0;
+
+            last_cnx = NULL;
+            ret = picoquic_prepare_next_packet_ex(quic, send_time, send_buffer,
+                (gso_disabled) ? PICOQUIC_MAX_PACKET_SIZE : PICOQUIC_SHARD_SEND_BUFFER_SIZE,
+                &send_length, &peer_addr, &local_addr, &if_index, &log_cid, &last_cnx, &send_msg_size);
+            if (ret != 0) {
+                break;
+            }
+            if (send_length == 0) {
+                /* With SO_TXTIME, prepare the packets due within the horizon
+                 * now, and let the qdisc release them at their pacing time.
+                 * The next wake time is not only pacing: PTO, loss, ack delay
+                 * and idle timers due within the horizon also run early,
+                 * which is why the horizon is kept to a few ms. */
+                uint64_t next_time;
+
+                if (!shard->txtime_enabled || ++nb_ahead > PICOQUIC_SHARD_TXTIME_AHEAD_MAX) {
+                    break;
+                }
+                next_time = picoquic_get_next_wake_time(quic, send_time);
+                if (next_time <= send_time || next_time > current_time + CONFIG_PICOQUIC_TXTIME_HORIZON_US) {
+                    break;
+                }
+                send_time = next_time;
+                continue;
+            }
+            if (picoquic_send_through_socket_gso_txtime(shard->fd, (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr,
+                if_index, (const char*)send_buffer, (int)send_length,
+                (send_msg_size > 0) ? (int)send_msg_size : (int)send_length,
+                (send_time > current_time) ? send_time : 0, &gso_disabled, &sock_err) <= 0) {
+                if (last_cnx != NULL && picoquic_socket_error_implies_unreachable(sock_err)) {
+                    picoquic_notify_destination_unreachable(last_cnx, current_time,
+                        (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr, if_index, sock_err);
+                }
+            }
+            else {
+                bytes_sent += send_length;
+            }
+        }
+
+        if (ret == 0 && server->loop_callback != NULL) {
+            ret = server->loop_callback(quic, picoquic_packet_loop_after_send, server->loop_callback_ctx, &bytes_sent);
+        }
+    }
+
+    if (ret == PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP) {
+        ret = 0;
+    }
+
+    return ret;
+}
+
+static void* picoquic_shard_thread(void* arg)
+{
+    picoquic_shard_t* shard = (picoquic_shard_t*)arg;
+    picoquic_recv_slot_t* slots = (picoquic_recv_slot_t*)malloc(PICOQUIC_RECV_BATCH_MAX * sizeof(picoquic_recv_slot_t));
+    /* Large enough for GRO coalesced datagrams */
+    uint8_t* recv_buffers = (uint8_t*)malloc(PICOQUIC_RECV_BATCH_MAX * PICOQUIC_RECV_GRO_BUFFER_SIZE);
+    uint8_t* send_buffer = (uint8_t*)malloc(PICOQUIC_SHARD_SEND_BUFFER_SIZE);
+
+    if (slots == NULL || recv_buffers == NULL || send_buffer == NULL) {
+        shard->loop_ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        for (int i = 0; i < PICOQUIC_RECV_BATCH_MAX; i++) {
+            memset(&slots[i], 0, sizeof(picoquic_recv_slot_t));
+            slots[i].buffer = recv_buffers + i * PICOQUIC_RECV_GRO_BUFFER_SIZE;
+            slots[i].buffer_max = PICOQUIC_RECV_GRO_BUFFER_SIZE;
+        }
+        shard->loop_ret = picoquic_shard_packet_loop(shard, slots, send_buffer);
+    }
+    DBG_PRINTF("Shard %d exits, ret = %d\n", shard->shard_id, shard->loop_ret);
+
+    free(slots);
+    free(recv_buffers);
+    free(send_buffer);
+
+    return NULL;
+}
+
+int picoquic_sharded_server_start(picoquic_sharded_server_t* server, int nb_shards, int af, int port,
+    picoquic_shard_create_quic_fn create_quic_fn, void* create_ctx,
+    picoquic_packet_loop_cb_fn loop_callback, void* loop_callback_ctx)
+{
+    int ret = 0;
+    uint64_t current_time = picoquic_current_time();
+
+    memset(server, 0, sizeof(picoquic_sharded_server_t));
+    server->loop_callback = loop_callback;
+    server->loop_callback_ctx = loop_callback_ctx;
+
+    if (nb_shards <= 0 || nb_shards > PICOQUIC_SHARDS_MAX) {
+        return -1;
+    }
+    server->nb_shards = nb_shards;
+
+    ret = picoquic_open_sharded_server_sockets(server->sockets, nb_shards, af, port);
+
+    for (int i = 0; ret == 0 && i < nb_shards; i++) {
+        picoquic_shard_t* shard = &server->shards[i];
+
+        shard->server = server;
+        shard->shard_id = i;
+        shard->fd = server->sockets[i];
+        shard->local_port = picoquic_get_local_port(shard->fd);
+        shard->txtime_enabled = (CONFIG_PICOQUIC_TXTIME_HORIZON_US > 0 &&
+            picoquic_socket_set_txtime_options(shard->fd) == 0);
+        shard->quic = create_quic_fn(i, picoquic_shard_cnx_id_callback, shard, create_ctx, current_time);
+        if (shard->quic == NULL) {
+            DBG_PRINTF("Cannot create the context of shard %d\n", i);
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < nb_shards; i++) {
+        picoquic_shard_t* shard = &server->shards[i];
+
+        if (pthread_create(&shard->thread, NULL, picoquic_shard_thread, shard) != 0) {
+            DBG_PRINTF("Cannot start the thread of shard %d\n", i);
+            ret = -1;
+        }
+        else {
+            shard->thread_started = 1;
+        }
+    }
+
+    if (ret != 0) {
+        picoquic_sharded_server_delete(server);
+    }
+
+    return ret;
+}
+
+void picoquic_sharded_server_stop(picoquic_sharded_server_t* server)
+{
+    server->stop_requested = 1;
+}
+
+int picoquic_sharded_server_wait(picoquic_sharded_server_t* server)
+{
+    int ret = 0;
+
+    for (int i = 0; i < server->nb_shards; i++) {
+        picoquic_shard_t* shard = &server->shards[i];
+
+        if (shard->thread_started) {
+            pthread_join(shard->thread, NULL);
+            shard->thread_started = 0;
+            if (ret == 0) {
+                ret = shard->loop_ret;
+            }
+        }
+    }
+
+    return ret;
+}
+
+void picoquic_sharded_server_delete(picoquic_sharded_server_t* server)
+{
+    picoquic_sharded_server_stop(server);
+    (void)picoquic_sharded_server_wait(server);
+
+    for (int i = 0; i < server->nb_shards; i++) {
+        if (server->shards[i].quic != NULL) {
+            picoquic_free(server->shards[i].quic);
+            server->shards[i].quic = NULL;
+        }
+    }
+    picoquic_close_sharded_server_sockets(server->sockets, server->nb_shards);
+    server->nb_shards = 0;
+}
+
+picoquic_quic_t* picoquic_sharded_server_get_quic(picoquic_sharded_server_t* server, int shard_id)
+{
+    return (shard_id >= 0 && shard_id < server->nb_shards) ? server->shards[shard_id].quic : NULL;
+}
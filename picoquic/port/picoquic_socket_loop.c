@@ -0,0 +1,281 @@
+/*
+ * Picoquic ESP-IDF socket packet loop
+ *
+ * Same structure as the stock picoquic_packet_loop_v2(): wait for the next
+ * wake time or for a datagram, submit what was received, then prepare and
+ * send until picoquic has nothing left to send.
+ */
+
+#include "picoquic_socket_loop.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "picoquic_utils.h"
+#include "sdkconfig.h"
+
+#ifndef CONFIG_PICOQUIC_SOCKET_LOOP_BATCH
+#define CONFIG_PICOQUIC_SOCKET_LOOP_BATCH 8
+#endif
+#ifndef CONFIG_PICOQUIC_SOCKET_LOOP_SEND_BATCH
+#define CONFIG_PICOQUIC_SOCKET_LOOP_SEND_BATCH 8
+#endif
+
+static int picoquic_socket_loop_open_sockets(picoquic_packet_loop_param_t* param, SOCKET_TYPE* sockets,
+    int* sock_af)
+{
+    int nb_sockets = 0;
+    const int loop_af[] = { AF_INET, AF_INET6 };
+
+    for (int i = 0; i < 2; i++) {
+        if (param->local_af != 0 && param->local_af != loop_af[i]) {
+            continue;
+        }
+        sockets[nb_sockets] = picoquic_open_client_socket(loop_af[i]);
+        if (sockets[nb_sockets] == INVALID_SOCKET) {
+            continue;
+        }
+        if (loop_af[i] == AF_INET6 && nb_sockets > 0) {
+            /* The IPv4 socket may be bound to the same port */
+            int val = 1;
+            (void)setsockopt(sockets[nb_sockets], IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(int));
+        }
+        if (picoquic_bind_to_port(sockets[nb_sockets], loop_af[i], param->local_port) != 0) {
+            DBG_PRINTF("Cannot bind socket (af=%d) to port %d\n", loop_af[i], param->local_port);
+            SOCKET_CLOSE(sockets[nb_sockets]);
+            continue;
+        }
+        sock_af[nb_sockets] = loop_af[i];
+        nb_sockets++;
+    }
+
+    return nb_sockets;
+}
+
+/* Rank of the socket for the address family of the destination, or -1 */
+static int picoquic_socket_loop_find_socket(const int* sock_af, int nb_sockets, int af)
+{
+    for (int i = 0; i < nb_sockets; i++) {
+        if (sock_af[i] == af) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Queued packets are only checked after later prepares, which may have
+ * deleted their connection */
+static int picoquic_socket_loop_cnx_exists(picoquic_quic_t* quic, picoquic_cnx_t* cnx)
+{
+    for (picoquic_cnx_t* next = picoquic_get_first_cnx(quic); next != NULL; next = picoquic_get_next_cnx(next)) {
+        if (next == cnx) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Send the queued packets, and report the unreachable destinations.
+ * A coalesced packet that the kernel or driver rejects with EIO or EINVAL
+ * disables GSO on the loop and is sent again one packet at a time, and so
+ * are the packets that sendmmsg() gave up on after the EIO. */
+static void picoquic_socket_loop_flush(picoquic_quic_t* quic, SOCKET_TYPE fd, picoquic_send_batch_t* batch,
+    picoquic_cnx_t** batch_cnx, uint64_t current_time, int* gso_disabled, size_t* bytes_sent)
+{
+    int nb_entries = batch->nb_entries;
+    int sock_err = 0;
+
+    (void)picoquic_send_batch_flush(fd, batch, &sock_err);
+    for (int i = 0; i < nb_entries; i++) {
+        picoquic_send_batch_entry_t* entry = &batch->entries[i];
+
+        if (entry->bytes_sent <= 0 && (entry->sock_err == EIO || entry->sock_err == EINVAL)) {
+            int segment_size = 0;
+
+            if (entry->send_msg_size > 0 && entry->send_msg_size < entry->length) {
+                segment_size = entry->send_msg_size;
+                *gso_disabled = 1;
+            }
+            entry->sock_err = 0;
+            entry->bytes_sent = picoquic_send_through_socket_gso(fd, (struct sockaddr*)&entry->addr_dest,
+                (struct sockaddr*)&entry->addr_from, entry->dest_if, (const char*)entry->bytes, entry->length,
+                segment_size, gso_disabled, &entry->sock_err);
+        }
+        if (entry->bytes_sent > 0) {
+            *bytes_sent += (size_t)entry->bytes_sent;
+        }
+        else if (batch_cnx[i] != NULL && picoquic_socket_error_implies_unreachable(entry->sock_err) &&
+            picoquic_socket_loop_cnx_exists(quic, batch_cnx[i])) {
+            picoquic_notify_destination_unreachable(batch_cnx[i], current_time,
+                (struct sockaddr*)&entry->addr_dest, (struct sockaddr*)&entry->addr_from, entry->dest_if,
+                entry->sock_err);
+        }
+    }
+}
+
+int picoquic_socket_packet_loop(picoquic_quic_t* quic,
+    picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void* loop_callback_ctx)
+{
+    int ret = 0;
+    uint64_t current_time = picoquic_get_quic_time(quic);
+    uint64_t last_time = current_time;
+    const int64_t delay_max = 10000000;
+    picoquic_packet_loop_options_t options;
+    SOCKET_TYPE sockets[PICOQUIC_SOCKET_LOOP_MAX_SOCKETS];
+    int sock_af[PICOQUIC_SOCKET_LOOP_MAX_SOCKETS];
+    int local_ports[PICOQUIC_SOCKET_LOOP_MAX_SOCKETS];
+    int nb_sockets = picoquic_socket_loop_open_sockets(param, sockets, sock_af);
+    picoquic_poller_t* poller = NULL;
+    picoquic_recv_slot_t slots[CONFIG_PICOQUIC_SOCKET_LOOP_BATCH];
+    uint8_t* recv_buffers = (uint8_t*)malloc(CONFIG_PICOQUIC_SOCKET_LOOP_BATCH * PICOQUIC_MAX_PACKET_SIZE);
+    picoquic_send_batch_t* batch = (picoquic_send_batch_t*)malloc(sizeof(picoquic_send_batch_t));
+    picoquic_cnx_t* batch_cnx[CONFIG_PICOQUIC_SOCKET_LOOP_SEND_BATCH];
+    int batch_rank = -1;
+    int gso_disabled = 1;
+    size_t send_buffer_size = PICOQUIC_MAX_PACKET_SIZE;
+    uint8_t* send_buffers = NULL;
+
+#if defined(__linux)
+    /* Room for picoquic to coalesce the packets of a path, sent with UDP_SEGMENT */
+    if (!param->do_not_use_gso) {
+        gso_disabled = 0;
+        send_buffer_size = PICOQUIC_RECV_GRO_BUFFER_SIZE;
+    }
+#endif
+    send_buffers = (uint8_t*)malloc(CONFIG_PICOQUIC_SOCKET_LOOP_SEND_BATCH * send_buffer_size);
+
+    memset(&options, 0, sizeof(options));
+    for (int i = 0; i < CONFIG_PICOQUIC_SOCKET_LOOP_BATCH; i++) {
+        memset(&slots[i], 0, sizeof(picoquic_recv_slot_t));
+        slots[i].buffer = (recv_buffers != NULL) ? recv_buffers + i * PICOQUIC_MAX_PACKET_SIZE : NULL;
+        slots[i].buffer_max = PICOQUIC_MAX_PACKET_SIZE;
+    }
+    for (int i = 0; i < nb_sockets; i++) {
+        local_ports[i] = picoquic_get_local_port(sockets[i]);
+    }
+    if (nb_sockets == 0) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    else if ((poller = picoquic_poller_create(nb_sockets)) == NULL || recv_buffers == NULL ||
+        send_buffers == NULL || batch == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else {
+        picoquic_send_batch_init(batch);
+        /* Sockets are registered in order, their poller rank is their index */
+        for (int i = 0; ret == 0 && i < nb_sockets; i++) {
+            if (picoquic_poller_add(poller, sockets[i]) != i) {
+                ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+            }
+        }
+        if (ret == 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_ready, loop_callback_ctx, &options);
+        }
+    }
+
+    while (ret == 0) {
+        picoquic_cnx_t* last_cnx = NULL;
+        int64_t delta_t = picoquic_get_next_wake_delay(quic, current_time, delay_max);
+        int nb_slots;
+        size_t bytes_sent = 0;
+
+        if (options.do_time_check && loop_callback != NULL) {
+            packet_loop_time_check_arg_t time_check_arg;
+            time_check_arg.current_time = current_time;
+            time_check_arg.delta_t = delta_t;
+            ret = loop_callback(quic, picoquic_packet_loop_time_check, loop_callback_ctx, &time_check_arg);
+            if (time_check_arg.delta_t < delta_t) {
+                delta_t = time_check_arg.delta_t;
+            }
+        }
+
+        /* Time of the last prepare, received packets are not stamped earlier */
+        last_time = current_time;
+        nb_slots = picoquic_poller_select_batch(poller, slots, CONFIG_PICOQUIC_SOCKET_LOOP_BATCH, delta_t,
+            &current_time);
+        if (nb_slots < 0) {
+            ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+            break;
+        }
+        for (int i = 0; i < nb_slots; i++) {
+            (void)picoquic_incoming_recv_slot(quic, &slots[i], local_ports[slots[i].socket_rank], &last_cnx,
+                current_time, last_time);
+        }
+
+        current_time = picoquic_current_time();
+        if (ret == 0 && nb_slots > 0 && loop_callback != NULL) {
+            size_t nb_packets_received = (size_t)nb_slots;
+            ret = loop_callback(quic, picoquic_packet_loop_after_receive, loop_callback_ctx, &nb_packets_received);
+        }
+
+        /* Prepare the packets in turn into the buffers of the batch, and
+         * send them with one call when it is full, when the next packet
+         * goes through the other socket, or when nothing is left to send. */
+        while (ret == 0) {
+            struct sockaddr_storage peer_addr;
+            struct sockaddr_storage local_addr;
+            picoquic_connection_id_t log_cid;
+            int if_index = param->dest_if;
+            uint8_t* send_buffer = send_buffers + batch->nb_entries * send_buffer_size;
+            size_t send_length = 0;
+            size_t send_msg_size = 0;
+            int rank;
+
+            last_cnx = NULL;
+            ret = picoquic_prepare_next_packet_ex(quic, current_time, send_buffer,
+                (gso_disabled) ? PICOQUIC_MAX_PACKET_SIZE : send_buffer_size,
+                &send_length, &peer_addr, &local_addr, &if_index, &log_cid, &last_cnx, &send_msg_size);
+            if (ret != 0 || send_length == 0) {
+                break;
+            }
+            if ((rank = picoquic_socket_loop_find_socket(sock_af, nb_sockets, peer_addr.ss_family)) < 0) {
+                if (last_cnx != NULL) {
+                    picoquic_notify_destination_unreachable(last_cnx, current_time,
+                        (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr, if_index, EAFNOSUPPORT);
+                }
+                continue;
+            }
+            if (rank != batch_rank && batch->nb_entries > 0) {
+                /* Once the queued packets are sent, the first buffer is free */
+                picoquic_socket_loop_flush(quic, sockets[batch_rank], batch, batch_cnx, current_time,
+                    &gso_disabled, &bytes_sent);
+                memmove(send_buffers, send_buffer, send_length);
+                send_buffer = send_buffers;
+            }
+            batch_rank = rank;
+            batch_cnx[batch->nb_entries] = last_cnx;
+            (void)picoquic_send_batch_add(batch, (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr,
+                if_index, send_buffer, (int)send_length, (int)send_msg_size);
+            if (batch->nb_entries >= CONFIG_PICOQUIC_SOCKET_LOOP_SEND_BATCH) {
+                picoquic_socket_loop_flush(quic, sockets[batch_rank], batch, batch_cnx, current_time,
+                    &gso_disabled, &bytes_sent);
+            }
+        }
+        if (batch->nb_entries > 0) {
+            picoquic_socket_loop_flush(quic, sockets[batch_rank], batch, batch_cnx, current_time,
+                &gso_disabled, &bytes_sent);
+        }
+
+        if (ret == 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_send, loop_callback_ctx, &bytes_sent);
+        }
+    }
+
+    if (ret == PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP) {
+        ret = 0;
+    }
+
+    if (poller != NULL) {
+        picoquic_poller_delete(poller);
+    }
+    for (int i = 0; i < nb_sockets; i++) {
+        SOCKET_CLOSE(sockets[i]);
+    }
+    free(recv_buffers);
+    free(send_buffers);
+    free(batch);
+
+    return ret;
+}
@@ -0,0 +1,536 @@
+/*
+ * Picoquic io_uring socket backend (Linux target)
+ *
+ * Completions are tagged with their type in the top byte of the user data:
+ * multishot receives carry the socket rank, sends the send slot index.
+ */
+
+#include "picoquic_uring.h"
+
+#include <liburing.h>
+#include <string.h>
+
+#include "picoquic_utils.h"
+#include "sdkconfig.h"
+
+#ifndef CONFIG_PICOQUIC_IO_URING_RECV_BUFFERS
+#define CONFIG_PICOQUIC_IO_URING_RECV_BUFFERS 256
+#endif
+
+#define PICOQUIC_URING_SEND_SLOTS 64
+#define PICOQUIC_URING_BUFFER_GROUP 0
+/* Control data space of the multishot receives */
+#define PICOQUIC_URING_RECV_CMSG_SPACE 256
+/* Header, source address, control data and payload of a received datagram */
+#define PICOQUIC_URING_RECV_BUFFER_SIZE 2048
+
+#define PICOQUIC_URING_UD_RECV ((uint64_t)1 << 56)
+#define PICOQUIC_URING_UD_SEND ((uint64_t)2 << 56)
+#define PICOQUIC_URING_UD_TIMEOUT ((uint64_t)3 << 56)
+#define PICOQUIC_URING_UD_TYPE(ud) ((ud) & ((uint64_t)0xFF << 56))
+#define PICOQUIC_URING_UD_INDEX(ud) ((int)((ud) & 0xFFFFFFFF))
+
+typedef struct st_picoquic_uring_send_slot_t {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr_dest;
+    union {
+        struct cmsghdr hdr;
+        char buf[PICOQUIC_SEND_CMSG_SPACE];
+    } control;
+    uint8_t buffer[PICOQUIC_MAX_PACKET_SIZE];
+    int next_free;
+} picoquic_uring_send_slot_t;
+
+struct st_picoquic_uring_t {
+    struct io_uring ring;
+    int ring_initialized;
+    /* Receive side */
+    int nb_sockets;
+    SOCKET_TYPE sockets[PICOQUIC_URING_MAX_SOCKETS];
+    int socket_af[PICOQUIC_URING_MAX_SOCKETS];
+    struct msghdr recv_msg[PICOQUIC_URING_MAX_SOCKETS];
+    int recv_armed[PICOQUIC_URING_MAX_SOCKETS];
+    struct io_uring_buf_ring* buf_ring;
+    unsigned int nb_recv_buffers;
+    uint8_t* recv_buffers;
+    /* Send side */
+    int nb_send_slots;
+    picoquic_uring_send_slot_t* send_slots;
+    int first_free_send;
+    int nb_sends_queued;
+    uint64_t nb_send_errors;
+    int last_send_error;
+    struct __kernel_timespec timeout;
+};
+
+static void picoquic_uring_recycle(picoquic_uring_t* uring, unsigned int bid)
+{
+    io_uring_buf_ring_add(uring->buf_ring, uring->recv_buffers + (size_t)bid * PICOQUIC_URING_RECV_BUFFER_SIZE,
+        PICOQUIC_URING_RECV_BUFFER_SIZE, (unsigned short)bid, io_uring_buf_ring_mask(uring->nb_recv_buffers), 0);
+    io_uring_buf_ring_advance(uring->buf_ring, 1);
+}
+
+static struct io_uring_sqe* picoquic_uring_get_sqe(picoquic_uring_t* uring)
+{
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&uring->ring);
+
+    if (sqe == NULL) {
+        /* Submission queue full: submit what is queued and retry */
+        (void)io_uring_submit(&uring->ring);
+        sqe = io_uring_get_sqe(&uring->ring);
+    }
+    return sqe;
+}
+
+static void picoquic_uring_arm_receives(picoquic_uring_t* uring)
+{
+    for (int i = 0; i < uring->nb_sockets; i++) {
+        if (!uring->recv_armed[i]) {
+            struct io_uring_sqe* sqe = picoquic_uring_get_sqe(uring);
+            if (sqe == NULL) {
+                break;
+            }
+            io_uring_prep_recvmsg_multishot(sqe, uring->sockets[i], &uring->recv_msg[i], 0);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = PICOQUIC_URING_BUFFER_GROUP;
+            io_uring_sqe_set_data64(sqe, PICOQUIC_URING_UD_RECV | (uint64_t)i);
+            uring->recv_armed[i] = 1;
+        }
+    }
+}
+
+picoquic_uring_t* picoquic_uring_create(SOCKET_TYPE* sockets, int nb_sockets,
+    int nb_recv_buffers, int nb_send_slots)
+{
+    int ret = 0;
+    picoquic_uring_t* uring;
+
+    if (nb_sockets <= 0 || nb_sockets > PICOQUIC_URING_MAX_SOCKETS) {
+        return NULL;
+    }
+    if (nb_recv_buffers <= 0) {
+        nb_recv_buffers = CONFIG_PICOQUIC_IO_URING_RECV_BUFFERS;
+    }
+    if (nb_send_slots <= 0) {
+        nb_send_slots = PICOQUIC_URING_SEND_SLOTS;
+    }
+
+    uring = (picoquic_uring_t*)malloc(sizeof(picoquic_uring_t));
+    if (uring == NULL) {
+        return NULL;
+    }
+    memset(uring, 0, sizeof(picoquic_uring_t));
+
+    /* Buffer rings must have a power of 2 number of entries */
+    uring->nb_recv_buffers = 1;
+    while (uring->nb_recv_buffers < (unsigned int)nb_recv_buffers && uring->nb_recv_buffers < 32768) {
+        uring->nb_recv_buffers <<= 1;
+    }
+    uring->nb_send_slots = nb_send_slots;
+    uring->recv_buffers = (uint8_t*)malloc((size_t)uring->nb_recv_buffers * PICOQUIC_URING_RECV_BUFFER_SIZE);
+    uring->send_slots = (picoquic_uring_send_slot_t*)malloc(nb_send_slots * sizeof(picoquic_uring_send_slot_t));
+
+    if (uring->recv_buffers == NULL || uring->send_slots == NULL) {
+        ret = -1;
+    }
+    else if ((ret = io_uring_queue_init(uring->nb_recv_buffers + nb_send_slots, &uring->ring, 0)) != 0) {
+        DBG_PRINTF("io_uring_queue_init fails, err: %d\n", ret);
+    }
+    else {
+        uring->ring_initialized = 1;
+        uring->buf_ring = io_uring_setup_buf_ring(&uring->ring, uring->nb_recv_buffers,
+            PICOQUIC_URING_BUFFER_GROUP, 0, &ret);
+        if (uring->buf_ring == NULL) {
+            DBG_PRINTF("io_uring_setup_buf_ring fails, err: %d\n", ret);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        for (unsigned int bid = 0; bid < uring->nb_recv_buffers; bid++) {
+            picoquic_uring_recycle(uring, bid);
+        }
+        for (int i = 0; i < nb_send_slots; i++) {
+            uring->send_slots[i].next_free = (i + 1 < nb_send_slots) ? i + 1 : -1;
+        }
+        uring->first_free_send = 0;
+
+        uring->nb_sockets = nb_sockets;
+        for (int i = 0; i < nb_sockets; i++) {
+            struct sockaddr_storage local_addr;
+
+            uring->sockets[i] = sockets[i];
+            uring->socket_af[i] = (picoquic_get_local_address(sockets[i], &local_addr) == 0) ?
+                local_addr.ss_family : AF_INET;
+            /* Only the name and control lengths are used by multishot receives */
+            uring->recv_msg[i].msg_namelen = sizeof(struct sockaddr_storage);
+            uring->recv_msg[i].msg_controllen = PICOQUIC_URING_RECV_CMSG_SPACE;
+        }
+        picoquic_uring_arm_receives(uring);
+        if (io_uring_submit(&uring->ring) < 0) {
+            ret = -1;
+        }
+    }
+
+    if (ret != 0) {
+        picoquic_uring_delete(uring);
+        uring = NULL;
+    }
+
+    return uring;
+}
+
+void picoquic_uring_delete(picoquic_uring_t* uring)
+{
+    if (uring == NULL) {
+        return;
+    }
+    if (uring->ring_initialized) {
+        /* Also cancels the multishot receives and the pending sends */
+        if (uring->buf_ring != NULL) {
+            (void)io_uring_free_buf_ring(&uring->ring, uring->buf_ring, uring->nb_recv_buffers,
+                PICOQUIC_URING_BUFFER_GROUP);
+        }
+        io_uring_queue_exit(&uring->ring);
+    }
+    free(uring->recv_buffers);
+    free(uring->send_slots);
+    free(uring);
+}
+
+int picoquic_uring_send(picoquic_uring_t* uring,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int dest_if,
+    const uint8_t* bytes, int length, int send_msg_size, int* sock_err)
+{
+    int rank = 0;
+    int slot_index = uring->first_free_send;
+    struct io_uring_sqe* sqe = NULL;
+
+    for (int i = 0; i < uring->nb_sockets; i++) {
+        if (uring->socket_af[i] == addr_dest->sa_family) {
+            rank = i;
+            break;
+        }
+    }
+
+    if (slot_index >= 0 && length <= PICOQUIC_MAX_PACKET_SIZE) {
+        sqe = picoquic_uring_get_sqe(uring);
+    }
+
+    if (sqe == NULL) {
+        /* No send slot available, send directly */
+        return picoquic_sendmsg(uring->sockets[rank], addr_dest, addr_from, dest_if,
+            (const char*)bytes, length, send_msg_size, sock_err);
+    }
+    else {
+        picoquic_uring_send_slot_t* slot = &uring->send_slots[slot_index];
+
+        uring->first_free_send = slot->next_free;
+        memcpy(slot->buffer, bytes, length);
+        memcpy(&slot->addr_dest, addr_dest, picoquic_addr_length(addr_dest));
+        memset(&slot->msg, 0, sizeof(slot->msg));
+        slot->iov.iov_base = slot->buffer;
+        slot->iov.iov_len = length;
+        slot->msg.msg_name = &slot->addr_dest;
+        slot->msg.msg_namelen = picoquic_addr_length(addr_dest);
+        slot->msg.msg_iov = &slot->iov;
+        slot->msg.msg_iovlen = 1;
+        slot->msg.msg_control = slot->control.buf;
+        slot->msg.msg_controllen = sizeof(slot->control.buf);
+        picoquic_socks_cmsg_format(&slot->msg, length, send_msg_size, addr_from, dest_if);
+
+        io_uring_prep_sendmsg(sqe, uring->sockets[rank], &slot->msg, 0);
+        io_uring_sqe_set_data64(sqe, PICOQUIC_URING_UD_SEND | (uint64_t)slot_index);
+        uring->nb_sends_queued++;
+    }
+
+    return length;
+}
+
+int picoquic_uring_flush(picoquic_uring_t* uring)
+{
+    int ret = 0;
+
+    if (uring->nb_sends_queued > 0) {
+        ret = (io_uring_submit(&uring->ring) < 0) ? -1 : 0;
+        uring->nb_sends_queued = 0;
+    }
+    return ret;
+}
+
+/* Fill a slot from a multishot receive completion.
+ * Returns 1 if the slot holds a datagram, 0 if the buffer was recycled.
+ */
+static int picoquic_uring_recv_completion(picoquic_uring_t* uring, struct io_uring_cqe* cqe,
+    int rank, picoquic_recv_slot_t* slot)
+{
+    unsigned int bid;
+    uint8_t* buffer;
+    struct io_uring_recvmsg_out* out;
+    struct msghdr control_msg;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        /* Multishot ended, e.g. no buffer left (ENOBUFS): re-arm on next wait */
+        uring->recv_armed[rank] = 0;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+            DBG_PRINTF("io_uring recvmsg on socket %d fails, err: %d\n", (int)uring->sockets[rank], -cqe->res);
+        }
+        return 0;
+    }
+
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buffer = uring->recv_buffers + (size_t)bid * PICOQUIC_URING_RECV_BUFFER_SIZE;
+    out = (cqe->res > 0) ? io_uring_recvmsg_validate(buffer, cqe->res, &uring->recv_msg[rank]) : NULL;
+    if (out == NULL || (out->flags & MSG_TRUNC) != 0) {
+        picoquic_uring_recycle(uring, bid);
+        return 0;
+    }
+
+    memset(slot, 0, sizeof(picoquic_recv_slot_t));
+    memcpy(&slot->addr_from, io_uring_recvmsg_name(out),
+        (out->namelen < sizeof(struct sockaddr_storage)) ? out->namelen : sizeof(struct sockaddr_storage));
+    memset(&control_msg, 0, sizeof(control_msg));
+    control_msg.msg_control = (uint8_t*)io_uring_recvmsg_cmsg_firsthdr(out, &uring->recv_msg[rank]);
+    control_msg.msg_controllen = (control_msg.msg_control == NULL) ? 0 : out->controllen;
+    if (control_msg.msg_controllen > 0) {
+        picoquic_socks_cmsg_parse_slot(&control_msg, slot);
+    }
+    slot->socket_rank = rank;
+    slot->buffer = (uint8_t*)io_uring_recvmsg_payload(out, &uring->recv_msg[rank]);
+    slot->bytes_recv = (int)io_uring_recvmsg_payload_length(out, cqe->res, &uring->recv_msg[rank]);
+    slot->buffer_max = slot->bytes_recv;
+
+    return 1;
+}
+
+int picoquic_uring_wait(picoquic_uring_t* uring, int64_t delta_t,
+    picoquic_recv_slot_t* slots, int nb_slots, uint64_t* current_time)
+{
+    int ret = 0;
+    int nb_recv = 0;
+    unsigned int nb_seen = 0;
+    unsigned int head;
+    struct io_uring_cqe* cqe;
+
+    picoquic_uring_arm_receives(uring);
+    uring->nb_sends_queued = 0;
+
+    if (delta_t > 0 && io_uring_cq_ready(&uring->ring) == 0) {
+        /* Completes at the picoquic wake time, or with the first other completion */
+        struct io_uring_sqe* sqe = picoquic_uring_get_sqe(uring);
+
+        if (sqe != NULL) {
+            uring->timeout.tv_sec = delta_t / 1000000;
+            uring->timeout.tv_nsec = (delta_t % 1000000) * 1000;
+            io_uring_prep_timeout(sqe, &uring->timeout, 1, 0);
+            io_uring_sqe_set_data64(sqe, PICOQUIC_URING_UD_TIMEOUT);
+            ret = io_uring_submit_and_wait(&uring->ring, 1);
+        }
+        else {
+            ret = io_uring_submit(&uring->ring);
+        }
+    }
+    else {
+        ret = io_uring_submit(&uring->ring);
+    }
+
+    if (ret < 0 && ret != -EINTR && ret != -ETIME) {
+        DBG_PRINTF("io_uring submit fails, err: %d\n", -ret);
+        return -1;
+    }
+
+    io_uring_for_each_cqe(&uring->ring, head, cqe) {
+        uint64_t ud = io_uring_cqe_get_data64(cqe);
+
+        if (PICOQUIC_URING_UD_TYPE(ud) == PICOQUIC_URING_UD_RECV) {
+            if (nb_recv >= nb_slots) {
+                /* Leave the remaining completions for the next call */
+                break;
+            }
+            nb_recv += picoquic_uring_recv_completion(uring, cqe, PICOQUIC_URING_UD_INDEX(ud), &slots[nb_recv]);
+        }
+        else if (PICOQUIC_URING_UD_TYPE(ud) == PICOQUIC_URING_UD_SEND) {
+            int slot_index = PICOQUIC_URING_UD_INDEX(ud);
+
+            if (cqe->res < 0) {
+                uring->nb_send_errors++;
+                uring->last_send_error = -cqe->res;
+            }
+            uring->send_slots[slot_index].next_free = uring->first_free_send;
+            uring->first_free_send = slot_index;
+        }
+        nb_seen++;
+    }
+    io_uring_cq_advance(&uring->ring, nb_seen);
+
+    *current_time = picoquic_current_time();
+
+    return nb_recv;
+}
+
+void picoquic_uring_release(picoquic_uring_t* uring, picoquic_recv_slot_t* slots, int nb_slots)
+{
+    for (int i = 0; i < nb_slots; i++) {
+        if (slots[i].buffer != NULL) {
+            size_t offset = (size_t)(slots[i].buffer - uring->recv_buffers);
+            picoquic_uring_recycle(uring, (unsigned int)(offset / PICOQUIC_URING_RECV_BUFFER_SIZE));
+            slots[i].buffer = NULL;
+        }
+    }
+}
+
+uint64_t picoquic_uring_get_send_errors(picoquic_uring_t* uring, int* last_sock_err)
+{
+    if (last_sock_err != NULL) {
+        *last_sock_err = uring->last_send_error;
+    }
+    return uring->nb_send_errors;
+}
+
+static int picoquic_uring_open_sockets(picoquic_packet_loop_param_t* param, SOCKET_TYPE* sockets)
+{
+    int nb_sockets = 0;
+    const int sock_af[] = { AF_INET, AF_INET6 };
+
+    for (int i = 0; i < 2; i++) {
+        if (param->local_af != 0 && param->local_af != sock_af[i]) {
+            continue;
+        }
+        sockets[nb_sockets] = picoquic_open_client_socket(sock_af[i]);
+        if (sockets[nb_sockets] == INVALID_SOCKET) {
+            continue;
+        }
+        if (sock_af[i] == AF_INET6 && nb_sockets > 0) {
+            /* The IPv4 socket may be bound to the same port */
+            int val = 1;
+            (void)setsockopt(sockets[nb_sockets], IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(int));
+        }
+        if (picoquic_bind_to_port(sockets[nb_sockets], sock_af[i], param->local_port) != 0) {
+            DBG_PRINTF("Cannot bind socket (af=%d) to port %d\n", sock_af[i], param->local_port);
+            SOCKET_CLOSE(sockets[nb_sockets]);
+            continue;
+        }
+        nb_sockets++;
+    }
+
+    return nb_sockets;
+}
+
+int picoquic_uring_packet_loop(picoquic_quic_t* quic,
+    picoquic_packet_loop_param_t* param,
+    picoquic_packet_loop_cb_fn loop_callback,
+    void* loop_callback_ctx)
+{
+    int ret = 0;
+    uint64_t current_time = picoquic_get_quic_time(quic);
+    uint64_t last_time = current_time;
+    const int64_t delay_max = 10000000;
+    picoquic_packet_loop_options_t options;
+    SOCKET_TYPE sockets[PICOQUIC_URING_MAX_SOCKETS];
+    int nb_sockets = picoquic_uring_open_sockets(param, sockets);
+    int local_ports[PICOQUIC_URING_MAX_SOCKETS];
+    picoquic_uring_t* uring = NULL;
+    picoquic_recv_slot_t slots[PICOQUIC_RECV_BATCH_MAX];
+    uint8_t* send_buffer = (uint8_t*)malloc(PICOQUIC_MAX_PACKET_SIZE);
+
+    memset(&options, 0, sizeof(options));
+    for (int i = 0; i < nb_sockets; i++) {
+        local_ports[i] = picoquic_get_local_port(sockets[i]);
+    }
+    if (nb_sockets == 0) {
+        ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    else if ((uring = picoquic_uring_create(sockets, nb_sockets, 0, 0)) == NULL || send_buffer == NULL) {
+        ret = PICOQUIC_ERROR_MEMORY;
+    }
+    else if (loop_callback != NULL) {
+        ret = loop_callback(quic, picoquic_packet_loop_ready, loop_callback_ctx, &options);
+    }
+
+    while (ret == 0) {
+        picoquic_cnx_t* last_cnx = NULL;
+        int64_t delta_t = picoquic_get_next_wake_delay(quic, current_time, delay_max);
+        int nb_slots;
+        size_t bytes_sent = 0;
+
+        if (options.do_time_check && loop_callback != NULL) {
+            packet_loop_time_check_arg_t time_check_arg;
+            time_check_arg.current_time = current_time;
+            time_check_arg.delta_t = delta_t;
+            ret = loop_callback(quic, picoquic_packet_loop_time_check, loop_callback_ctx, &time_check_arg);
+            if (time_check_arg.delta_t < delta_t) {
+                delta_t = time_check_arg.delta_t;
+            }
+        }
+
+        /* Time of the last prepare, received packets are not stamped earlier */
+        last_time = current_time;
+        /* Also submits the packets queued in the previous iteration */
+        nb_slots = picoquic_uring_wait(uring, delta_t, slots, PICOQUIC_RECV_BATCH_MAX, &current_time);
+        if (nb_slots < 0) {
+            ret = PICOQUIC_ERROR_UNEXPECTED_ERROR;
+            break;
+        }
+        for (int i = 0; i < nb_slots; i++) {
+            (void)picoquic_incoming_recv_slot(quic, &slots[i], local_ports[slots[i].socket_rank], &last_cnx,
+                current_time, last_time);
+        }
+        picoquic_uring_release(uring, slots, nb_slots);
+
+        current_time = picoquic_current_time();
+        if (ret == 0 && nb_slots > 0 && loop_callback != NULL) {
+            size_t nb_packets_received = (size_t)nb_slots;
+            ret = loop_callback(quic, picoquic_packet_loop_after_receive, loop_callback_ctx, &nb_packets_received);
+        }
+
+        while (ret == 0) {
+            struct sockaddr_storage peer_addr;
+            struct sockaddr_storage local_addr;
+            picoquic_connection_id_t log_cid;
+            int if_index = param->dest_if;
+            size_t send_length = 0;
+            size_t send_msg_size = 0;
+            int sock_err = 0;
+
+            last_cnx = NULL;
+            ret = picoquic_prepare_next_packet_ex(quic, current_time, send_buffer, PICOQUIC_MAX_PACKET_SIZE,
+                &send_length, &peer_addr, &local_addr, &if_index, &log_cid, &last_cnx, &send_msg_size);
+            if (ret != 0 || send_length == 0) {
+                break;
+            }
+            if (picoquic_uring_send(uring, (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr,
+                if_index, send_buffer, (int)send_length, (int)send_msg_size, &sock_err) <= 0) {
+                if (last_cnx != NULL && picoquic_socket_error_implies_unreachable(sock_err)) {
+                    picoquic_notify_destination_unreachable(last_cnx, current_time,
+                        (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr, if_index, sock_err);
+                }
+            }
+            else {
+                bytes_sent += send_length;
+            }
+        }
+
+        if (ret == 0 && loop_callback != NULL) {
+            ret = loop_callback(quic, picoquic_packet_loop_after_send, loop_callback_ctx, &bytes_sent);
+        }
+    }
+
+    if (ret == PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP) {
+        ret = 0;
+    }
+
+    if (uring != NULL) {
+        /* Send what the last iteration queued, e.g. a connection close */
+        (void)picoquic_uring_flush(uring);
+        picoquic_uring_delete(uring);
+    }
+    for (int i = 0; i < nb_sockets; i++) {
+        SOCKET_CLOSE(sockets[i]);
+    }
+    free(send_buffer);
+
+    return ret;
+}
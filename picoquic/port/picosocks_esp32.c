@@ -18,28 +18,143 @@
 * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *
-* ESP32-specific version: IPv4 only, no IPv6 support
+* ESP32-specific version: IPv4, plus IPv6 when lwIP is built with
+* CONFIG_LWIP_IPV6 (always on the Linux target)
 */
 
+#if defined(__linux) && !defined(_GNU_SOURCE)
+/* Needed for recvmmsg() on the Linux target */
+#define _GNU_SOURCE
+#endif
+
 #include "picosocks.h"
+#include "picosocks_esp32.h"
+#include "picoquic_internal.h"
 #include "picoquic_utils.h"
+#include "sdkconfig.h"
+#include <pthread.h>
+#if defined(__linux)
+#include <sys/epoll.h>
+#include <time.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#else
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/priv/tcpip_priv.h"
+#endif
+
+#if defined(__linux)
+/* The empty port/include/netinet/udp.h shadows the system header,
+ * so provide the Linux UDP GSO definitions here. */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+#endif
+
+/* Socket buffer sizes, 0 keeps the system default */
+#ifndef CONFIG_PICOQUIC_SOCKET_RCVBUF
+#define CONFIG_PICOQUIC_SOCKET_RCVBUF 0
+#endif
+#ifndef CONFIG_PICOQUIC_SOCKET_SNDBUF
+#define CONFIG_PICOQUIC_SOCKET_SNDBUF 0
+#endif
+
+/* IPv6 sockets are available on the Linux target, and on lwIP if enabled */
+#if defined(__linux) || (defined(LWIP_IPV6) && LWIP_IPV6)
+#define PICOQUIC_SOCKS_HAS_IPV6 1
+#else
+#define PICOQUIC_SOCKS_HAS_IPV6 0
+#endif
+
+/* Control buffer space for received datagrams. Only a handful of small
+ * cmsgs are parsed, so a few hundred bytes are plenty. */
+#define PICOQUIC_RECV_CMSG_SPACE 256
+#if defined(__linux)
+/* Number of datagrams requested per recvmmsg() call */
+#define PICOQUIC_RECV_MMSG_CHUNK 16
+#endif
+
+/* Control buffers must be aligned for the cmsghdr accesses */
+typedef union st_picoquic_recv_cmsg_buffer_t {
+    struct cmsghdr hdr;
+    char buf[PICOQUIC_RECV_CMSG_SPACE];
+} picoquic_recv_cmsg_buffer_t;
+
+typedef union st_picoquic_send_cmsg_buffer_t {
+    struct cmsghdr hdr;
+    char buf[PICOQUIC_SEND_CMSG_SPACE];
+} picoquic_send_cmsg_buffer_t;
+
+/* Path MTU cache entry, keyed by the destination IP address. The PMTU is
+ * learned from EMSGSIZE failures or set by the application; the route MTU
+ * is the MTU of the interface routing to the destination, valid for one
+ * route generation. Entries are written under the mutex and read without
+ * locking on the send path: seq is odd while the entry is written.
+ */
+typedef struct st_picoquic_pmtu_entry_t {
+    uint32_t seq;
+    uint32_t route_generation; /* 0 if the route MTU is unknown */
+    struct sockaddr_storage addr;
+    int pmtu;
+    int route_mtu;
+} picoquic_pmtu_entry_t;
+
+static picoquic_pmtu_entry_t picoquic_pmtu_cache[PICOQUIC_PMTU_CACHE_SIZE];
+static int picoquic_pmtu_cache_next;
+static uint32_t picoquic_pmtu_route_generation = 1;
+static pthread_mutex_t picoquic_pmtu_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int picoquic_stored_addr_is_same(const struct sockaddr_storage* stored, const struct sockaddr* addr)
+{
+    if (addr == NULL || addr->sa_family == 0) {
+        return stored->ss_family == 0;
+    }
+    return picoquic_compare_addr((const struct sockaddr*)stored, addr) == 0;
+}
+
+int picoquic_socket_af_is_supported(int af)
+{
+    return af == AF_INET || (PICOQUIC_SOCKS_HAS_IPV6 && af == AF_INET6);
+}
 
 int picoquic_bind_to_port(SOCKET_TYPE fd, int af, int port)
 {
     struct sockaddr_storage sa;
     int addr_length = 0;
 
-    /* ESP-IDF only supports IPv4 */
-    if (af != AF_INET) {
-        return -1;
-    }
-
     memset(&sa, 0, sizeof(sa));
 
-    struct sockaddr_in* s4 = (struct sockaddr_in*)&sa;
-    s4->sin_family = af;
-    s4->sin_port = htons((unsigned short)port);
-    addr_length = sizeof(struct sockaddr_in);
+    if (af == AF_INET) {
+        struct sockaddr_in* s4 = (struct sockaddr_in*)&sa;
+        s4->sin_family = af;
+        s4->sin_port = htons((unsigned short)port);
+        addr_length = sizeof(struct sockaddr_in);
+    }
+#if PICOQUIC_SOCKS_HAS_IPV6
+    else if (af == AF_INET6) {
+        struct sockaddr_in6* s6 = (struct sockaddr_in6*)&sa;
+        s6->sin6_family = AF_INET6;
+        s6->sin6_port = htons((unsigned short)port);
+        addr_length = sizeof(struct sockaddr_in6);
+    }
+#endif
+    else {
+        return -1;
+    }
 
     return bind(fd, (struct sockaddr*)&sa, addr_length);
 }
@@ -50,16 +165,41 @@ int picoquic_get_local_address(SOCKET_TYPE sd, struct sockaddr_storage * addr)
     return getsockname(sd, (struct sockaddr *)addr, &name_len);
 }
 
+int picoquic_get_local_port(SOCKET_TYPE sd)
+{
+    struct sockaddr_storage addr;
+
+    if (picoquic_get_local_address(sd, &addr) != 0) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+    }
+    return (addr.ss_family == AF_INET) ? ntohs(((struct sockaddr_in*)&addr)->sin_port) : 0;
+}
+
 int picoquic_socket_set_pkt_info(SOCKET_TYPE sd, int af)
 {
     int ret = 0;
 
-    /* ESP-IDF lwIP doesn't support IPv6 packet info, only IPv4 */
-    if (af != AF_INET) {
+    int val = 1;
+
+    if (af == AF_INET6) {
+        /* lwIP does not define IPV6_RECVPKTINFO, the destination address
+         * of IPv6 packets is then left unset. */
+#if PICOQUIC_SOCKS_HAS_IPV6 && defined(IPV6_RECVPKTINFO)
+        ret = setsockopt(sd, IPPROTO_IPV6, IPV6_RECVPKTINFO, (char*)&val, sizeof(int));
+        if (ret != 0) {
+            DBG_PRINTF("IPV6_RECVPKTINFO not available, errno: %d\n", errno);
+            ret = 0;
+        }
+#endif
+        return ret;
+    }
+    else if (af != AF_INET) {
         return 0;
     }
 
-    int val = 1;
 #ifdef IP_PKTINFO
     ret = setsockopt(sd, IPPROTO_IP, IP_PKTINFO, (char*)&val, sizeof(int));
 #else
@@ -84,14 +224,35 @@ int picoquic_socket_set_ecn_options(SOCKET_TYPE sd, int af, int * recv_set, int
 {
     int ret = 0;
 
-    /* ESP-IDF lwIP doesn't support IPv6 ECN options, skip IPv6 */
-    if (af != AF_INET) {
-        *recv_set = 0;
-        *send_set = 0;
-        return 0;
-    }
+    *recv_set = 0;
+    *send_set = 0;
 
-    if (af == AF_INET) {
+    if (af == AF_INET6) {
+        /* lwIP does not support the IPv6 traffic class options */
+#if PICOQUIC_SOCKS_HAS_IPV6 && defined(IPV6_TCLASS)
+        {
+            unsigned int ecn = PICOQUIC_ECN_ECT_1;
+            if (setsockopt(sd, IPPROTO_IPV6, IPV6_TCLASS, &ecn, sizeof(ecn)) < 0) {
+                DBG_PRINTF("setsockopt IPv6 IPV6_TCLASS (0x%x) fails, errno: %d\n", ecn, errno);
+            }
+            else {
+                *send_set = 1;
+            }
+        }
+#endif
+#if PICOQUIC_SOCKS_HAS_IPV6 && defined(IPV6_RECVTCLASS)
+        {
+            unsigned int set = 1;
+            if (setsockopt(sd, IPPROTO_IPV6, IPV6_RECVTCLASS, &set, sizeof(set)) < 0) {
+                DBG_PRINTF("setsockopt IPv6 IPV6_RECVTCLASS (0x%x) fails, errno: %d\n", set, errno);
+            }
+            else {
+                *recv_set = 1;
+            }
+        }
+#endif
+    }
+    else if (af == AF_INET) {
 #if defined(IP_TOS)
         {
             unsigned int ecn = PICOQUIC_ECN_ECT_1;
@@ -131,6 +292,11 @@ int picoquic_socket_set_ecn_options(SOCKET_TYPE sd, int af, int * recv_set, int
     return ret;
 }
 
+/* lwIP does not set the DF bit, and fragments datagrams larger than the
+ * interface MTU. picoquic_sendmsg() fails them with EMSGSIZE instead, so
+ * that PMTUD probes are lost as they would be with DF. This applies to all
+ * sockets, so there is nothing to set here.
+ */
 int picoquic_socket_set_pmtud_options(SOCKET_TYPE sd, int af)
 {
     int ret = 0;
@@ -139,6 +305,141 @@ int picoquic_socket_set_pmtud_options(SOCKET_TYPE sd, int af)
         int val = IP_PMTUDISC_PROBE;
         ret = setsockopt(sd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(int));
     }
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+    else if (af == AF_INET6) {
+        int val = IPV6_PMTUDISC_PROBE;
+        ret = setsockopt(sd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val, sizeof(int));
+    }
+#endif
+#else
+    (void)af;
+    (void)sd;
+#endif
+    return ret;
+}
+
+int picoquic_socket_set_buffer_sizes(SOCKET_TYPE sd, int rcvbuf, int sndbuf)
+{
+    int ret = 0;
+
+    /* lwIP only has SO_RCVBUF, if built with CONFIG_LWIP_SO_RCVBUF */
+#if defined(SO_RCVBUF)
+    if (rcvbuf > 0 && setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int)) != 0) {
+        DBG_PRINTF("setsockopt SO_RCVBUF (%d) fails, errno: %d\n", rcvbuf, errno);
+        ret = -1;
+    }
+#else
+    if (rcvbuf > 0) {
+        ret = -1;
+    }
+#endif
+#if defined(SO_SNDBUF) && defined(__linux)
+    if (sndbuf > 0 && setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int)) != 0) {
+        DBG_PRINTF("setsockopt SO_SNDBUF (%d) fails, errno: %d\n", sndbuf, errno);
+        ret = -1;
+    }
+#else
+    if (sndbuf > 0) {
+        ret = -1;
+    }
+#endif
+    return ret;
+}
+
+int picoquic_socket_get_buffer_sizes(SOCKET_TYPE sd, int* rcvbuf, int* sndbuf)
+{
+    int ret = 0;
+    socklen_t len;
+
+    *rcvbuf = 0;
+    *sndbuf = 0;
+#if defined(SO_RCVBUF)
+    len = sizeof(int);
+    if (getsockopt(sd, SOL_SOCKET, SO_RCVBUF, rcvbuf, &len) != 0) {
+        ret = -1;
+    }
+#endif
+#if defined(SO_SNDBUF) && defined(__linux)
+    len = sizeof(int);
+    if (getsockopt(sd, SOL_SOCKET, SO_SNDBUF, sndbuf, &len) != 0) {
+        ret = -1;
+    }
+#endif
+    (void)len;
+    return ret;
+}
+
+int picoquic_socket_set_drop_counter_options(SOCKET_TYPE sd)
+{
+    int ret = -1;
+#if defined(__linux) && defined(SO_RXQ_OVFL)
+    int val = 1;
+    ret = setsockopt(sd, SOL_SOCKET, SO_RXQ_OVFL, &val, sizeof(int));
+    if (ret != 0) {
+        DBG_PRINTF("setsockopt SO_RXQ_OVFL fails, errno: %d\n", errno);
+    }
+#else
+    (void)sd;
+#endif
+    return ret;
+}
+
+/* Buffer sizes, drop counters and receive time stamps, best effort */
+static void picoquic_socket_set_default_queue_options(SOCKET_TYPE sd, int af)
+{
+    if (picoquic_socket_set_buffer_sizes(sd, CONFIG_PICOQUIC_SOCKET_RCVBUF, CONFIG_PICOQUIC_SOCKET_SNDBUF) != 0) {
+        DBG_PRINTF("Cannot set socket buffer sizes (%d, %d)\n", CONFIG_PICOQUIC_SOCKET_RCVBUF, CONFIG_PICOQUIC_SOCKET_SNDBUF);
+    }
+    (void)picoquic_socket_set_drop_counter_options(sd);
+    (void)picoquic_socket_set_rx_timestamp_options(sd, af);
+}
+
+int picoquic_socket_set_rx_timestamp_options(SOCKET_TYPE sd, int af)
+{
+    int ret = -1;
+#if defined(__linux) && defined(SO_TIMESTAMPNS)
+    int val = 1;
+    (void)af;
+    ret = setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(int));
+    if (ret != 0) {
+        DBG_PRINTF("setsockopt SO_TIMESTAMPNS fails, errno: %d\n", errno);
+    }
+#else
+    (void)af;
+    (void)sd;
+#endif
+    return ret;
+}
+
+int picoquic_socket_set_txtime_options(SOCKET_TYPE sd)
+{
+    int ret = -1;
+#if defined(__linux)
+    struct sock_txtime txtime_config;
+
+    memset(&txtime_config, 0, sizeof(txtime_config));
+    /* The fq qdisc only accepts CLOCK_MONOTONIC departure times */
+    txtime_config.clockid = CLOCK_MONOTONIC;
+    ret = setsockopt(sd, SOL_SOCKET, SO_TXTIME, &txtime_config, sizeof(txtime_config));
+    if (ret != 0) {
+        DBG_PRINTF("setsockopt SO_TXTIME fails, errno: %d\n", errno);
+    }
+#else
+    (void)sd;
+#endif
+    return ret;
+}
+
+int picoquic_socket_set_gro_options(SOCKET_TYPE sd, int af)
+{
+    int ret = -1;
+#if defined(UDP_GRO)
+    int val = 1;
+    (void)af;
+    ret = setsockopt(sd, SOL_UDP, UDP_GRO, &val, sizeof(int));
+    if (ret != 0) {
+        DBG_PRINTF("setsockopt UDP_GRO fails, errno: %d\n", errno);
+    }
 #else
     (void)af;
     (void)sd;
@@ -148,8 +449,7 @@ int picoquic_socket_set_pmtud_options(SOCKET_TYPE sd, int af)
 
 SOCKET_TYPE picoquic_open_client_socket(int af)
 {
-    /* ESP-IDF only supports IPv4 */
-    if (af != AF_INET) {
+    if (!picoquic_socket_af_is_supported(af)) {
         return INVALID_SOCKET;
     }
 
@@ -168,6 +468,7 @@ SOCKET_TYPE picoquic_open_client_socket(int af)
         if (picoquic_socket_set_pmtud_options(sd, af) != 0) {
             DBG_PRINTF("Cannot set PMTUD options (af=%d)\n", af);
         }
+        picoquic_socket_set_default_queue_options(sd, af);
     }
     else {
         DBG_PRINTF("Cannot open socket(AF=%d), error: %d\n", af, errno);
@@ -180,39 +481,174 @@ int picoquic_open_server_sockets(picoquic_server_sockets_t* sockets, int port)
 {
     int ret = 0;
 
-    /* ESP-IDF lwIP doesn't support IPv6 packet info, use IPv4 only */
+#if PICOQUIC_SOCKS_HAS_IPV6
+    const int sock_af[] = { AF_INET6, AF_INET };
+    const int nb_sockets = 2;
+#else
     const int sock_af[] = { AF_INET };
     const int nb_sockets = 1;
+#endif
 
-    for (int i = 0; i < nb_sockets; i++) {
-        if (ret == 0) {
-            sockets->s_socket[i] = socket(sock_af[i], SOCK_DGRAM, IPPROTO_UDP);
-        } else {
-            sockets->s_socket[i] = INVALID_SOCKET;
-        }
+    for (int i = 0; i < PICOQUIC_NB_SERVER_SOCKETS; i++) {
+        sockets->s_socket[i] = INVALID_SOCKET;
+    }
+
+    for (int i = 0; ret == 0 && i < nb_sockets; i++) {
+        int sock_ret = 0;
+
+        sockets->s_socket[i] = socket(sock_af[i], SOCK_DGRAM, IPPROTO_UDP);
 
         if (sockets->s_socket[i] == INVALID_SOCKET) {
-            ret = -1;
+            sock_ret = -1;
         }
         else {
             int recv_set = 0;
             int send_set = 0;
+#if PICOQUIC_SOCKS_HAS_IPV6 && defined(IPV6_V6ONLY)
+            if (sock_af[i] == AF_INET6) {
+                /* The IPv4 socket binds the same port */
+                int val = 1;
+                if (setsockopt(sockets->s_socket[i], IPPROTO_IPV6, IPV6_V6ONLY, (char*)&val, sizeof(int)) != 0) {
+                    DBG_PRINTF("Cannot set IPV6_V6ONLY, errno: %d\n", errno);
+                }
+            }
+#endif
             if (picoquic_socket_set_ecn_options(sockets->s_socket[i], sock_af[i], &recv_set, &send_set) != 0) {
                 DBG_PRINTF("Cannot set ECN options (af=%d)\n", sock_af[i]);
             }
-            ret = picoquic_socket_set_pkt_info(sockets->s_socket[i], sock_af[i]);
-            if (ret == 0) {
-                ret = picoquic_bind_to_port(sockets->s_socket[i], sock_af[i], port);
+            sock_ret = picoquic_socket_set_pkt_info(sockets->s_socket[i], sock_af[i]);
+            if (sock_ret == 0) {
+                sock_ret = picoquic_bind_to_port(sockets->s_socket[i], sock_af[i], port);
             }
-            if (ret == 0) {
-                ret = picoquic_socket_set_pmtud_options(sockets->s_socket[i], sock_af[i]);
+            if (sock_ret == 0) {
+                sock_ret = picoquic_socket_set_pmtud_options(sockets->s_socket[i], sock_af[i]);
+            }
+            if (sock_ret == 0) {
+                picoquic_socket_set_default_queue_options(sockets->s_socket[i], sock_af[i]);
+            }
+        }
+
+        if (sock_ret != 0) {
+            if (sock_af[i] == AF_INET6) {
+                /* e.g. IPv6 disabled on the host: serve IPv4 only */
+                DBG_PRINTF("Cannot open the IPv6 server socket, errno: %d\n", errno);
+                if (sockets->s_socket[i] != INVALID_SOCKET) {
+                    SOCKET_CLOSE(sockets->s_socket[i]);
+                    sockets->s_socket[i] = INVALID_SOCKET;
+                }
+            }
+            else {
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+#if defined(__linux) && defined(SO_REUSEPORT)
+/* Steer datagrams to socket (first CID byte % nb_shards) of the reuseport
+ * group. The program sees the UDP payload: the CID starts at byte 1 of
+ * short header packets and at byte 6 of long header packets. If the
+ * packet is too short, the program returns 0 and the first shard gets it.
+ */
+static int picoquic_attach_shard_steering(SOCKET_TYPE fd, int nb_shards)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x80, 2, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+        BPF_JUMP(BPF_JMP | BPF_JA | BPF_K, 1, 0, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)nb_shards),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    struct sock_fprog prog;
+
+    prog.len = (unsigned short)(sizeof(code) / sizeof(code[0]));
+    prog.filter = code;
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+#endif
+
+int picoquic_open_sharded_server_sockets(SOCKET_TYPE* sockets, int nb_shards, int af, int port)
+{
+    int ret = 0;
+
+    for (int i = 0; i < nb_shards; i++) {
+        sockets[i] = INVALID_SOCKET;
+    }
+
+#if defined(__linux) && defined(SO_REUSEPORT)
+    if (nb_shards <= 0 || nb_shards > PICOQUIC_SHARDS_MAX || !picoquic_socket_af_is_supported(af)) {
+        return -1;
+    }
+
+    for (int i = 0; ret == 0 && i < nb_shards; i++) {
+        int val = 1;
+        int recv_set = 0;
+        int send_set = 0;
+
+        sockets[i] = socket(af, SOCK_DGRAM, IPPROTO_UDP);
+        if (sockets[i] == INVALID_SOCKET) {
+            DBG_PRINTF("Cannot open shard socket(AF=%d), error: %d\n", af, errno);
+            ret = -1;
+            break;
+        }
+        if (setsockopt(sockets[i], SOL_SOCKET, SO_REUSEPORT, &val, sizeof(int)) != 0) {
+            DBG_PRINTF("Cannot set SO_REUSEPORT, errno: %d\n", errno);
+            ret = -1;
+            break;
+        }
+        if (picoquic_socket_set_ecn_options(sockets[i], af, &recv_set, &send_set) != 0) {
+            DBG_PRINTF("Cannot set ECN options (af=%d)\n", af);
+        }
+        ret = picoquic_socket_set_pkt_info(sockets[i], af);
+        if (ret == 0) {
+            /* Sockets join the reuseport group in bind order, which is the shard order */
+            ret = picoquic_bind_to_port(sockets[i], af, port);
+        }
+        if (ret == 0 && i == 0) {
+            if (port == 0 && (port = picoquic_get_local_port(sockets[0])) == 0) {
+                /* All shards must share the ephemeral port picked for the first one */
+                ret = -1;
             }
+            if (ret == 0 && (ret = picoquic_attach_shard_steering(sockets[0], nb_shards)) != 0) {
+                DBG_PRINTF("Cannot attach the reuseport program, errno: %d\n", errno);
+            }
+        }
+        if (ret == 0) {
+            ret = picoquic_socket_set_pmtud_options(sockets[i], af);
+        }
+        if (ret == 0) {
+            picoquic_socket_set_default_queue_options(sockets[i], af);
+            (void)picoquic_socket_set_gro_options(sockets[i], af);
         }
     }
 
+    if (ret != 0) {
+        picoquic_close_sharded_server_sockets(sockets, nb_shards);
+    }
+#else
+    (void)af;
+    (void)port;
+    ret = -1;
+#endif
+
     return ret;
 }
 
+void picoquic_close_sharded_server_sockets(SOCKET_TYPE* sockets, int nb_shards)
+{
+    for (int i = 0; i < nb_shards; i++) {
+        if (sockets[i] != INVALID_SOCKET) {
+            SOCKET_CLOSE(sockets[i]);
+            sockets[i] = INVALID_SOCKET;
+        }
+    }
+}
+
 void picoquic_close_server_sockets(picoquic_server_sockets_t* sockets)
 {
     for (int i = 0; i < PICOQUIC_NB_SERVER_SOCKETS; i++) {
@@ -223,12 +659,50 @@ void picoquic_close_server_sockets(picoquic_server_sockets_t* sockets)
     }
 }
 
+#if defined(__linux)
+static uint64_t picoquic_timespec_to_time(const struct timespec* ts)
+{
+    /* Same clock and unit as picoquic_current_time() */
+    return ((uint64_t)ts->tv_sec) * 1000000 + ((uint64_t)ts->tv_nsec) / 1000;
+}
+#endif
+
+/* picoquic_socks_cmsg_parse(), also returning the kernel receive time if
+ * available (0 otherwise).
+ */
+static void picoquic_socks_cmsg_parse_ex(
+    void* vmsg,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    size_t* udp_coalesced_size,
+    uint64_t* rx_time,
+    uint32_t* rxq_drops);
+
 void picoquic_socks_cmsg_parse(
     void* vmsg,
     struct sockaddr_storage* addr_dest,
     int* dest_if,
     unsigned char* received_ecn,
     size_t * udp_coalesced_size)
+{
+    picoquic_socks_cmsg_parse_ex(vmsg, addr_dest, dest_if, received_ecn, udp_coalesced_size, NULL, NULL);
+}
+
+void picoquic_socks_cmsg_parse_slot(void* vmsg, picoquic_recv_slot_t* slot)
+{
+    picoquic_socks_cmsg_parse_ex(vmsg, &slot->addr_dest, &slot->dest_if, &slot->received_ecn,
+        &slot->udp_coalesced_size, &slot->rx_time, &slot->rxq_drops);
+}
+
+static void picoquic_socks_cmsg_parse_ex(
+    void* vmsg,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    size_t* udp_coalesced_size,
+    uint64_t* rx_time,
+    uint32_t* rxq_drops)
 {
     /* Assume that msg has been filled by a call to recvmsg */
     struct msghdr* msg = (struct msghdr*)vmsg;
@@ -274,20 +748,80 @@ void picoquic_socks_cmsg_parse(
                 }
             }
         }
-    }
-}
+#if PICOQUIC_SOCKS_HAS_IPV6
+        else if (cmsg->cmsg_level == IPPROTO_IPV6) {
+#ifdef IPV6_PKTINFO
+            if (cmsg->cmsg_type == IPV6_PKTINFO) {
+                if (addr_dest != NULL) {
+                    struct in6_pktinfo* pPktInfo6 = (struct in6_pktinfo*)CMSG_DATA(cmsg);
+                    struct sockaddr_in6* a6 = (struct sockaddr_in6*)addr_dest;
 
-static void* cmsg_format_header_return_data_ptr(struct msghdr* msg, struct cmsghdr** last_cmsg, int* control_length,
-    int cmsg_level, int cmsg_type, size_t cmsg_data_len)
-{
-    void* cmsg_data_ptr = NULL;
-#ifdef CMSG_ALIGN
-    struct cmsghdr* cmsg = (*last_cmsg == NULL) ? CMSG_FIRSTHDR(msg) :
-        (struct cmsghdr*)((unsigned char*)(*last_cmsg) + CMSG_ALIGN((*last_cmsg)->cmsg_len));
-#else
-    struct cmsghdr* cmsg = (*last_cmsg == NULL) ? CMSG_FIRSTHDR(msg) : CMSG_NXTHDR(msg, *last_cmsg);
+                    memset(a6, 0, sizeof(struct sockaddr_in6));
+                    a6->sin6_family = AF_INET6;
+                    memcpy(&a6->sin6_addr, &pPktInfo6->ipi6_addr, sizeof(struct in6_addr));
+                    if (dest_if != NULL) {
+                        *dest_if = (int)pPktInfo6->ipi6_ifindex;
+                    }
+                }
+            }
 #endif
-
+#ifdef IPV6_TCLASS
+            if (cmsg->cmsg_type == IPV6_TCLASS && cmsg->cmsg_len > 0) {
+                if (received_ecn != NULL) {
+                    int tclass = 0;
+                    memcpy(&tclass, CMSG_DATA(cmsg), sizeof(int));
+                    *received_ecn = (unsigned char)tclass;
+                }
+            }
+#endif
+        }
+#endif
+#if defined(UDP_GRO)
+        else if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            if (udp_coalesced_size != NULL) {
+                int gro_size = 0;
+                memcpy(&gro_size, CMSG_DATA(cmsg), sizeof(int));
+                *udp_coalesced_size = (gro_size > 0) ? (size_t)gro_size : 0;
+            }
+        }
+#endif
+#if defined(__linux)
+        else if (cmsg->cmsg_level == SOL_SOCKET) {
+            if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+                if (rxq_drops != NULL) {
+                    memcpy(rxq_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+                }
+            }
+            else if (cmsg->cmsg_type == SCM_TIMESTAMPNS && rx_time != NULL) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                *rx_time = picoquic_timespec_to_time(&ts);
+            }
+            else if (cmsg->cmsg_type == SCM_TIMESTAMPING && rx_time != NULL) {
+                /* ts[0] is the software time stamp. The raw hardware time stamp in
+                 * ts[2] is on the NIC clock, which picoquic cannot use. */
+                struct timespec ts[3];
+                memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+                if (ts[0].tv_sec != 0 || ts[0].tv_nsec != 0) {
+                    *rx_time = picoquic_timespec_to_time(&ts[0]);
+                }
+            }
+        }
+#endif
+    }
+}
+
+static void* cmsg_format_header_return_data_ptr(struct msghdr* msg, struct cmsghdr** last_cmsg, int* control_length,
+    int cmsg_level, int cmsg_type, size_t cmsg_data_len)
+{
+    void* cmsg_data_ptr = NULL;
+#ifdef CMSG_ALIGN
+    struct cmsghdr* cmsg = (*last_cmsg == NULL) ? CMSG_FIRSTHDR(msg) :
+        (struct cmsghdr*)((unsigned char*)(*last_cmsg) + CMSG_ALIGN((*last_cmsg)->cmsg_len));
+#else
+    struct cmsghdr* cmsg = (*last_cmsg == NULL) ? CMSG_FIRSTHDR(msg) : CMSG_NXTHDR(msg, *last_cmsg);
+#endif
+
     if (cmsg != NULL) {
         size_t cmsg_required_space = CMSG_SPACE(cmsg_data_len);
         *control_length += (int)cmsg_required_space;
@@ -302,12 +836,39 @@ static void* cmsg_format_header_return_data_ptr(struct msghdr* msg, struct cmsgh
     return cmsg_data_ptr;
 }
 
+#if defined(__linux)
+/* Convert a departure time on the picoquic_current_time() clock to
+ * CLOCK_MONOTONIC nanoseconds. Returns 0 if the departure time has passed.
+ */
+static uint64_t picoquic_txtime_to_monotonic(uint64_t departure_time)
+{
+    uint64_t current_time = picoquic_current_time();
+    struct timespec ts;
+
+    if (departure_time <= current_time || clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0;
+    }
+    return ((uint64_t)ts.tv_sec) * 1000000000 + (uint64_t)ts.tv_nsec + (departure_time - current_time) * 1000;
+}
+#endif
+
 void picoquic_socks_cmsg_format(
     void* vmsg,
     size_t message_length,
     size_t send_msg_size,
     struct sockaddr* addr_from,
     int dest_if)
+{
+    picoquic_socks_cmsg_format_txtime(vmsg, message_length, send_msg_size, addr_from, dest_if, 0);
+}
+
+void picoquic_socks_cmsg_format_txtime(
+    void* vmsg,
+    size_t message_length,
+    size_t send_msg_size,
+    struct sockaddr* addr_from,
+    int dest_if,
+    uint64_t departure_time)
 {
     struct msghdr* msg = (struct msghdr*)vmsg;
     int control_length = 0;
@@ -346,6 +907,19 @@ void picoquic_socks_cmsg_format(
             }
 #endif
         }
+#if PICOQUIC_SOCKS_HAS_IPV6 && defined(IPV6_PKTINFO)
+        else if (addr_from->sa_family == AF_INET6) {
+            struct in6_pktinfo* pktinfo6 = (struct in6_pktinfo*)cmsg_format_header_return_data_ptr(msg, &last_cmsg,
+                &control_length, IPPROTO_IPV6, IPV6_PKTINFO, sizeof(struct in6_pktinfo));
+            if (pktinfo6 != NULL) {
+                memcpy(&pktinfo6->ipi6_addr, &((struct sockaddr_in6*)addr_from)->sin6_addr, sizeof(struct in6_addr));
+                pktinfo6->ipi6_ifindex = (unsigned int)dest_if;
+            }
+            else {
+                is_null = 1;
+            }
+        }
+#endif
     }
 #if defined(UDP_SEGMENT)
     if (!is_null && send_msg_size > 0 && send_msg_size < message_length) {
@@ -359,6 +933,21 @@ void picoquic_socks_cmsg_format(
         }
     }
 #endif
+#if defined(__linux)
+    if (!is_null && departure_time != 0) {
+        uint64_t txtime = picoquic_txtime_to_monotonic(departure_time);
+        if (txtime != 0) {
+            void* pval = cmsg_format_header_return_data_ptr(msg, &last_cmsg,
+                &control_length, SOL_SOCKET, SCM_TXTIME, sizeof(uint64_t));
+            if (pval != NULL) {
+                /* CMSG_DATA is only 4 bytes aligned on 32 bits targets */
+                memcpy(pval, &txtime, sizeof(uint64_t));
+            }
+        }
+    }
+#else
+    (void)departure_time;
+#endif
 
     msg->msg_controllen = control_length;
     if (control_length == 0) {
@@ -366,17 +955,20 @@ void picoquic_socks_cmsg_format(
     }
 }
 
-int picoquic_recvmsg(SOCKET_TYPE fd,
+static int picoquic_recvmsg_flags(SOCKET_TYPE fd,
     struct sockaddr_storage* addr_from,
     struct sockaddr_storage* addr_dest,
     int* dest_if,
     unsigned char* received_ecn,
-    uint8_t* buffer, int buffer_max)
+    size_t* udp_coalesced_size,
+    uint64_t* rx_time,
+    uint32_t* rxq_drops,
+    uint8_t* buffer, int buffer_max, int flags)
 {
     int bytes_recv = 0;
     struct msghdr msg;
     struct iovec dataBuf;
-    char cmsg_buffer[1024];
+    picoquic_recv_cmsg_buffer_t cmsg_buffer;
 
     if (dest_if != NULL) {
         *dest_if = 0;
@@ -390,229 +982,1634 @@ int picoquic_recvmsg(SOCKET_TYPE fd,
     msg.msg_iov = &dataBuf;
     msg.msg_iovlen = 1;
     msg.msg_flags = 0;
-    msg.msg_control = (void*)cmsg_buffer;
-    msg.msg_controllen = sizeof(cmsg_buffer);
+    msg.msg_control = (void*)cmsg_buffer.buf;
+    msg.msg_controllen = sizeof(cmsg_buffer.buf);
 
-    bytes_recv = recvmsg(fd, &msg, 0);
+    bytes_recv = recvmsg(fd, &msg, flags);
 
     if (bytes_recv <= 0) {
         addr_from->ss_family = 0;
     } else {
-        picoquic_socks_cmsg_parse(&msg, addr_dest, dest_if, received_ecn, NULL);
+        picoquic_socks_cmsg_parse_ex(&msg, addr_dest, dest_if, received_ecn, udp_coalesced_size, rx_time, rxq_drops);
     }
 
     return bytes_recv;
 }
 
-int picoquic_sendmsg(SOCKET_TYPE fd,
-    struct sockaddr* addr_dest,
-    struct sockaddr* addr_from,
-    int dest_if,
-    const char* bytes, int length,
-    int send_msg_size,
-    int * sock_err)
+int picoquic_recvmsg(SOCKET_TYPE fd,
+    struct sockaddr_storage* addr_from,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    uint8_t* buffer, int buffer_max)
 {
-    struct msghdr msg;
-    struct iovec dataBuf;
-    char cmsg_buffer[1024];
-    int bytes_sent;
+    return picoquic_recvmsg_flags(fd, addr_from, addr_dest, dest_if, received_ecn, NULL, NULL, NULL, buffer, buffer_max, 0);
+}
 
-    /* Format the message header */
+static void picoquic_recv_slot_reset(picoquic_recv_slot_t* slot)
+{
+    slot->addr_from.ss_family = 0;
+    slot->addr_dest.ss_family = 0;
+    slot->dest_if = 0;
+    slot->received_ecn = 0;
+    slot->udp_coalesced_size = 0;
+    slot->rx_time = 0;
+    slot->rxq_drops = 0;
+    slot->bytes_recv = 0;
+}
 
-    dataBuf.iov_base = (char*)bytes;
-    dataBuf.iov_len = length;
+static int picoquic_recv_error_is_empty_queue(int last_error)
+{
+    return (last_error == EAGAIN || last_error == EWOULDBLOCK);
+}
 
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = addr_dest;
-    msg.msg_namelen = picoquic_addr_length(addr_dest);
-    msg.msg_iov = &dataBuf;
-    msg.msg_iovlen = 1;
-    msg.msg_control = (void*)cmsg_buffer;
-    msg.msg_controllen = sizeof(cmsg_buffer);
+int picoquic_recvmsg_batch(SOCKET_TYPE fd, picoquic_recv_slot_t* slots, int nb_slots)
+{
+    int nb_recv = 0;
+    int ret = 0;
 
-    /* Format the control message */
-    picoquic_socks_cmsg_format(&msg, length, send_msg_size, addr_from, dest_if);
+#if defined(__linux)
+    while (nb_recv < nb_slots) {
+        struct mmsghdr msgs[PICOQUIC_RECV_MMSG_CHUNK];
+        struct iovec iovs[PICOQUIC_RECV_MMSG_CHUNK];
+        picoquic_recv_cmsg_buffer_t cmsg_buffers[PICOQUIC_RECV_MMSG_CHUNK];
+        int chunk = nb_slots - nb_recv;
+        int nb_mmsg;
 
-    bytes_sent = sendmsg(fd, &msg, 0);
+        if (chunk > PICOQUIC_RECV_MMSG_CHUNK) {
+            chunk = PICOQUIC_RECV_MMSG_CHUNK;
+        }
 
-    if (bytes_sent <= 0) {
-        int last_error = errno;
-#ifndef DISABLE_DEBUG_PRINTF
-        DBG_PRINTF("Could not send packet on UDP socket[AF=%d]= %d!\n",
-            addr_dest->sa_family, last_error);
-#endif
-        if (sock_err != NULL) {
-            *sock_err = last_error;
+        memset(msgs, 0, sizeof(struct mmsghdr) * chunk);
+        for (int i = 0; i < chunk; i++) {
+            picoquic_recv_slot_t* slot = &slots[nb_recv + i];
+
+            picoquic_recv_slot_reset(slot);
+            iovs[i].iov_base = (char*)slot->buffer;
+            iovs[i].iov_len = slot->buffer_max;
+            msgs[i].msg_hdr.msg_name = (struct sockaddr*)&slot->addr_from;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = (void*)cmsg_buffers[i].buf;
+            msgs[i].msg_hdr.msg_controllen = sizeof(cmsg_buffers[i].buf);
+        }
+
+        nb_mmsg = recvmmsg(fd, msgs, chunk, MSG_DONTWAIT, NULL);
+
+        if (nb_mmsg <= 0) {
+            if (nb_mmsg < 0 && !picoquic_recv_error_is_empty_queue(errno)) {
+                DBG_PRINTF("recvmmsg on UDP socket %d fails, errno: %d\n", (int)fd, errno);
+                ret = -1;
+            }
+            break;
+        }
+
+        for (int i = 0; i < nb_mmsg; i++) {
+            picoquic_recv_slot_t* slot = &slots[nb_recv + i];
+
+            slot->bytes_recv = (int)msgs[i].msg_len;
+            picoquic_socks_cmsg_parse_ex(&msgs[i].msg_hdr, &slot->addr_dest, &slot->dest_if,
+                &slot->received_ecn, &slot->udp_coalesced_size, &slot->rx_time, &slot->rxq_drops);
+        }
+        nb_recv += nb_mmsg;
+
+        if (nb_mmsg < chunk) {
+            /* The socket queue is empty */
+            break;
         }
     }
-    return bytes_sent;
+#else
+    while (nb_recv < nb_slots) {
+        picoquic_recv_slot_t* slot = &slots[nb_recv];
+        int bytes_recv;
+
+        picoquic_recv_slot_reset(slot);
+        bytes_recv = picoquic_recvmsg_flags(fd, &slot->addr_from, &slot->addr_dest, &slot->dest_if,
+            &slot->received_ecn, &slot->udp_coalesced_size, &slot->rx_time, &slot->rxq_drops,
+            slot->buffer, slot->buffer_max, MSG_DONTWAIT);
+
+        if (bytes_recv <= 0) {
+            if (bytes_recv < 0 && !picoquic_recv_error_is_empty_queue(errno)) {
+                DBG_PRINTF("recvmsg on UDP socket %d fails, errno: %d\n", (int)fd, errno);
+                ret = -1;
+            }
+            break;
+        }
+        slot->bytes_recv = bytes_recv;
+        nb_recv++;
+    }
+#endif
+
+    /* Report the error only if nothing was received, so that already
+     * drained datagrams are not lost. */
+    return (nb_recv == 0 && ret != 0) ? -1 : nb_recv;
 }
 
-int picoquic_select_ex(SOCKET_TYPE* sockets,
-    int nb_sockets,
-    struct sockaddr_storage* addr_from,
-    struct sockaddr_storage* addr_dest,
-    int* dest_if,
-    unsigned char * received_ecn,
-    uint8_t* buffer, int buffer_max,
-    int64_t delta_t,
-    int * socket_rank,
-    uint64_t* current_time)
+int picoquic_datagram_overhead(int af)
 {
-    fd_set readfds;
-    struct timeval tv;
-    int ret_select = 0;
-    int bytes_recv = 0;
-    int sockmax = 0;
+    /* IP and UDP headers, without options or extension headers */
+    return (af == AF_INET6) ? 48 : 28;
+}
 
-    if (received_ecn != NULL) {
-        *received_ecn = 0;
+static int picoquic_pmtu_addr_is_same(const struct sockaddr_storage* stored, const struct sockaddr* addr)
+{
+    if (stored->ss_family != addr->sa_family) {
+        return 0;
     }
+    if (addr->sa_family == AF_INET) {
+        return ((struct sockaddr_in*)stored)->sin_addr.s_addr == ((const struct sockaddr_in*)addr)->sin_addr.s_addr;
+    }
+#if PICOQUIC_SOCKS_HAS_IPV6
+    if (addr->sa_family == AF_INET6) {
+        return memcmp(&((struct sockaddr_in6*)stored)->sin6_addr, &((const struct sockaddr_in6*)addr)->sin6_addr,
+            sizeof(struct in6_addr)) == 0;
+    }
+#endif
+    return 0;
+}
 
-    FD_ZERO(&readfds);
-
-    for (int i = 0; i < nb_sockets; i++) {
-        if (sockmax < (int)sockets[i]) {
-            sockmax = (int)sockets[i];
+/* Must be called with the mutex held */
+static picoquic_pmtu_entry_t* picoquic_pmtu_cache_find(const struct sockaddr* addr)
+{
+    for (int i = 0; i < PICOQUIC_PMTU_CACHE_SIZE; i++) {
+        if (picoquic_pmtu_addr_is_same(&picoquic_pmtu_cache[i].addr, addr)) {
+            return &picoquic_pmtu_cache[i];
         }
-        FD_SET(sockets[i], &readfds);
     }
+    return NULL;
+}
 
-    if (delta_t <= 0) {
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
-    } else {
-        if (delta_t > 10000000) {
-            tv.tv_sec = (long)10;
-            tv.tv_usec = 0;
-        } else {
-            tv.tv_sec = (long)(delta_t / 1000000);
-            tv.tv_usec = (long)(delta_t % 1000000);
+/* Read the PMTU and the route MTU of addr without locking. route_mtu is
+ * set to -1 if unknown for the current route generation.
+ * Returns 1 if addr is in the cache, else 0.
+ */
+static int picoquic_pmtu_cache_read(const struct sockaddr* addr, int* pmtu, int* route_mtu)
+{
+    uint32_t generation = __atomic_load_n(&picoquic_pmtu_route_generation, __ATOMIC_RELAXED);
+
+    *pmtu = 0;
+    *route_mtu = -1;
+    for (int i = 0; i < PICOQUIC_PMTU_CACHE_SIZE; i++) {
+        picoquic_pmtu_entry_t* entry = &picoquic_pmtu_cache[i];
+        uint32_t seq;
+        int found;
+
+        do {
+            seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+            found = picoquic_pmtu_addr_is_same(&entry->addr, addr);
+            *pmtu = entry->pmtu;
+            *route_mtu = (entry->route_generation == generation) ? entry->route_mtu : -1;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) != 0 || __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq);
+        if (found) {
+            return 1;
         }
     }
+    *pmtu = 0;
+    *route_mtu = -1;
 
-    ret_select = select(sockmax + 1, &readfds, NULL, NULL, &tv);
+    return 0;
+}
 
-    if (ret_select < 0) {
-        bytes_recv = -1;
-        DBG_PRINTF("Error: select returns %d\n", ret_select);
-    } else if (ret_select > 0) {
-        for (int i = 0; i < nb_sockets; i++) {
-            if (FD_ISSET(sockets[i], &readfds)) {
-                *socket_rank = i;
-                bytes_recv = picoquic_recvmsg(sockets[i], addr_from,
-                    addr_dest, dest_if, received_ecn,
-                    buffer, buffer_max);
+int picoquic_pmtu_cache_get(const struct sockaddr* addr_dest)
+{
+    int pmtu;
+    int route_mtu;
 
-                if (bytes_recv <= 0) {
-                    DBG_PRINTF("Could not receive packet on UDP socket[%d]= %d!\n",
-                        i, (int)sockets[i]);
+    (void)picoquic_pmtu_cache_read(addr_dest, &pmtu, &route_mtu);
 
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
+    return pmtu;
+}
+
+int picoquic_pmtu_cache_get_limit(const struct sockaddr* addr_dest)
+{
+    int pmtu;
+    int route_mtu;
+
+    (void)picoquic_pmtu_cache_read(addr_dest, &pmtu, &route_mtu);
+    if (route_mtu > 0 && (pmtu == 0 || route_mtu < pmtu)) {
+        pmtu = route_mtu;
     }
 
-    *current_time = picoquic_current_time();
+    return pmtu;
+}
 
-    return bytes_recv;
+/* Find or create the entry of addr_dest and open it for writing. Must be
+ * called with the mutex held. Returns NULL if the family is not supported.
+ */
+static picoquic_pmtu_entry_t* picoquic_pmtu_cache_write_begin(const struct sockaddr* addr_dest)
+{
+    picoquic_pmtu_entry_t* entry;
+
+    if (addr_dest->sa_family != AF_INET && addr_dest->sa_family != AF_INET6) {
+        return NULL;
+    }
+    if ((entry = picoquic_pmtu_cache_find(addr_dest)) == NULL) {
+        /* Replace the oldest entry */
+        entry = &picoquic_pmtu_cache[picoquic_pmtu_cache_next];
+        picoquic_pmtu_cache_next = (picoquic_pmtu_cache_next + 1) % PICOQUIC_PMTU_CACHE_SIZE;
+        __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memset(&entry->addr, 0, sizeof(entry->addr));
+        memcpy(&entry->addr, addr_dest, picoquic_addr_length(addr_dest));
+        entry->pmtu = 0;
+        entry->route_mtu = 0;
+        entry->route_generation = 0;
+    }
+    else {
+        __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    return entry;
 }
 
-int picoquic_select(SOCKET_TYPE* sockets,
-    int nb_sockets,
-    struct sockaddr_storage* addr_from,
-    struct sockaddr_storage* addr_dest,
-    int* dest_if,
-    unsigned char* received_ecn,
-    uint8_t* buffer, int buffer_max,
-    int64_t delta_t,
-    uint64_t* current_time) {
-    int socket_rank;
-    return picoquic_select_ex(sockets, nb_sockets, addr_from, addr_dest, dest_if,
-        received_ecn, buffer, buffer_max, delta_t, &socket_rank, current_time);
+static void picoquic_pmtu_cache_write_end(picoquic_pmtu_entry_t* entry)
+{
+    __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELEASE);
 }
 
-int picoquic_send_through_socket(
-    SOCKET_TYPE fd,
-    struct sockaddr* addr_dest,
-    struct sockaddr* addr_from, int from_if,
-    const char* bytes, int length, int* sock_err)
+static void picoquic_pmtu_cache_update(const struct sockaddr* addr_dest, int pmtu, int only_lower)
 {
-    int sent = picoquic_sendmsg(fd, addr_dest, addr_from, from_if, bytes, length, 0, sock_err);
+    picoquic_pmtu_entry_t* entry;
 
-    return sent;
+    pthread_mutex_lock(&picoquic_pmtu_mutex);
+    if ((entry = picoquic_pmtu_cache_write_begin(addr_dest)) != NULL) {
+        if (!only_lower || entry->pmtu == 0 || pmtu < entry->pmtu) {
+            entry->pmtu = pmtu;
+        }
+        picoquic_pmtu_cache_write_end(entry);
+    }
+    pthread_mutex_unlock(&picoquic_pmtu_mutex);
 }
 
-int picoquic_send_through_server_sockets(
-    picoquic_server_sockets_t* sockets,
-    struct sockaddr* addr_dest,
-    struct sockaddr* addr_from, int from_if,
-    const char* bytes, int length, int* sock_err)
+void picoquic_pmtu_cache_set(const struct sockaddr* addr_dest, int pmtu)
 {
-    /* ESP-IDF only supports IPv4 */
-    if (addr_dest->sa_family != AF_INET) {
-        if (sock_err != NULL) {
-            *sock_err = EAFNOSUPPORT;
-        }
-        return -1;
+    picoquic_pmtu_cache_update(addr_dest, pmtu, 0);
+}
+
+void picoquic_pmtu_cache_set_route_mtu(const struct sockaddr* addr_dest, int route_mtu)
+{
+    picoquic_pmtu_entry_t* entry;
+
+    pthread_mutex_lock(&picoquic_pmtu_mutex);
+    if ((entry = picoquic_pmtu_cache_write_begin(addr_dest)) != NULL) {
+        entry->route_mtu = route_mtu;
+        entry->route_generation = __atomic_load_n(&picoquic_pmtu_route_generation, __ATOMIC_RELAXED);
+        picoquic_pmtu_cache_write_end(entry);
     }
-    return picoquic_send_through_socket(sockets->s_socket[0], addr_dest, addr_from, from_if, bytes, length, sock_err);
+    pthread_mutex_unlock(&picoquic_pmtu_mutex);
 }
 
-int picoquic_get_server_address(const char* ip_address_text, int server_port,
-    struct sockaddr_storage* server_address, int* is_name)
+void picoquic_pmtu_cache_route_changed(void)
 {
-    int ret = 0;
-    struct sockaddr_in* ipv4_dest = (struct sockaddr_in*)server_address;
+    uint32_t generation = __atomic_add_fetch(&picoquic_pmtu_route_generation, 1, __ATOMIC_RELAXED);
 
-    /* get the IP address of the server */
-    memset(server_address, 0, sizeof(struct sockaddr_storage));
-    *is_name = 0;
+    if (generation == 0) {
+        /* 0 marks unknown route MTUs */
+        __atomic_store_n(&picoquic_pmtu_route_generation, 1, __ATOMIC_RELAXED);
+    }
+}
 
-    if (inet_pton(AF_INET, ip_address_text, &ipv4_dest->sin_addr) == 1) {
-        /* Valid IPv4 address */
-        ipv4_dest->sin_family = AF_INET;
-        ipv4_dest->sin_port = htons((unsigned short)server_port);
+void picoquic_pmtu_cache_flush(void)
+{
+    pthread_mutex_lock(&picoquic_pmtu_mutex);
+    for (int i = 0; i < PICOQUIC_PMTU_CACHE_SIZE; i++) {
+        picoquic_pmtu_entry_t* entry = &picoquic_pmtu_cache[i];
+
+        __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memset(&entry->addr, 0, sizeof(entry->addr));
+        entry->pmtu = 0;
+        entry->route_mtu = 0;
+        entry->route_generation = 0;
+        picoquic_pmtu_cache_write_end(entry);
     }
-    else {
-        /* Server is described by name. Do a lookup for the IP address,
-        * and then use the name as SNI parameter */
-        struct addrinfo* result = NULL;
-        struct addrinfo hints;
-
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET;  /* ESP-IDF only supports IPv4 */
-        hints.ai_socktype = SOCK_DGRAM;
-        hints.ai_protocol = IPPROTO_UDP;
-
-        if ((ret = getaddrinfo(ip_address_text, NULL, &hints, &result)) != 0) {
-            int err = ret;
-            fprintf(stderr, "Cannot get IP address for %s, err = %d (0x%x)\n", ip_address_text, err, err);
-            ret = -1;
-        } else {
-            *is_name = 1;
+    picoquic_pmtu_cache_next = 0;
+    pthread_mutex_unlock(&picoquic_pmtu_mutex);
+}
 
-            switch (result->ai_family) {
-            case AF_INET:
-                ipv4_dest->sin_family = AF_INET;
-                ipv4_dest->sin_port = htons((unsigned short)server_port);
-                ipv4_dest->sin_addr.s_addr = ((struct sockaddr_in*)result->ai_addr)->sin_addr.s_addr;
-                break;
-            default:
-                fprintf(stderr, "Error getting IPv4 address for %s, family = %d\n",
-                    ip_address_text, result->ai_family);
-                ret = -1;
-                break;
-            }
+#if !defined(__linux)
+typedef struct st_picoquic_route_mtu_call_t {
+    struct tcpip_api_call_data call;
+    ip_addr_t addr;
+    int mtu;
+} picoquic_route_mtu_call_t;
 
-            freeaddrinfo(result);
-        }
+static err_t picoquic_route_mtu_fn(struct tcpip_api_call_data* call)
+{
+    picoquic_route_mtu_call_t* msg = (picoquic_route_mtu_call_t*)call;
+    struct netif* netif;
+
+#if LWIP_IPV6
+    if (IP_IS_V6(&msg->addr)) {
+        netif = ip6_route(IP6_ADDR_ANY6, ip_2_ip6(&msg->addr));
+        msg->mtu = (netif != NULL) ? netif_mtu6(netif) : 0;
+        return ERR_OK;
     }
+#endif
+    netif = ip4_route(ip_2_ip4(&msg->addr));
+    msg->mtu = (netif != NULL) ? netif->mtu : 0;
 
-    return ret;
+    return ERR_OK;
+}
+
+/* MTU of the interface that routes to addr_dest, or 0 if unknown */
+static int picoquic_route_mtu(const struct sockaddr* addr_dest)
+{
+    picoquic_route_mtu_call_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    if (addr_dest->sa_family == AF_INET) {
+        ip_addr_set_ip4_u32(&msg.addr, ((const struct sockaddr_in*)addr_dest)->sin_addr.s_addr);
+    }
+#if LWIP_IPV6
+    else if (addr_dest->sa_family == AF_INET6) {
+        const struct sockaddr_in6* s6 = (const struct sockaddr_in6*)addr_dest;
+        IP_ADDR6(&msg.addr, s6->sin6_addr.un.u32_addr[0], s6->sin6_addr.un.u32_addr[1],
+            s6->sin6_addr.un.u32_addr[2], s6->sin6_addr.un.u32_addr[3]);
+    }
+#endif
+    else {
+        return 0;
+    }
+    if (tcpip_api_call(picoquic_route_mtu_fn, &msg.call) != ERR_OK) {
+        return 0;
+    }
+    return msg.mtu;
+}
+
+/* Emulate the DF bit: refuse datagrams that lwIP would fragment. The route
+ * is only looked up for new destinations and after route changes, not on
+ * every send. */
+static int picoquic_pmtu_allows(const struct sockaddr* addr_dest, int length)
+{
+    int pmtu;
+    int route_mtu;
+    int overhead = picoquic_datagram_overhead(addr_dest->sa_family);
+
+    (void)picoquic_pmtu_cache_read(addr_dest, &pmtu, &route_mtu);
+    if (route_mtu < 0) {
+        route_mtu = picoquic_route_mtu(addr_dest);
+        picoquic_pmtu_cache_set_route_mtu(addr_dest, route_mtu);
+    }
+    return (pmtu == 0 || length + overhead <= pmtu) && (route_mtu == 0 || length + overhead <= route_mtu);
+}
+#endif
+
+/* Returns 0 if the datagram can be sent. On lwIP, datagrams larger than the
+ * path MTU are refused with EMSGSIZE, as the kernel does with IP_PMTUDISC_DO. */
+static int picoquic_send_check_pmtu(const struct sockaddr* addr_dest, int length)
+{
+#if !defined(__linux)
+    if (!picoquic_pmtu_allows(addr_dest, length)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+#else
+    (void)addr_dest;
+    (void)length;
+#endif
+    return 0;
+}
+
+/* After a failed send on lwIP, lower the cached PMTU if the datagram was
+ * too large. The kernel keeps its own PMTU, nothing reads the cache there. */
+static void picoquic_send_error_update_pmtu(const struct sockaddr* addr_dest, int length, int send_msg_size, int last_error)
+{
+#if !defined(__linux)
+    if (last_error == EMSGSIZE && (send_msg_size <= 0 || send_msg_size >= length)) {
+        /* Too large for the path: PMTUD probes are lost, not fatal */
+        picoquic_pmtu_cache_update(addr_dest, length + picoquic_datagram_overhead(addr_dest->sa_family) - 1, 1);
+    }
+#else
+    (void)addr_dest;
+    (void)length;
+    (void)send_msg_size;
+    (void)last_error;
+#endif
+}
+
+int picoquic_sendmsg(SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from,
+    int dest_if,
+    const char* bytes, int length,
+    int send_msg_size,
+    int * sock_err)
+{
+    return picoquic_sendmsg_txtime(fd, addr_dest, addr_from, dest_if, bytes, length, send_msg_size, 0, sock_err);
+}
+
+int picoquic_sendmsg_txtime(SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from,
+    int dest_if,
+    const char* bytes, int length,
+    int send_msg_size,
+    uint64_t departure_time,
+    int * sock_err)
+{
+    struct msghdr msg;
+    struct iovec dataBuf;
+    picoquic_send_cmsg_buffer_t cmsg_buffer;
+    int bytes_sent;
+
+    /* Format the message header */
+
+    dataBuf.iov_base = (char*)bytes;
+    dataBuf.iov_len = length;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr_dest;
+    msg.msg_namelen = picoquic_addr_length(addr_dest);
+    msg.msg_iov = &dataBuf;
+    msg.msg_iovlen = 1;
+    msg.msg_control = (void*)cmsg_buffer.buf;
+    msg.msg_controllen = sizeof(cmsg_buffer.buf);
+
+    /* Format the control message */
+    picoquic_socks_cmsg_format_txtime(&msg, length, send_msg_size, addr_from, dest_if, departure_time);
+
+    bytes_sent = (picoquic_send_check_pmtu(addr_dest, length) == 0) ? sendmsg(fd, &msg, 0) : -1;
+
+    if (bytes_sent <= 0) {
+        int last_error = errno;
+#ifndef DISABLE_DEBUG_PRINTF
+        DBG_PRINTF("Could not send packet on UDP socket[AF=%d]= %d!\n",
+            addr_dest->sa_family, last_error);
+#endif
+        picoquic_send_error_update_pmtu(addr_dest, length, send_msg_size, last_error);
+        if (sock_err != NULL) {
+            *sock_err = last_error;
+        }
+    }
+    return bytes_sent;
+}
+
+void picoquic_send_batch_init(picoquic_send_batch_t* batch)
+{
+    batch->nb_entries = 0;
+}
+
+int picoquic_send_batch_add(picoquic_send_batch_t* batch,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int dest_if,
+    const uint8_t* bytes, int length, int send_msg_size)
+{
+    picoquic_send_batch_entry_t* entry;
+
+    if (batch->nb_entries >= PICOQUIC_SEND_BATCH_MAX) {
+        return -1;
+    }
+
+    entry = &batch->entries[batch->nb_entries];
+    memset(&entry->addr_dest, 0, sizeof(entry->addr_dest));
+    memcpy(&entry->addr_dest, addr_dest, picoquic_addr_length(addr_dest));
+    memset(&entry->addr_from, 0, sizeof(entry->addr_from));
+    if (addr_from != NULL && addr_from->sa_family != 0) {
+        memcpy(&entry->addr_from, addr_from, picoquic_addr_length(addr_from));
+    }
+    entry->dest_if = dest_if;
+    entry->bytes = bytes;
+    entry->length = length;
+    entry->send_msg_size = send_msg_size;
+    entry->bytes_sent = 0;
+    entry->sock_err = 0;
+    batch->nb_entries++;
+
+    return 0;
+}
+
+#if defined(__linux)
+static int picoquic_send_effective_segment_size(int length, int send_msg_size)
+{
+    /* picoquic_socks_cmsg_format() only adds UDP_SEGMENT for multi-packet buffers */
+    return (send_msg_size > 0 && send_msg_size < length) ? send_msg_size : 0;
+}
+
+static int picoquic_send_batch_same_control(const picoquic_send_batch_entry_t* previous,
+    const picoquic_send_batch_entry_t* entry)
+{
+    return previous->dest_if == entry->dest_if &&
+        picoquic_send_effective_segment_size(previous->length, previous->send_msg_size) ==
+        picoquic_send_effective_segment_size(entry->length, entry->send_msg_size) &&
+        picoquic_stored_addr_is_same(&previous->addr_from, (const struct sockaddr*)&entry->addr_from);
+}
+#endif
+
+int picoquic_send_batch_flush(SOCKET_TYPE fd, picoquic_send_batch_t* batch, int* sock_err)
+{
+    int nb_sent = 0;
+    int first_err = 0;
+
+#if defined(__linux)
+    int next = 0;
+
+    while (next < batch->nb_entries) {
+        struct mmsghdr msgs[PICOQUIC_SEND_BATCH_MAX];
+        struct iovec iovs[PICOQUIC_SEND_BATCH_MAX];
+        picoquic_send_cmsg_buffer_t cmsg_buffers[PICOQUIC_SEND_BATCH_MAX];
+        int nb_msgs = batch->nb_entries - next;
+        int nb_mmsg;
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * nb_msgs);
+        for (int i = 0; i < nb_msgs; i++) {
+            picoquic_send_batch_entry_t* entry = &batch->entries[next + i];
+
+            iovs[i].iov_base = (char*)entry->bytes;
+            iovs[i].iov_len = entry->length;
+            msgs[i].msg_hdr.msg_name = (struct sockaddr*)&entry->addr_dest;
+            msgs[i].msg_hdr.msg_namelen = picoquic_addr_length((struct sockaddr*)&entry->addr_dest);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            if (i > 0 && picoquic_send_batch_same_control(entry - 1, entry)) {
+                /* Same control data as the previous packet, share its buffer */
+                msgs[i].msg_hdr.msg_control = msgs[i - 1].msg_hdr.msg_control;
+                msgs[i].msg_hdr.msg_controllen = msgs[i - 1].msg_hdr.msg_controllen;
+            }
+            else {
+                msgs[i].msg_hdr.msg_control = (void*)cmsg_buffers[i].buf;
+                msgs[i].msg_hdr.msg_controllen = sizeof(cmsg_buffers[i].buf);
+                picoquic_socks_cmsg_format(&msgs[i].msg_hdr, entry->length, entry->send_msg_size,
+                    (struct sockaddr*)&entry->addr_from, entry->dest_if);
+            }
+        }
+
+        nb_mmsg = sendmmsg(fd, msgs, nb_msgs, 0);
+
+        if (nb_mmsg > 0) {
+            /* A partial count is not an error: send the rest on the next pass */
+            for (int i = 0; i < nb_mmsg; i++) {
+                batch->entries[next + i].bytes_sent = (int)msgs[i].msg_len;
+            }
+            nb_sent += nb_mmsg;
+            next += nb_mmsg;
+        }
+        else {
+            /* sendmmsg() fails only if the first packet could not be sent */
+            int last_error = (nb_mmsg < 0) ? errno : EIO;
+            int nb_failed = 1;
+
+            if (last_error == EINTR) {
+                continue;
+            }
+            if (last_error == EAGAIN || last_error == EWOULDBLOCK || last_error == ENOBUFS || last_error == EIO) {
+                /* The socket cannot take more packets now: give up on the rest */
+                nb_failed = batch->nb_entries - next;
+            }
+            DBG_PRINTF("Could not send %d packet(s) on UDP socket[AF=%d]= %d!\n",
+                nb_failed, batch->entries[next].addr_dest.ss_family, last_error);
+            for (int i = 0; i < nb_failed; i++) {
+                batch->entries[next + i].bytes_sent = -1;
+                batch->entries[next + i].sock_err = last_error;
+            }
+            if (first_err == 0) {
+                first_err = last_error;
+            }
+            next += nb_failed;
+        }
+    }
+#else
+    /* The packets of a batch mostly share their source address, format the
+     * control data once for all of them */
+    picoquic_send_template_t send_template;
+
+    picoquic_send_template_init(&send_template);
+    for (int i = 0; i < batch->nb_entries; i++) {
+        picoquic_send_batch_entry_t* entry = &batch->entries[i];
+
+        entry->bytes_sent = picoquic_sendmsg_template(fd, &send_template, (struct sockaddr*)&entry->addr_dest,
+            (struct sockaddr*)&entry->addr_from, entry->dest_if,
+            (const char*)entry->bytes, entry->length, entry->send_msg_size, &entry->sock_err);
+        if (entry->bytes_sent > 0) {
+            nb_sent++;
+        }
+        else if (first_err == 0) {
+            first_err = entry->sock_err;
+        }
+    }
+#endif
+
+    if (sock_err != NULL) {
+        *sock_err = first_err;
+    }
+    batch->nb_entries = 0;
+
+    return nb_sent;
+}
+
+static int picoquic_select_wait(SOCKET_TYPE* sockets, int nb_sockets, fd_set* readfds, int64_t delta_t)
+{
+    struct timeval tv;
+    int sockmax = 0;
+
+    FD_ZERO(readfds);
+
+    for (int i = 0; i < nb_sockets; i++) {
+        if (sockets[i] == INVALID_SOCKET) {
+            /* e.g. the IPv6 server socket on an IPv4 only host */
+            continue;
+        }
+        if (sockmax < (int)sockets[i]) {
+            sockmax = (int)sockets[i];
+        }
+        FD_SET(sockets[i], readfds);
+    }
+
+    if (delta_t <= 0) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+    } else {
+        if (delta_t > 10000000) {
+            tv.tv_sec = (long)10;
+            tv.tv_usec = 0;
+        } else {
+            tv.tv_sec = (long)(delta_t / 1000000);
+            tv.tv_usec = (long)(delta_t % 1000000);
+        }
+    }
+
+    return select(sockmax + 1, readfds, NULL, NULL, &tv);
+}
+
+int picoquic_select_ex(SOCKET_TYPE* sockets,
+    int nb_sockets,
+    struct sockaddr_storage* addr_from,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char * received_ecn,
+    uint8_t* buffer, int buffer_max,
+    int64_t delta_t,
+    int * socket_rank,
+    uint64_t* current_time)
+{
+    fd_set readfds;
+    int ret_select = 0;
+    int bytes_recv = 0;
+    uint64_t entry_time = picoquic_current_time();
+    uint64_t rx_time = 0;
+
+    if (received_ecn != NULL) {
+        *received_ecn = 0;
+    }
+
+    ret_select = picoquic_select_wait(sockets, nb_sockets, &readfds, delta_t);
+
+    if (ret_select < 0) {
+        bytes_recv = -1;
+        DBG_PRINTF("Error: select returns %d\n", ret_select);
+    } else if (ret_select > 0) {
+        for (int i = 0; i < nb_sockets; i++) {
+            if (sockets[i] != INVALID_SOCKET && FD_ISSET(sockets[i], &readfds)) {
+                *socket_rank = i;
+                bytes_recv = picoquic_recvmsg_flags(sockets[i], addr_from,
+                    addr_dest, dest_if, received_ecn, NULL, &rx_time, NULL,
+                    buffer, buffer_max, 0);
+
+                if (bytes_recv <= 0) {
+                    DBG_PRINTF("Could not receive packet on UDP socket[%d]= %d!\n",
+                        i, (int)sockets[i]);
+
+                    break;
+                } else {
+                    break;
+                }
+            }
+        }
+    }
+
+    /* The kernel arrival time of the packet, if time stamps are enabled. The
+     * loop passed times up to entry_time to picoquic before waiting. */
+    *current_time = picoquic_rx_time_or_current(rx_time, picoquic_current_time(), entry_time);
+
+    return bytes_recv;
+}
+
+int picoquic_select_batch(SOCKET_TYPE* sockets, int nb_sockets,
+    picoquic_recv_slot_t* slots, int nb_slots,
+    int64_t delta_t, uint64_t* current_time)
+{
+    fd_set readfds;
+    int ret_select = 0;
+    int nb_recv = 0;
+
+    ret_select = picoquic_select_wait(sockets, nb_sockets, &readfds, delta_t);
+
+    if (ret_select < 0) {
+        nb_recv = -1;
+        DBG_PRINTF("Error: select returns %d\n", ret_select);
+    } else if (ret_select > 0) {
+        for (int i = 0; i < nb_sockets && nb_recv < nb_slots; i++) {
+            if (sockets[i] != INVALID_SOCKET && FD_ISSET(sockets[i], &readfds)) {
+                int nb_drained = picoquic_recvmsg_batch(sockets[i], slots + nb_recv, nb_slots - nb_recv);
+
+                if (nb_drained < 0) {
+                    DBG_PRINTF("Could not receive packets on UDP socket[%d]= %d!\n",
+                        i, (int)sockets[i]);
+                    if (nb_recv == 0) {
+                        nb_recv = -1;
+                    }
+                    break;
+                }
+                for (int j = 0; j < nb_drained; j++) {
+                    slots[nb_recv + j].socket_rank = i;
+                }
+                nb_recv += nb_drained;
+            }
+        }
+    }
+
+    /* One timestamp for the whole batch */
+    *current_time = picoquic_current_time();
+
+    return nb_recv;
+}
+
+struct st_picoquic_poller_t {
+    int max_sockets;
+    SOCKET_TYPE* sockets;
+#if defined(__linux)
+    int epoll_fd;
+#else
+    fd_set readfds;
+    int sockmax;
+#endif
+};
+
+picoquic_poller_t* picoquic_poller_create(int max_sockets)
+{
+    picoquic_poller_t* poller;
+
+    if (max_sockets <= 0) {
+        DBG_PRINTF("Invalid poller size: %d\n", max_sockets);
+        return NULL;
+    }
+    poller = (picoquic_poller_t*)malloc(sizeof(picoquic_poller_t));
+
+    if (poller != NULL) {
+        memset(poller, 0, sizeof(picoquic_poller_t));
+        poller->max_sockets = max_sockets;
+        poller->sockets = (SOCKET_TYPE*)malloc(sizeof(SOCKET_TYPE) * max_sockets);
+#if defined(__linux)
+        poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (poller->epoll_fd < 0) {
+            DBG_PRINTF("epoll_create1 fails, errno: %d\n", errno);
+        }
+        if (poller->sockets == NULL || poller->epoll_fd < 0) {
+#else
+        FD_ZERO(&poller->readfds);
+        if (poller->sockets == NULL) {
+#endif
+            picoquic_poller_delete(poller);
+            poller = NULL;
+        }
+        else {
+            for (int i = 0; i < max_sockets; i++) {
+                poller->sockets[i] = INVALID_SOCKET;
+            }
+        }
+    }
+
+    return poller;
+}
+
+void picoquic_poller_delete(picoquic_poller_t* poller)
+{
+    if (poller != NULL) {
+#if defined(__linux)
+        if (poller->epoll_fd >= 0) {
+            close(poller->epoll_fd);
+        }
+#endif
+        free(poller->sockets);
+        free(poller);
+    }
+}
+
+int picoquic_poller_add(picoquic_poller_t* poller, SOCKET_TYPE fd)
+{
+    int rank = -1;
+
+    if (fd == INVALID_SOCKET || (int)fd < 0) {
+        return -1;
+    }
+#if !defined(__linux)
+    if ((int)fd >= FD_SETSIZE) {
+        DBG_PRINTF("Socket %d does not fit in an fd_set\n", (int)fd);
+        return -1;
+    }
+#endif
+    for (int i = 0; i < poller->max_sockets; i++) {
+        if (poller->sockets[i] == fd) {
+            DBG_PRINTF("Socket %d is already registered\n", (int)fd);
+            return -1;
+        }
+        if (rank < 0 && poller->sockets[i] == INVALID_SOCKET) {
+            rank = i;
+        }
+    }
+
+    if (rank >= 0) {
+#if defined(__linux)
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)rank;
+        if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            DBG_PRINTF("epoll_ctl ADD socket %d fails, errno: %d\n", (int)fd, errno);
+            return -1;
+        }
+#else
+        FD_SET(fd, &poller->readfds);
+        if (poller->sockmax < (int)fd) {
+            poller->sockmax = (int)fd;
+        }
+#endif
+        poller->sockets[rank] = fd;
+    }
+
+    return rank;
+}
+
+int picoquic_poller_remove(picoquic_poller_t* poller, SOCKET_TYPE fd)
+{
+    int ret = -1;
+
+    for (int i = 0; i < poller->max_sockets; i++) {
+        if (poller->sockets[i] == fd) {
+            poller->sockets[i] = INVALID_SOCKET;
+            ret = 0;
+            break;
+        }
+    }
+
+    if (ret == 0) {
+#if defined(__linux)
+        (void)epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+        FD_CLR(fd, &poller->readfds);
+        poller->sockmax = 0;
+        for (int i = 0; i < poller->max_sockets; i++) {
+            if (poller->sockets[i] != INVALID_SOCKET && poller->sockmax < (int)poller->sockets[i]) {
+                poller->sockmax = (int)poller->sockets[i];
+            }
+        }
+#endif
+    }
+
+    return ret;
+}
+
+SOCKET_TYPE picoquic_poller_get_socket(picoquic_poller_t* poller, int rank)
+{
+    return (rank >= 0 && rank < poller->max_sockets) ? poller->sockets[rank] : INVALID_SOCKET;
+}
+
+int picoquic_poller_wait(picoquic_poller_t* poller, int64_t delta_t, int* ready_ranks, int max_ready)
+{
+    int nb_ready = 0;
+
+    if (delta_t > 10000000) {
+        delta_t = 10000000;
+    }
+
+#if defined(__linux)
+    {
+        struct epoll_event events[PICOQUIC_RECV_BATCH_MAX];
+        /* Round up, so that a short wait does not turn into a busy loop */
+        int timeout_ms = (delta_t <= 0) ? 0 : (int)((delta_t + 999) / 1000);
+        int nb_events;
+
+        if (max_ready > PICOQUIC_RECV_BATCH_MAX) {
+            max_ready = PICOQUIC_RECV_BATCH_MAX;
+        }
+        nb_events = epoll_wait(poller->epoll_fd, events, max_ready, timeout_ms);
+        if (nb_events < 0) {
+            if (errno != EINTR) {
+                DBG_PRINTF("Error: epoll_wait returns %d, errno: %d\n", nb_events, errno);
+                nb_ready = -1;
+            }
+        }
+        else {
+            for (int i = 0; i < nb_events; i++) {
+                ready_ranks[nb_ready++] = (int)events[i].data.u32;
+            }
+        }
+    }
+#else
+    {
+        fd_set readfds;
+        struct timeval tv;
+        int ret_select;
+
+        /* Copy the prepared set instead of rebuilding it */
+        readfds = poller->readfds;
+        if (delta_t <= 0) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+        }
+        else {
+            tv.tv_sec = (long)(delta_t / 1000000);
+            tv.tv_usec = (long)(delta_t % 1000000);
+        }
+
+        ret_select = select(poller->sockmax + 1, &readfds, NULL, NULL, &tv);
+        if (ret_select < 0) {
+            DBG_PRINTF("Error: select returns %d\n", ret_select);
+            nb_ready = -1;
+        }
+        else {
+            for (int i = 0; ret_select > 0 && nb_ready < max_ready && i < poller->max_sockets; i++) {
+                if (poller->sockets[i] != INVALID_SOCKET && FD_ISSET(poller->sockets[i], &readfds)) {
+                    ready_ranks[nb_ready++] = i;
+                    ret_select--;
+                }
+            }
+        }
+    }
+#endif
+
+    return nb_ready;
+}
+
+int picoquic_poller_select_batch(picoquic_poller_t* poller,
+    picoquic_recv_slot_t* slots, int nb_slots,
+    int64_t delta_t, uint64_t* current_time)
+{
+    int ready_ranks[PICOQUIC_RECV_BATCH_MAX];
+    int nb_recv = 0;
+    int nb_ready = picoquic_poller_wait(poller, delta_t, ready_ranks, PICOQUIC_RECV_BATCH_MAX);
+
+    if (nb_ready < 0) {
+        nb_recv = -1;
+    }
+    for (int i = 0; i < nb_ready && nb_recv < nb_slots; i++) {
+        SOCKET_TYPE fd = poller->sockets[ready_ranks[i]];
+        int nb_drained;
+
+        if (fd == INVALID_SOCKET) {
+            continue;
+        }
+        nb_drained = picoquic_recvmsg_batch(fd, slots + nb_recv, nb_slots - nb_recv);
+        if (nb_drained < 0) {
+            DBG_PRINTF("Could not receive packets on UDP socket[%d]= %d!\n",
+                ready_ranks[i], (int)fd);
+            if (nb_recv == 0) {
+                nb_recv = -1;
+            }
+            break;
+        }
+        for (int j = 0; j < nb_drained; j++) {
+            slots[nb_recv + j].socket_rank = ready_ranks[i];
+        }
+        nb_recv += nb_drained;
+    }
+
+    *current_time = picoquic_current_time();
+
+    return nb_recv;
+}
+
+uint64_t picoquic_rx_time_or_current(uint64_t rx_time, uint64_t current_time, uint64_t last_time)
+{
+    /* Ignore time stamps from the future, or too old to be queueing delay,
+     * which happen if the system clock was changed. */
+    if (rx_time == 0 || rx_time > current_time || current_time - rx_time > PICOQUIC_RX_TIME_MAX_AGE) {
+        rx_time = current_time;
+    }
+    /* Packets may have arrived before the loop last called picoquic, which
+     * must not see its clock go backwards. */
+    return (rx_time < last_time) ? last_time : rx_time;
+}
+
+int picoquic_incoming_recv_slot(picoquic_quic_t* quic, picoquic_recv_slot_t* slot, int local_port,
+    picoquic_cnx_t** first_cnx, uint64_t current_time, uint64_t last_time)
+{
+    int ret = 0;
+    size_t segment_size = slot->udp_coalesced_size;
+    size_t length = (slot->bytes_recv > 0) ? (size_t)slot->bytes_recv : 0;
+
+    if (segment_size == 0 || segment_size > length) {
+        segment_size = length;
+    }
+    /* The packet info only carries the local address, not the port */
+    if (slot->addr_dest.ss_family == AF_INET6) {
+        ((struct sockaddr_in6*)&slot->addr_dest)->sin6_port = htons((unsigned short)local_port);
+    }
+    else if (slot->addr_dest.ss_family == AF_INET) {
+        ((struct sockaddr_in*)&slot->addr_dest)->sin_port = htons((unsigned short)local_port);
+    }
+
+    for (size_t offset = 0; offset < length; offset += segment_size) {
+        size_t packet_length = length - offset;
+        int packet_ret;
+
+        if (packet_length > segment_size) {
+            packet_length = segment_size;
+        }
+        packet_ret = picoquic_incoming_packet_ex(quic, slot->buffer + offset, packet_length,
+            (struct sockaddr*)&slot->addr_from, (struct sockaddr*)&slot->addr_dest,
+            slot->dest_if, slot->received_ecn, first_cnx,
+            picoquic_rx_time_or_current(slot->rx_time, current_time, last_time));
+        if (packet_ret != 0) {
+            /* A bad segment does not invalidate the other coalesced packets */
+            DBG_PRINTF("Could not process segment at offset %zu of %zu, ret = %d\n", offset, length, packet_ret);
+            if (ret == 0) {
+                ret = packet_ret;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int picoquic_select(SOCKET_TYPE* sockets,
+    int nb_sockets,
+    struct sockaddr_storage* addr_from,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    uint8_t* buffer, int buffer_max,
+    int64_t delta_t,
+    uint64_t* current_time) {
+    int socket_rank;
+    return picoquic_select_ex(sockets, nb_sockets, addr_from, addr_dest, dest_if,
+        received_ecn, buffer, buffer_max, delta_t, &socket_rank, current_time);
+}
+
+/* The picosocks API sends one datagram per call, without a segment size,
+ * so this path never uses GSO. Loops that prepare several packets for the
+ * same path use picoquic_gso_sender_add() or picoquic_send_through_socket_gso().
+ */
+int picoquic_send_through_socket(
+    SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from, int from_if,
+    const char* bytes, int length, int* sock_err)
+{
+    int sent = picoquic_sendmsg(fd, addr_dest, addr_from, from_if, bytes, length, 0, sock_err);
+
+    return sent;
+}
+
+int picoquic_send_through_socket_gso(
+    SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from, int from_if,
+    const char* bytes, int length, int segment_size,
+    int* gso_disabled, int* sock_err)
+{
+    return picoquic_send_through_socket_gso_txtime(fd, addr_dest, addr_from, from_if,
+        bytes, length, segment_size, 0, gso_disabled, sock_err);
+}
+
+int picoquic_send_through_socket_gso_txtime(
+    SOCKET_TYPE fd,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from, int from_if,
+    const char* bytes, int length, int segment_size,
+    uint64_t departure_time,
+    int* gso_disabled, int* sock_err)
+{
+    int sent = 0;
+
+    if (segment_size <= 0 || segment_size >= length) {
+        return picoquic_sendmsg_txtime(fd, addr_dest, addr_from, from_if, bytes, length, 0, departure_time, sock_err);
+    }
+
+#if defined(UDP_SEGMENT)
+    if (!*gso_disabled) {
+        int gso_err = 0;
+
+        sent = picoquic_sendmsg_txtime(fd, addr_dest, addr_from, from_if, bytes, length, segment_size,
+            departure_time, &gso_err);
+        if (sent > 0 || (gso_err != EIO && gso_err != EINVAL)) {
+            if (sent <= 0 && sock_err != NULL) {
+                *sock_err = gso_err;
+            }
+            return sent;
+        }
+        /* EIO means that the device does not support segmentation offload,
+         * EINVAL that the kernel does not know UDP_SEGMENT. Stop using GSO
+         * on this socket and send the packets one by one. */
+        DBG_PRINTF("UDP GSO rejected on socket %d, falling back to single packets\n", (int)fd);
+        *gso_disabled = 1;
+        sent = 0;
+    }
+#else
+    *gso_disabled = 1;
+#endif
+
+    for (int offset = 0; offset < length; offset += segment_size) {
+        int packet_length = length - offset;
+        int packet_sent;
+
+        if (packet_length > segment_size) {
+            packet_length = segment_size;
+        }
+        packet_sent = picoquic_sendmsg_txtime(fd, addr_dest, addr_from, from_if, bytes + offset, packet_length, 0,
+            departure_time, sock_err);
+        if (packet_sent <= 0) {
+            return (sent > 0) ? sent : packet_sent;
+        }
+        sent += packet_sent;
+    }
+
+    return sent;
+}
+
+void picoquic_gso_sender_init(picoquic_gso_sender_t* sender, SOCKET_TYPE fd,
+    uint8_t* buffer, size_t buffer_max)
+{
+    memset(sender, 0, sizeof(picoquic_gso_sender_t));
+    sender->fd = fd;
+    sender->buffer = buffer;
+    sender->buffer_max = buffer_max;
+}
+
+int picoquic_gso_sender_flush(picoquic_gso_sender_t* sender, int* sock_err)
+{
+    int ret = 0;
+
+    if (sender->length > 0) {
+        int sent = picoquic_send_through_socket_gso(sender->fd,
+            (struct sockaddr*)&sender->addr_dest, (struct sockaddr*)&sender->addr_from, sender->dest_if,
+            (const char*)sender->buffer, (int)sender->length, (int)sender->segment_size,
+            &sender->gso_disabled, sock_err);
+        if (sent <= 0) {
+            ret = -1;
+        }
+    }
+    sender->length = 0;
+    sender->segment_size = 0;
+    sender->nb_segments = 0;
+    sender->is_last_segment_short = 0;
+
+    return ret;
+}
+
+int picoquic_gso_sender_add(picoquic_gso_sender_t* sender,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int dest_if,
+    const uint8_t* bytes, size_t length, int* sock_err)
+{
+    int ret = 0;
+
+    if (length > sender->buffer_max) {
+        return -1;
+    }
+
+    if (sender->nb_segments > 0 && (
+        sender->is_last_segment_short ||
+        length > sender->segment_size ||
+        sender->nb_segments >= PICOQUIC_GSO_MAX_SEGMENTS ||
+        sender->length + length > sender->buffer_max ||
+        sender->dest_if != dest_if ||
+        !picoquic_stored_addr_is_same(&sender->addr_dest, addr_dest) ||
+        !picoquic_stored_addr_is_same(&sender->addr_from, addr_from))) {
+        ret = picoquic_gso_sender_flush(sender, sock_err);
+    }
+
+    if (sender->nb_segments == 0) {
+        memset(&sender->addr_dest, 0, sizeof(sender->addr_dest));
+        memcpy(&sender->addr_dest, addr_dest, picoquic_addr_length(addr_dest));
+        memset(&sender->addr_from, 0, sizeof(sender->addr_from));
+        if (addr_from != NULL && addr_from->sa_family != 0) {
+            memcpy(&sender->addr_from, addr_from, picoquic_addr_length(addr_from));
+        }
+        sender->dest_if = dest_if;
+        sender->segment_size = length;
+    }
+    else if (length < sender->segment_size) {
+        /* Only the last segment of a GSO buffer may be shorter */
+        sender->is_last_segment_short = 1;
+    }
+
+    memcpy(sender->buffer + sender->length, bytes, length);
+    sender->length += length;
+    sender->nb_segments++;
+
+    return ret;
+}
+
+void picoquic_send_template_init(picoquic_send_template_t* send_template)
+{
+    memset(send_template, 0, sizeof(picoquic_send_template_t));
+}
+
+void picoquic_send_template_invalidate(picoquic_send_template_t* send_template)
+{
+    send_template->is_valid = 0;
+}
+
+int picoquic_sendmsg_template(SOCKET_TYPE fd,
+    picoquic_send_template_t* send_template,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from,
+    int dest_if,
+    const char* bytes, int length,
+    int send_msg_size,
+    int* sock_err)
+{
+    int segment_size = (send_msg_size > 0 && send_msg_size < length) ? send_msg_size : 0;
+    int bytes_sent;
+
+    if (!send_template->is_valid || send_template->dest_if != dest_if ||
+        send_template->segment_size != segment_size ||
+        !picoquic_stored_addr_is_same(&send_template->addr_from, addr_from)) {
+        /* Path change: format the control data once for the new parameters */
+        memset(&send_template->msg, 0, sizeof(send_template->msg));
+        send_template->msg.msg_control = (void*)send_template->control.buf;
+        send_template->msg.msg_controllen = sizeof(send_template->control.buf);
+        picoquic_socks_cmsg_format(&send_template->msg, length, segment_size, addr_from, dest_if);
+
+        memset(&send_template->addr_from, 0, sizeof(send_template->addr_from));
+        if (addr_from != NULL && addr_from->sa_family != 0) {
+            memcpy(&send_template->addr_from, addr_from, picoquic_addr_length(addr_from));
+        }
+        send_template->dest_if = dest_if;
+        send_template->segment_size = segment_size;
+        send_template->is_valid = 1;
+    }
+
+    send_template->iov.iov_base = (char*)bytes;
+    send_template->iov.iov_len = length;
+    send_template->msg.msg_iov = &send_template->iov;
+    send_template->msg.msg_iovlen = 1;
+    send_template->msg.msg_name = addr_dest;
+    send_template->msg.msg_namelen = picoquic_addr_length(addr_dest);
+
+    bytes_sent = (picoquic_send_check_pmtu(addr_dest, length) == 0) ? sendmsg(fd, &send_template->msg, 0) : -1;
+
+    if (bytes_sent <= 0) {
+        int last_error = errno;
+        DBG_PRINTF("Could not send packet on UDP socket[AF=%d]= %d!\n",
+            addr_dest->sa_family, last_error);
+        picoquic_send_error_update_pmtu(addr_dest, length, send_msg_size, last_error);
+        if (sock_err != NULL) {
+            *sock_err = last_error;
+        }
+    }
+    return bytes_sent;
+}
+
+int picoquic_send_through_server_sockets(
+    picoquic_server_sockets_t* sockets,
+    struct sockaddr* addr_dest,
+    struct sockaddr* addr_from, int from_if,
+    const char* bytes, int length, int* sock_err)
+{
+    /* Sockets are opened in the order { AF_INET6, AF_INET } when IPv6 is available */
+    int rank = (PICOQUIC_SOCKS_HAS_IPV6 && addr_dest->sa_family == AF_INET) ? 1 : 0;
+
+    if (!picoquic_socket_af_is_supported(addr_dest->sa_family) ||
+        sockets->s_socket[rank] == INVALID_SOCKET) {
+        if (sock_err != NULL) {
+            *sock_err = EAFNOSUPPORT;
+        }
+        return -1;
+    }
+    return picoquic_send_through_socket(sockets->s_socket[rank], addr_dest, addr_from, from_if, bytes, length, sock_err);
+}
+
+static void picoquic_connected_socket_update_local(picoquic_connected_socket_t* connected)
+{
+    if (picoquic_get_local_address(connected->fd, &connected->local_addr) != 0) {
+        memset(&connected->local_addr, 0, sizeof(connected->local_addr));
+    }
+}
+
+int picoquic_connected_socket_open(picoquic_connected_socket_t* connected, int af)
+{
+    int recv_set = 0;
+    int send_set = 0;
+
+    memset(connected, 0, sizeof(picoquic_connected_socket_t));
+    connected->fd = picoquic_open_client_socket(af);
+    if (connected->fd == INVALID_SOCKET) {
+        return -1;
+    }
+    connected->af = af;
+
+    /* Called again for the result: picoquic_open_client_socket() does not report it */
+    (void)picoquic_socket_set_ecn_options(connected->fd, af, &recv_set, &send_set);
+    connected->ecn_recv_set = recv_set;
+    picoquic_connected_socket_update_local(connected);
+
+    return 0;
+}
+
+void picoquic_connected_socket_close(picoquic_connected_socket_t* connected)
+{
+    if (connected->fd != INVALID_SOCKET) {
+        SOCKET_CLOSE(connected->fd);
+        connected->fd = INVALID_SOCKET;
+    }
+    connected->peer_addr.ss_family = 0;
+    connected->local_addr.ss_family = 0;
+}
+
+int picoquic_connected_socket_connect(picoquic_connected_socket_t* connected, struct sockaddr* peer_addr)
+{
+    if (peer_addr->sa_family != connected->af) {
+        /* A socket cannot change its address family */
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    if (connect(connected->fd, peer_addr, picoquic_addr_length(peer_addr)) != 0) {
+        DBG_PRINTF("Cannot connect UDP socket %d (AF=%d), errno: %d\n",
+            (int)connected->fd, peer_addr->sa_family, errno);
+        return -1;
+    }
+
+    memset(&connected->peer_addr, 0, sizeof(connected->peer_addr));
+    memcpy(&connected->peer_addr, peer_addr, picoquic_addr_length(peer_addr));
+    /* connect() selects the route, and with it the local address */
+    picoquic_connected_socket_update_local(connected);
+
+    return 0;
+}
+
+int picoquic_connected_socket_disconnect(picoquic_connected_socket_t* connected)
+{
+    struct sockaddr unspec;
+
+    if (connected->peer_addr.ss_family == 0) {
+        return 0;
+    }
+
+    memset(&unspec, 0, sizeof(unspec));
+    unspec.sa_family = AF_UNSPEC;
+    if (connect(connected->fd, &unspec, sizeof(unspec)) != 0) {
+        DBG_PRINTF("Cannot disconnect UDP socket %d, errno: %d\n", (int)connected->fd, errno);
+        return -1;
+    }
+
+    connected->peer_addr.ss_family = 0;
+    picoquic_connected_socket_update_local(connected);
+
+    return 0;
+}
+
+int picoquic_connected_socket_update(picoquic_connected_socket_t* connected, picoquic_cnx_t* cnx)
+{
+    struct sockaddr* peer_addr = NULL;
+
+    if (cnx->nb_paths == 1 && cnx->path[0]->challenge_verified) {
+        picoquic_get_peer_addr(cnx, &peer_addr);
+    }
+    if (peer_addr == NULL || peer_addr->sa_family != connected->af) {
+        /* Probing, migrating, or not validated yet: keep the socket open to all peers */
+        return picoquic_connected_socket_disconnect(connected);
+    }
+    if (connected->peer_addr.ss_family != 0 &&
+        picoquic_compare_addr((struct sockaddr*)&connected->peer_addr, peer_addr) == 0) {
+        return 0;
+    }
+
+    return picoquic_connected_socket_connect(connected, peer_addr);
+}
+
+static int picoquic_connected_socket_is_local(picoquic_connected_socket_t* connected, struct sockaddr* addr_from)
+{
+    if (addr_from == NULL || addr_from->sa_family == 0) {
+        return 1;
+    }
+    if (addr_from->sa_family != connected->local_addr.ss_family) {
+        return 0;
+    }
+    if (addr_from->sa_family == AF_INET) {
+        return ((struct sockaddr_in*)addr_from)->sin_addr.s_addr ==
+            ((struct sockaddr_in*)&connected->local_addr)->sin_addr.s_addr;
+    }
+    return memcmp(&((struct sockaddr_in6*)addr_from)->sin6_addr,
+        &((struct sockaddr_in6*)&connected->local_addr)->sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+int picoquic_connected_socket_send(picoquic_connected_socket_t* connected,
+    struct sockaddr* addr_dest, struct sockaddr* addr_from, int from_if,
+    const char* bytes, int length, int* sock_err)
+{
+    int bytes_sent;
+
+    if (addr_dest->sa_family != connected->af) {
+        if (sock_err != NULL) {
+            *sock_err = EAFNOSUPPORT;
+        }
+        return -1;
+    }
+
+    if (connected->peer_addr.ss_family == 0 ||
+        picoquic_compare_addr((struct sockaddr*)&connected->peer_addr, addr_dest) != 0 ||
+        !picoquic_connected_socket_is_local(connected, addr_from)) {
+        /* Path probe or migration: leave the association to picoquic_connected_socket_update() */
+        return picoquic_sendmsg(connected->fd, addr_dest, addr_from, from_if, bytes, length, 0, sock_err);
+    }
+
+    bytes_sent = (picoquic_send_check_pmtu(addr_dest, length) == 0) ? send(connected->fd, bytes, length, 0) : -1;
+    if (bytes_sent <= 0) {
+        int last_error = errno;
+        DBG_PRINTF("Could not send packet on connected UDP socket[AF=%d]= %d!\n",
+            addr_dest->sa_family, last_error);
+        picoquic_send_error_update_pmtu(addr_dest, length, 0, last_error);
+        if (sock_err != NULL) {
+            *sock_err = last_error;
+        }
+    }
+
+    return bytes_sent;
+}
+
+int picoquic_connected_socket_recv(picoquic_connected_socket_t* connected,
+    struct sockaddr_storage* addr_from,
+    struct sockaddr_storage* addr_dest,
+    int* dest_if,
+    unsigned char* received_ecn,
+    uint8_t* buffer, int buffer_max)
+{
+    int bytes_recv;
+
+    if (connected->ecn_recv_set || connected->peer_addr.ss_family == 0) {
+        bytes_recv = picoquic_recvmsg(connected->fd, addr_from, addr_dest, dest_if, received_ecn, buffer, buffer_max);
+        if (bytes_recv > 0 && addr_dest != NULL && addr_dest->ss_family == 0) {
+            memcpy(addr_dest, &connected->local_addr, sizeof(struct sockaddr_storage));
+        }
+        return bytes_recv;
+    }
+
+    bytes_recv = recv(connected->fd, buffer, buffer_max, 0);
+    if (bytes_recv <= 0) {
+        addr_from->ss_family = 0;
+    }
+    else {
+        memcpy(addr_from, &connected->peer_addr, sizeof(struct sockaddr_storage));
+        if (addr_dest != NULL) {
+            memcpy(addr_dest, &connected->local_addr, sizeof(struct sockaddr_storage));
+        }
+        if (dest_if != NULL) {
+            *dest_if = 0;
+        }
+        if (received_ecn != NULL) {
+            *received_ecn = 0;
+        }
+    }
+
+    return bytes_recv;
+}
+
+static int picoquic_set_server_address(const struct sockaddr* addr, int server_port,
+    struct sockaddr_storage* server_address)
+{
+    memset(server_address, 0, sizeof(struct sockaddr_storage));
+    if (addr->sa_family == AF_INET) {
+        memcpy(server_address, addr, sizeof(struct sockaddr_in));
+        ((struct sockaddr_in*)server_address)->sin_port = htons((unsigned short)server_port);
+    }
+#if PICOQUIC_SOCKS_HAS_IPV6
+    else if (addr->sa_family == AF_INET6) {
+        memcpy(server_address, addr, sizeof(struct sockaddr_in6));
+        ((struct sockaddr_in6*)server_address)->sin6_port = htons((unsigned short)server_port);
+    }
+#endif
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Parse a numeric address. Returns 1 if the text is a valid address. */
+static int picoquic_parse_server_address(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_address)
+{
+    struct sockaddr_in* ipv4_dest = (struct sockaddr_in*)server_address;
+
+    memset(server_address, 0, sizeof(struct sockaddr_storage));
+    if (inet_pton(AF_INET, ip_address_text, &ipv4_dest->sin_addr) == 1) {
+        ipv4_dest->sin_family = AF_INET;
+        ipv4_dest->sin_port = htons((unsigned short)server_port);
+        return 1;
+    }
+#if PICOQUIC_SOCKS_HAS_IPV6
+    else {
+        struct sockaddr_in6* ipv6_dest = (struct sockaddr_in6*)server_address;
+        if (inet_pton(AF_INET6, ip_address_text, &ipv6_dest->sin6_addr) == 1) {
+            ipv6_dest->sin6_family = AF_INET6;
+            ipv6_dest->sin6_port = htons((unsigned short)server_port);
+            return 1;
+        }
+    }
+#endif
+    return 0;
+}
+
+/* Resolve the name with a single getaddrinfo() call for af, which may be
+ * AF_UNSPEC, and keep the first address of each family, preferred family
+ * first. lwIP's getaddrinfo() only returns one address type for AF_UNSPEC.
+ * Returns the number of addresses found.
+ */
+static int picoquic_resolve_server_addresses(const char* ip_address_text, int server_port, int af,
+    struct sockaddr_storage* server_addresses, int max_addresses, int prefer_ipv6)
+{
+    int ret;
+    int nb_addresses = 0;
+    struct addrinfo* result = NULL;
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = af;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+
+    if ((ret = getaddrinfo(ip_address_text, NULL, &hints, &result)) != 0) {
+        DBG_PRINTF("Cannot get IP address for %s (af=%d), err = %d (0x%x)\n", ip_address_text, af, ret, ret);
+    }
+    else {
+#if PICOQUIC_SOCKS_HAS_IPV6
+        const int family[2] = { (prefer_ipv6) ? AF_INET6 : AF_INET, (prefer_ipv6) ? AF_INET : AF_INET6 };
+        const int nb_af = 2;
+#else
+        const int family[1] = { AF_INET };
+        const int nb_af = 1;
+        (void)prefer_ipv6;
+#endif
+
+        for (int i = 0; i < nb_af && nb_addresses < max_addresses; i++) {
+            for (struct addrinfo* ai = result; ai != NULL; ai = ai->ai_next) {
+                if (ai->ai_family == family[i] &&
+                    picoquic_set_server_address(ai->ai_addr, server_port, &server_addresses[nb_addresses]) == 0) {
+                    nb_addresses++;
+                    break;
+                }
+            }
+        }
+        freeaddrinfo(result);
+    }
+
+    return nb_addresses;
+}
+
+static int picoquic_get_server_addresses_ex(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_addresses, int max_addresses, int* is_name, int prefer_ipv6, int single_query)
+{
+    int nb_addresses = 0;
+
+    *is_name = 0;
+    if (max_addresses <= 0) {
+        return 0;
+    }
+
+    if (picoquic_parse_server_address(ip_address_text, server_port, &server_addresses[0])) {
+        nb_addresses = 1;
+    }
+    else {
+#if PICOQUIC_SOCKS_HAS_IPV6 && !defined(__linux)
+        if (!single_query) {
+            /* One query per family, to get both from lwIP */
+            const int resolve_af[2] = { (prefer_ipv6) ? AF_INET6 : AF_INET, (prefer_ipv6) ? AF_INET : AF_INET6 };
+
+            for (int i = 0; i < 2 && nb_addresses < max_addresses; i++) {
+                nb_addresses += picoquic_resolve_server_addresses(ip_address_text, server_port, resolve_af[i],
+                    &server_addresses[nb_addresses], 1, prefer_ipv6);
+            }
+        }
+        else
+#else
+        (void)single_query;
+#endif
+        {
+            nb_addresses = picoquic_resolve_server_addresses(ip_address_text, server_port, AF_UNSPEC,
+                server_addresses, max_addresses, prefer_ipv6);
+        }
+        if (nb_addresses > 0) {
+            *is_name = 1;
+        }
+        else {
+            fprintf(stderr, "Cannot get IP address for %s\n", ip_address_text);
+        }
+    }
+
+    return nb_addresses;
+}
+
+int picoquic_get_server_addresses(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_addresses, int max_addresses, int* is_name)
+{
+    /* IPv6 first, as recommended for happy eyeballs (RFC 8305) */
+    return picoquic_get_server_addresses_ex(ip_address_text, server_port, server_addresses, max_addresses, is_name, 1, 0);
+}
+
+int picoquic_get_server_addresses_single_query(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_addresses, int max_addresses, int* is_name)
+{
+    return picoquic_get_server_addresses_ex(ip_address_text, server_port, server_addresses, max_addresses, is_name, 1, 1);
+}
+
+int picoquic_get_server_address(const char* ip_address_text, int server_port,
+    struct sockaddr_storage* server_address, int* is_name)
+{
+    /* Single address: keep preferring IPv4, and only use IPv6 for IPv6-only names */
+    return (picoquic_get_server_addresses_ex(ip_address_text, server_port, server_address, 1, is_name, 0, 0) == 1) ? 0 : -1;
 }
 
 /* Wireshark needs the session keys in order to decrypt and analyze packets.
@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Convert a picoquic ESP binary log dump to qlog (JSON, qlog 0.3).
+
+The dump is produced on the target by picoquic_esp_binlog_dump(). Input can
+be the raw binary dump, or a console capture where the application printed
+the dump as hex on lines starting with "binlog:".
+
+Usage: scripts/picoquic_binlog_to_qlog.py DUMP [-o OUT.qlog]
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b"PQBL"
+HEADER = struct.Struct("<4sHHIIQ")
+MAX_TRIGGERS = 16
+TRIGGER_LEN = 16
+RECORD = struct.Struct("<IBBBBIIQQQ")
+
+FLAG_RECEIVING = 0x01
+
+# picoquic_esp_binlog_event_enum
+EV_PDU = 1
+EV_PACKET = 2
+EV_DROPPED = 3
+EV_BUFFERED = 4
+EV_SENT = 5
+EV_LOST = 6
+EV_NEW_CONNECTION = 7
+EV_CLOSE_CONNECTION = 8
+EV_CC_DUMP = 9
+EV_APP_MESSAGE = 10
+
+# picoquic_packet_type_enum
+PACKET_TYPES = {
+    0: "unknown",
+    1: "version_negotiation",
+    2: "initial",
+    3: "retry",
+    4: "handshake",
+    5: "0RTT",
+    6: "1RTT",
+}
+
+
+def read_dump(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if data.startswith(MAGIC):
+        return data
+    # Console capture: concatenate the hex payload of the "binlog:" lines
+    chunks = []
+    for line in data.decode("utf-8", errors="replace").splitlines():
+        pos = line.find("binlog:")
+        if pos >= 0:
+            chunks.append(bytes.fromhex(line[pos + len("binlog:"):].strip()))
+    return b"".join(chunks)
+
+
+def parse_dump(data):
+    if len(data) < HEADER.size or not data.startswith(MAGIC):
+        raise ValueError("not a picoquic binary log dump")
+    magic, version, record_size, nb_records, head, dump_time = HEADER.unpack_from(data, 0)
+    if version != 1 or record_size != RECORD.size:
+        raise ValueError("unsupported dump version %d, record size %d" % (version, record_size))
+    offset = HEADER.size
+    triggers = []
+    for _ in range(MAX_TRIGGERS):
+        triggers.append(data[offset:offset + TRIGGER_LEN].split(b"\0", 1)[0].decode("ascii", errors="replace"))
+        offset += TRIGGER_LEN
+
+    records = []
+    for i in range(nb_records):
+        pos = offset + i * RECORD.size
+        if pos + RECORD.size > len(data):
+            break
+        seq, event, ptype, flags, arg, length, arg32, time, cid64, number = RECORD.unpack_from(data, pos)
+        # Skip empty slots and records caught being rewritten
+        if seq == 0 or ((head - (seq - 1)) & 0xFFFFFFFF) > nb_records:
+            continue
+        records.append({
+            "order": (head - seq) & 0xFFFFFFFF,
+            "event": event, "ptype": ptype, "flags": flags, "arg": arg,
+            "length": length, "arg32": arg32, "time": time, "cid64": cid64, "number": number,
+        })
+    # Oldest first
+    records.sort(key=lambda r: -r["order"])
+    return {"head": head, "dump_time": dump_time, "triggers": triggers, "records": records}
+
+
+def packet_type(ptype):
+    return PACKET_TYPES.get(ptype, "unknown")
+
+
+def to_qlog_event(rec, triggers, reference_time):
+    t = (rec["time"] - reference_time) / 1000.0
+    receiving = (rec["flags"] & FLAG_RECEIVING) != 0
+    ev = rec["event"]
+    if ev == EV_PDU:
+        name = "transport:datagrams_received" if receiving else "transport:datagrams_sent"
+        data = {"count": 1, "raw": [{"length": rec["length"]}]}
+    elif ev == EV_PACKET or ev == EV_SENT:
+        name = "transport:packet_received" if receiving else "transport:packet_sent"
+        data = {"header": {"packet_type": packet_type(rec["ptype"]), "packet_number": rec["number"]},
+                "raw": {"length": rec["length"]}}
+    elif ev == EV_DROPPED:
+        name = "transport:packet_dropped"
+        data = {"header": {"packet_type": packet_type(rec["ptype"]), "packet_number": rec["number"]},
+                "raw": {"length": rec["length"]}, "trigger": "error_%d" % rec["arg32"]}
+    elif ev == EV_BUFFERED:
+        name = "transport:packet_buffered"
+        data = {"header": {"packet_type": packet_type(rec["ptype"])}, "trigger": "keys_unavailable"}
+    elif ev == EV_LOST:
+        name = "recovery:packet_lost"
+        data = {"header": {"packet_type": packet_type(rec["ptype"]), "packet_number": rec["number"]}}
+        if rec["arg"] < len(triggers) and triggers[rec["arg"]]:
+            data["trigger"] = triggers[rec["arg"]]
+    elif ev == EV_NEW_CONNECTION:
+        name = "connectivity:connection_started"
+        data = {}
+    elif ev == EV_CLOSE_CONNECTION:
+        name = "connectivity:connection_closed"
+        data = {}
+    elif ev == EV_CC_DUMP:
+        name = "recovery:metrics_updated"
+        data = {"congestion_window": rec["number"], "bytes_in_flight": rec["length"],
+                "smoothed_rtt": rec["arg32"] / 1000.0, "cc_state": rec["arg"]}
+    elif ev == EV_APP_MESSAGE:
+        # The message is not formatted on the target, only its format string address is kept
+        name = "info:message"
+        data = {"message": "format string at 0x%x" % rec["number"]}
+    else:
+        name = "info:unknown_event"
+        data = {"event": ev}
+    return {"time": t, "name": name, "data": data}
+
+
+def to_qlog(dump, title):
+    traces = {}
+    for rec in dump["records"]:
+        traces.setdefault(rec["cid64"], []).append(rec)
+
+    qlog_traces = []
+    for cid64, records in traces.items():
+        reference_time = records[0]["time"]
+        vantage = "client"
+        for rec in records:
+            if rec["event"] == EV_NEW_CONNECTION:
+                vantage = "server" if (rec["flags"] & FLAG_RECEIVING) else "client"
+                break
+        qlog_traces.append({
+            "vantage_point": {"type": vantage},
+            "title": "cid64 %016x" % cid64,
+            "common_fields": {"group_id": "%016x" % cid64, "reference_time": reference_time / 1000.0,
+                              "time_format": "relative"},
+            "events": [to_qlog_event(rec, dump["triggers"], reference_time) for rec in records],
+        })
+
+    return {"qlog_version": "0.3", "qlog_format": "JSON", "title": title, "traces": qlog_traces}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("dump", help="binary dump, or console capture with binlog: hex lines")
+    parser.add_argument("-o", "--output", help="output qlog file (default: stdout)")
+    args = parser.parse_args()
+
+    try:
+        dump = parse_dump(read_dump(args.dump))
+    except (OSError, ValueError) as e:
+        print("error: %s" % e, file=sys.stderr)
+        return 1
+
+    qlog = to_qlog(dump, args.dump)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(qlog, f, indent=1)
+    else:
+        json.dump(qlog, sys.stdout, indent=1)
+        sys.stdout.write("\n")
+    print("%d records, %d connections" % (len(dump["records"]), len(qlog["traces"])), file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())